@@ -0,0 +1,744 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "./engine.h"
+#include "./blob.h"
+
+#define lock(lt, lk) ((lt) == l_read)? pthread_rwlock_rdlock(lk): pthread_rwlock_wrlock(lk)
+
+// The art engine is an adaptive radix tree. Keys are looked up one byte at a
+// time, counting the terminating '\0' as the last byte, so no key is a prefix
+// of another and a lookup costs O(key length) byte steps with no string
+// comparisons until it reaches a leaf. Inner nodes come in four sizes (4, 16,
+// 48 and 256 children) and grow or shrink as children come and go. A run of
+// bytes that every key below a node shares is stored once, in the node
+// (path compression), instead of as a chain of one-child nodes. Children are
+// kept in byte order, so walking the tree visits keys in lexicographic order.
+//
+// Queries lock hand over hand with read locks. Adds and removes lock hand
+// over hand with write locks, always holding the parent of the node they
+// are at, so that they can replace the node when it has to grow, shrink or
+// be split. Leaves have no lock; they are read and freed under their
+// parent's lock.
+
+enum node_type {NODE4, NODE16, NODE48, NODE256};
+
+typedef struct art_node {
+    pthread_rwlock_t lock;
+    uint8_t type;
+    uint16_t count;        // number of children
+    uint32_t prefix_len;   // the compressed path is stored after the node
+} art_node_t;
+
+typedef struct art_node4 {
+    art_node_t n;
+    unsigned char keys[4];     // sorted
+    art_node_t *children[4];
+} art_node4_t;
+
+typedef struct art_node16 {
+    art_node_t n;
+    unsigned char keys[16];    // sorted
+    art_node_t *children[16];
+} art_node16_t;
+
+typedef struct art_node48 {
+    art_node_t n;
+    unsigned char index[256];  // slot in children + 1, or 0 for none
+    art_node_t *children[48];
+} art_node48_t;
+
+typedef struct art_node256 {
+    art_node_t n;
+    art_node_t *children[256];
+} art_node256_t;
+
+// A leaf holds one name and its value, back to back. Pointers to leaves are
+// tagged with their low bit so they can sit among the children of a node.
+typedef struct art_leaf {
+    char *value;
+    char name[];
+} art_leaf_t;
+
+#define LEAF_TAG ((uintptr_t) 1)
+
+static const size_t node_size[] = {
+    sizeof(art_node4_t), sizeof(art_node16_t), sizeof(art_node48_t), sizeof(art_node256_t)
+};
+static const int node_capacity[] = {4, 16, 48, 256};
+
+// The root is never replaced and never freed (it's allocated in the data
+// region). It is a Node256 with no prefix, so it never grows or gets split.
+static art_node256_t root;
+
+// type for locking
+enum locktype {l_read, l_write};
+
+// locks a node, exiting if that would deadlock
+static inline void node_lock(art_node_t *node, enum locktype lt) {
+    if (lock(lt, &node->lock) == EDEADLK) {
+        fprintf(stderr, "%s\n", "lock failed. deadlock.");
+        exit(1);
+    }
+}
+
+// unlocks a node, exiting if it wasn't locked
+static inline void node_unlock(art_node_t *node) {
+    if (pthread_rwlock_unlock(&node->lock) == EPERM) {
+        fprintf(stderr, "%s\n", "unlock failed. wasn't locked");
+        exit(1);
+    }
+}
+
+static inline int is_leaf(art_node_t *ref) {
+    return ((uintptr_t) ref & LEAF_TAG) != 0;
+}
+
+static inline art_leaf_t *leaf_of(art_node_t *ref) {
+    return (art_leaf_t *) ((uintptr_t) ref & ~LEAF_TAG);
+}
+
+static inline art_node_t *leaf_ref(art_leaf_t *leaf) {
+    return (art_node_t *) ((uintptr_t) leaf | LEAF_TAG);
+}
+
+// returns the compressed path of a node
+static inline unsigned char *node_prefix(art_node_t *node) {
+    return (unsigned char *) node + node_size[node->type];
+}
+
+// constructs a leaf, or returns 0 if name or value is too long
+static art_leaf_t *leaf_constructor(char *name, char *value) {
+    size_t name_len = strlen(name);
+    size_t val_len = strlen(value);
+    art_leaf_t *leaf;
+
+    if (name_len > MAXLEN || val_len > MAXLEN)
+        return 0;
+
+    if ((leaf = (art_leaf_t *) malloc(sizeof(art_leaf_t) + name_len + val_len + 2)) == 0)
+        return 0;
+
+    memcpy(leaf->name, name, name_len + 1);
+    leaf->value = leaf->name + name_len + 1;
+    memcpy(leaf->value, value, val_len + 1);
+    return leaf;
+}
+
+// constructs an empty inner node, exiting if there is no memory left
+static art_node_t *node_constructor(enum node_type type, uint32_t prefix_len) {
+    art_node_t *node;
+
+    if ((node = (art_node_t *) calloc(1, node_size[type] + prefix_len)) == 0) {
+        perror("calloc");
+        exit(1);
+    }
+    pthread_rwlock_init(&node->lock, 0);
+    node->type = type;
+    node->prefix_len = prefix_len;
+    return node;
+}
+
+// destroys an inner node (but not its children)
+static void node_destructor(art_node_t *node) {
+    pthread_rwlock_destroy(&node->lock);
+    free(node);
+}
+
+// Returns the slot in node that holds the child for byte c, or 0 if there is
+// no such child.
+static art_node_t **find_child(art_node_t *node, unsigned char c) {
+    switch (node->type) {
+    case NODE4: {
+        art_node4_t *n = (art_node4_t *) node;
+        for (int i = 0; i < node->count; i++) {
+            if (n->keys[i] == c)
+                return &n->children[i];
+        }
+        return 0;
+    }
+    case NODE16: {
+        art_node16_t *n = (art_node16_t *) node;
+        for (int i = 0; i < node->count; i++) {
+            if (n->keys[i] == c)
+                return &n->children[i];
+        }
+        return 0;
+    }
+    case NODE48: {
+        art_node48_t *n = (art_node48_t *) node;
+        return n->index[c]? &n->children[n->index[c] - 1]: 0;
+    }
+    default: {
+        art_node256_t *n = (art_node256_t *) node;
+        return n->children[c]? &n->children[c]: 0;
+    }
+    }
+}
+
+// Fills bytes and children with the children of node in byte order and
+// returns how many there are.
+static int node_children(art_node_t *node, unsigned char *bytes, art_node_t **children) {
+    int count = 0;
+
+    switch (node->type) {
+    case NODE4:
+        memcpy(bytes, ((art_node4_t *) node)->keys, node->count);
+        memcpy(children, ((art_node4_t *) node)->children, node->count * sizeof(art_node_t *));
+        return node->count;
+    case NODE16:
+        memcpy(bytes, ((art_node16_t *) node)->keys, node->count);
+        memcpy(children, ((art_node16_t *) node)->children, node->count * sizeof(art_node_t *));
+        return node->count;
+    case NODE48: {
+        art_node48_t *n = (art_node48_t *) node;
+        for (int c = 0; c < 256; c++) {
+            if (n->index[c]) {
+                bytes[count] = (unsigned char) c;
+                children[count++] = n->children[n->index[c] - 1];
+            }
+        }
+        return count;
+    }
+    default: {
+        art_node256_t *n = (art_node256_t *) node;
+        for (int c = 0; c < 256; c++) {
+            if (n->children[c]) {
+                bytes[count] = (unsigned char) c;
+                children[count++] = n->children[c];
+            }
+        }
+        return count;
+    }
+    }
+}
+
+// adds a child for byte c to node, which must have room for it
+static void add_child(art_node_t *node, unsigned char c, art_node_t *child) {
+    switch (node->type) {
+    case NODE4:
+    case NODE16: {
+        unsigned char *keys;
+        art_node_t **children;
+        int i;
+        if (node->type == NODE4) {
+            keys = ((art_node4_t *) node)->keys;
+            children = ((art_node4_t *) node)->children;
+        } else {
+            keys = ((art_node16_t *) node)->keys;
+            children = ((art_node16_t *) node)->children;
+        }
+        for (i = 0; i < node->count && keys[i] < c; i++) {
+        }
+        memmove(&keys[i + 1], &keys[i], node->count - i);
+        memmove(&children[i + 1], &children[i], (node->count - i) * sizeof(art_node_t *));
+        keys[i] = c;
+        children[i] = child;
+        break;
+    }
+    case NODE48: {
+        art_node48_t *n = (art_node48_t *) node;
+        int slot = 0;
+        while (n->children[slot] != 0) {
+            slot++;
+        }
+        n->children[slot] = child;
+        n->index[c] = (unsigned char) (slot + 1);
+        break;
+    }
+    default:
+        ((art_node256_t *) node)->children[c] = child;
+        break;
+    }
+    node->count++;
+}
+
+// removes the child for byte c from node
+static void remove_child(art_node_t *node, unsigned char c) {
+    switch (node->type) {
+    case NODE4:
+    case NODE16: {
+        unsigned char *keys;
+        art_node_t **children;
+        int i;
+        if (node->type == NODE4) {
+            keys = ((art_node4_t *) node)->keys;
+            children = ((art_node4_t *) node)->children;
+        } else {
+            keys = ((art_node16_t *) node)->keys;
+            children = ((art_node16_t *) node)->children;
+        }
+        for (i = 0; keys[i] != c; i++) {
+        }
+        memmove(&keys[i], &keys[i + 1], node->count - i - 1);
+        memmove(&children[i], &children[i + 1], (node->count - i - 1) * sizeof(art_node_t *));
+        break;
+    }
+    case NODE48: {
+        art_node48_t *n = (art_node48_t *) node;
+        n->children[n->index[c] - 1] = 0;
+        n->index[c] = 0;
+        break;
+    }
+    default:
+        ((art_node256_t *) node)->children[c] = 0;
+        break;
+    }
+    node->count--;
+}
+
+// Returns a new node of the given type with the same children as node and
+// the given compressed path. node itself is left alone.
+static art_node_t *node_resize(art_node_t *node, enum node_type type,
+        unsigned char *prefix, uint32_t prefix_len) {
+    unsigned char bytes[256];
+    art_node_t *children[256];
+    int count = node_children(node, bytes, children);
+    art_node_t *copy = node_constructor(type, prefix_len);
+
+    memcpy(node_prefix(copy), prefix, prefix_len);
+    for (int i = 0; i < count; i++) {
+        add_child(copy, bytes[i], children[i]);
+    }
+    return copy;
+}
+
+// returns how many bytes of node's compressed path match key from depth on
+static inline uint32_t prefix_match(art_node_t *node, const unsigned char *key, size_t depth) {
+    unsigned char *prefix = node_prefix(node);
+    uint32_t i;
+
+    for (i = 0; i < node->prefix_len && prefix[i] == key[depth + i]; i++) {
+    }
+    return i;
+}
+
+// Queries for a key.
+static void art_query(char *name, char *result, int len) {
+    const unsigned char *key = (const unsigned char *) name;
+    art_node_t *node = &root.n;
+    art_node_t **slot;
+    art_node_t *child;
+    size_t depth = 0;
+
+    node_lock(node, l_read);
+    while (1) {
+        if (prefix_match(node, key, depth) != node->prefix_len)
+            break;
+        depth += node->prefix_len;
+        if ((slot = find_child(node, key[depth])) == 0)
+            break;
+        child = *slot;
+        if (is_leaf(child)) {
+            // leaves are freed under their parent's write lock
+            if (strcmp(leaf_of(child)->name, name) == 0) {
+                snprintf(result, len, "%s", leaf_of(child)->value);
+                node_unlock(node);
+                return;
+            }
+            break;
+        }
+        node_lock(child, l_read);
+        node_unlock(node);
+        node = child;
+        depth++;
+    }
+    result[0] = '\0';
+    node_unlock(node);
+}
+
+// Adds a new key into the tree. parent is write-locked along with node, so
+// that node can be replaced in its slot in parent (link).
+static int art_add(char *name, char *value) {
+    const unsigned char *key = (const unsigned char *) name;
+    art_node_t *parent = 0;
+    art_node_t **link = 0;
+    art_node_t *node = &root.n;
+    art_node_t **slot;
+    art_node_t *child;
+    art_node_t *split;
+    art_leaf_t *leaf;
+    size_t depth = 0;
+    uint32_t match;
+    int added = 1;
+
+    if ((leaf = leaf_constructor(name, value)) == 0)
+        return 0;
+
+    node_lock(node, l_write);
+    while (1) {
+        match = prefix_match(node, key, depth);
+        if (match != node->prefix_len) {
+            // The key leaves node's compressed path part way: split the path
+            // with a new node that has node and the new leaf as children.
+            unsigned char *prefix = node_prefix(node);
+            split = node_constructor(NODE4, match);
+            memcpy(node_prefix(split), prefix, match);
+            add_child(split, prefix[match], node);
+            add_child(split, key[depth + match], leaf_ref(leaf));
+            node->prefix_len -= match + 1;
+            memmove(prefix, prefix + match + 1, node->prefix_len);
+            *link = split;
+            break;
+        }
+        depth += node->prefix_len;
+
+        if ((slot = find_child(node, key[depth])) == 0) {
+            if (node->count == node_capacity[node->type]) {
+                art_node_t *grown = node_resize(node, node->type + 1,
+                        node_prefix(node), node->prefix_len);
+                add_child(grown, key[depth], leaf_ref(leaf));
+                *link = grown;
+                node_unlock(node);
+                node_destructor(node);
+                node_unlock(parent);
+                return 1;
+            }
+            add_child(node, key[depth], leaf_ref(leaf));
+            break;
+        }
+
+        child = *slot;
+        if (is_leaf(child)) {
+            // Two keys now share the bytes up to here: replace the leaf with
+            // a node for the bytes they share after this one, holding both.
+            const unsigned char *other = (const unsigned char *) leaf_of(child)->name;
+            size_t common = 0;
+            if (strcmp(leaf_of(child)->name, name) == 0) {
+                free(leaf);
+                added = 0;
+                break;
+            }
+            depth++;
+            while (key[depth + common] == other[depth + common]) {
+                common++;
+            }
+            split = node_constructor(NODE4, (uint32_t) common);
+            memcpy(node_prefix(split), key + depth, common);
+            add_child(split, other[depth + common], child);
+            add_child(split, key[depth + common], leaf_ref(leaf));
+            *slot = split;
+            break;
+        }
+
+        node_lock(child, l_write);
+        if (parent != 0)
+            node_unlock(parent);
+        parent = node;
+        link = slot;
+        node = child;
+        depth++;
+    }
+
+    node_unlock(node);
+    if (parent != 0)
+        node_unlock(parent);
+    return added;
+}
+
+// Called by art_remove after a child has been removed from node, with node
+// and its parent write-locked. Replaces node in its slot in parent (link)
+// with a smaller node if it has few children left, or with its only child if
+// it has just one. Returns the node that was replaced, or 0 if there was
+// none; the caller must free it.
+static art_node_t *node_shrink(art_node_t *node, art_node_t **link) {
+    static const int shrink_at[] = {1, 3, 12, 40};
+    unsigned char byte;
+    art_node_t *child;
+
+    if (node == &root.n || node->count > shrink_at[node->type])
+        return 0;
+
+    if (node->type != NODE4) {
+        *link = node_resize(node, node->type - 1, node_prefix(node), node->prefix_len);
+        return node;
+    }
+
+    // One child left: merge node's compressed path, the child's byte and the
+    // child's own path into a copy of the child.
+    node_children(node, &byte, &child);
+    if (!is_leaf(child)) {
+        unsigned char prefix[2 * MAXLEN + 2];
+        uint32_t prefix_len = node->prefix_len + 1 + child->prefix_len;
+        node_lock(child, l_write);
+        memcpy(prefix, node_prefix(node), node->prefix_len);
+        prefix[node->prefix_len] = byte;
+        memcpy(prefix + node->prefix_len + 1, node_prefix(child), child->prefix_len);
+        *link = node_resize(child, child->type, prefix, prefix_len);
+        node_unlock(child);
+        node_destructor(child);
+    } else {
+        *link = child;
+    }
+    return node;
+}
+
+// removes the input argument from the tree
+static int art_remove(char *name) {
+    const unsigned char *key = (const unsigned char *) name;
+    art_node_t *parent = 0;
+    art_node_t **link = 0;
+    art_node_t *node = &root.n;
+    art_node_t *replaced = 0;
+    art_node_t **slot;
+    art_node_t *child;
+    size_t depth = 0;
+    int removed = 0;
+
+    node_lock(node, l_write);
+    while (1) {
+        if (prefix_match(node, key, depth) != node->prefix_len)
+            break;
+        depth += node->prefix_len;
+        if ((slot = find_child(node, key[depth])) == 0)
+            break;
+        child = *slot;
+        if (is_leaf(child)) {
+            if (strcmp(leaf_of(child)->name, name) == 0) {
+                remove_child(node, key[depth]);
+                free(leaf_of(child));
+                replaced = node_shrink(node, link);
+                removed = 1;
+            }
+            break;
+        }
+        node_lock(child, l_write);
+        if (parent != 0)
+            node_unlock(parent);
+        parent = node;
+        link = slot;
+        node = child;
+        depth++;
+    }
+
+    node_unlock(node);
+    if (replaced != 0)
+        node_destructor(replaced);
+    if (parent != 0)
+        node_unlock(parent);
+    return removed;
+}
+
+// Arguments of art_scan_recurs that stay the same all the way down.
+typedef struct art_scan {
+    const unsigned char *start;
+    char *end;
+    int (*visit)(void *, char *, char *);
+    void *arg;
+} art_scan_t;
+
+/* Recursively visits the keys below node that are in the scan's range, in
+ * order, and returns 1 once the scan is over. bound is set while the bytes
+ * on the way to node (depth of them) are the same as the start's, and so
+ * some keys below node may come before it. The caller holds node's read
+ * lock; only the locks on the way down to the node being read are held. */
+static int art_scan_recurs(art_node_t *node, size_t depth, int bound, art_scan_t *scan) {
+    unsigned char bytes[256];
+    art_node_t *children[256];
+    unsigned char *prefix = node_prefix(node);
+    int count;
+    int stop = 0;
+
+    if (bound) {
+        for (uint32_t i = 0; i < node->prefix_len; i++) {
+            if (prefix[i] != scan->start[depth + i]) {
+                if (prefix[i] < scan->start[depth + i])
+                    return 0;  // every key below node comes before start
+                bound = 0;
+                break;
+            }
+        }
+    }
+    depth += node->prefix_len;
+
+    count = node_children(node, bytes, children);
+    for (int i = 0; i < count && !stop; i++) {
+        if (bound && bytes[i] < scan->start[depth])
+            continue;
+        if (is_leaf(children[i])) {
+            art_leaf_t *leaf = leaf_of(children[i]);
+            if (bound && strcmp(leaf->name, (const char *) scan->start) < 0)
+                continue;
+            stop = (scan->end != 0 && strcmp(leaf->name, scan->end) >= 0)
+                    || scan->visit(scan->arg, leaf->name, leaf->value);
+        } else {
+            node_lock(children[i], l_read);
+            stop = art_scan_recurs(children[i], depth + 1, bound && bytes[i] == scan->start[depth], scan);
+            node_unlock(children[i]);
+        }
+    }
+    return stop;
+}
+
+// Visits the keys from start up to end in order.
+static void art_scan(char *start, char *end, int (*visit)(void *, char *, char *), void *arg) {
+    art_scan_t scan = {(const unsigned char *) start, end, visit, arg};
+
+    node_lock(&root.n, l_read);
+    art_scan_recurs(&root.n, 0, 1, &scan);
+    node_unlock(&root.n);
+}
+
+/* Recursively builds the subtree for n sorted entries that share their first
+ * depth bytes, and returns a reference to it. The bytes all the entries share
+ * after that become the node's compressed path, and the entries are split
+ * into runs by the byte after the path, one child each. */
+static art_node_t *art_build(db_entry_t *entries, size_t n, size_t depth) {
+    const unsigned char *first = (const unsigned char *) entries[0].name;
+    const unsigned char *last = (const unsigned char *) entries[n - 1].name;
+    art_leaf_t *leaf;
+    art_node_t *node;
+    uint32_t common = 0;
+    int count = 0;
+    int type = NODE4;
+
+    if (n == 1) {
+        if ((leaf = leaf_constructor(entries[0].name, entries[0].value)) == 0) {
+            fprintf(stderr, "%s\n", "load: key too long");
+            exit(1);
+        }
+        return leaf_ref(leaf);
+    }
+
+    // The entries are sorted, so the first and the last share the least.
+    while (first[depth + common] == last[depth + common]) {
+        common++;
+    }
+    depth += common;
+    for (size_t i = 0; i < n; i++) {
+        if (i == 0 || entries[i].name[depth] != entries[i - 1].name[depth])
+            count++;
+    }
+    while (node_capacity[type] < count) {
+        type++;
+    }
+
+    node = node_constructor(type, common);
+    memcpy(node_prefix(node), first + depth - common, common);
+    for (size_t from = 0, to; from < n; from = to) {
+        unsigned char byte = (unsigned char) entries[from].name[depth];
+        for (to = from + 1; to < n && (unsigned char) entries[to].name[depth] == byte; to++) {
+        }
+        add_child(node, byte, art_build(entries + from, to - from, depth + 1));
+    }
+    return node;
+}
+
+// Arguments of load_byte.
+typedef struct art_load {
+    db_entry_t *entries;
+    size_t start[257];  // where the entries starting with each byte begin
+} art_load_t;
+
+// builds the subtree under the root for the entries that start with byte
+static void load_byte(void *arg, int byte) {
+    art_load_t *load = (art_load_t *) arg;
+    size_t from = load->start[byte];
+    size_t to = load->start[byte + 1];
+
+    if (to > from)
+        root.children[byte] = art_build(load->entries + from, to - from, 1);
+}
+
+/* Builds the tree from sorted entries without any locking, one subtree of
+ * the root per first byte, in parallel. The tree must be empty and nobody
+ * else may be using it. */
+static void art_load(db_entry_t *entries, size_t n) {
+    art_load_t load;
+    size_t e = 0;
+
+    load.entries = entries;
+    for (int byte = 0; byte <= 256; byte++) {
+        load.start[byte] = e;
+        while (byte < 256 && e < n && (unsigned char) entries[e].name[0] == byte) {
+            e++;
+        }
+    }
+    engine_parallel(256, load_byte, &load);
+    for (int byte = 0; byte < 256; byte++) {
+        if (root.children[byte] != 0)
+            root.n.count++;
+    }
+}
+
+static inline void print_spaces(int lvl, FILE *out) {
+    for (int i = 0; i < lvl; i++) {
+        fprintf(out, " ");
+    }
+}
+
+/* Recursively prints every key below node in order, indented by the depth
+ * of its leaf. The caller holds node's read lock. */
+static void art_print_recurs(art_node_t *node, int lvl, FILE *out) {
+    unsigned char bytes[256];
+    art_node_t *children[256];
+    int count = node_children(node, bytes, children);
+
+    for (int i = 0; i < count; i++) {
+        if (is_leaf(children[i])) {
+            print_spaces(lvl, out);
+            fprintf(out, "%s %s\n", leaf_of(children[i])->name,
+                    blob_value(leaf_of(children[i])->value));
+        } else {
+            node_lock(children[i], l_read);
+            art_print_recurs(children[i], lvl + 1, out);
+            node_unlock(children[i]);
+        }
+    }
+}
+
+static void art_print(FILE *out) {
+    fprintf(out, "(art)\n");
+    node_lock(&root.n, l_read);
+    art_print_recurs(&root.n, 1, out);
+    node_unlock(&root.n);
+}
+
+/* Recursively destroys every child of node. */
+static void art_cleanup_recurs(art_node_t *node) {
+    unsigned char bytes[256];
+    art_node_t *children[256];
+    int count = node_children(node, bytes, children);
+
+    for (int i = 0; i < count; i++) {
+        if (is_leaf(children[i])) {
+            free(leaf_of(children[i]));
+        } else {
+            art_cleanup_recurs(children[i]);
+            node_destructor(children[i]);
+        }
+    }
+}
+
+/* Sets up the root. */
+static void art_init(void) {
+    pthread_rwlock_init(&root.n.lock, 0);
+    root.n.type = NODE256;
+    root.n.count = 0;
+    root.n.prefix_len = 0;
+    memset(root.children, 0, sizeof(root.children));
+}
+
+/* Destroys every node other than the root.
+ * No threads should be using the database when this is called. */
+static void art_cleanup(void) {
+    art_cleanup_recurs(&root.n);
+    root.n.count = 0;
+    memset(root.children, 0, sizeof(root.children));
+}
+
+db_engine_t art_engine = {
+    "art",
+    art_init,
+    art_query,
+    art_add,
+    art_remove,
+    art_scan,
+    art_load,
+    art_print,
+    art_cleanup,
+    0, 0, 0  // batches run one key at a time
+};
@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "./db.h"
+#include "./keysearch.h"
+
+#define KEYLEN 32
+#define RESPLEN 256
+#define NODEKEYS 31       // keys in a full btree node
+#define NODESETS 16384    // nodes to search in
+#define TARGETS 65536     // distinct lookups, repeated
+#define LOOKUPS 4000000   // lookups per in-node search run
+#define CHURN_SECONDS 2   // length of a connection churn run
+
+/*
+ * Benchmark for the database engine. Inserts the same set of keys in sorted
+ * and in random order through interpret_command, then queries every key and
+ * as many keys that aren't there, and reports the throughput of each phase.
+ * It then adds and removes as many new keys, one after the other (churn), and
+ * runs both queries again.
+ * With -f, the database has a filter for the keys in front of the engine, and
+ * with -x a hash index of them next to it; their statistics are printed after
+ * each order.
+ *
+ * With -s, it instead times finding a key among the keys of one full btree
+ * node: with a chain of strcmp calls down a binary tree of separately
+ * allocated nodes, the way the tree engine searches, and with the inline
+ * prefixes of a btree node, both scalar and with SIMD.
+ *
+ * With -c, it instead measures connection churn against a server running on
+ * this machine: it holds a number of idle connections open and has a number
+ * of threads connect, run one query and disconnect, over and over, and
+ * reports the connections per second.
+ *
+ * Usage: bench [-f] [-x] [<number of keys> [<engine>]]
+ *        bench -s
+ *        bench -c <port> [<idle connections> [<threads>]]
+ */
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// fills keys with "key%08d" for 0 <= i < nkeys, in sorted order
+static char (*make_keys(int nkeys))[KEYLEN] {
+    char (*keys)[KEYLEN] = malloc(sizeof(*keys) * nkeys);
+    if (keys == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < nkeys; i++) {
+        snprintf(keys[i], KEYLEN, "key%08d", i);
+    }
+    return keys;
+}
+
+static void shuffle_keys(char (*keys)[KEYLEN], int nkeys) {
+    char tmp[KEYLEN];
+    srand(42);
+    for (int i = nkeys - 1; i > 0; i--) {
+        int j = rand() % (i + 1);
+        memcpy(tmp, keys[i], KEYLEN);
+        memcpy(keys[i], keys[j], KEYLEN);
+        memcpy(keys[j], tmp, KEYLEN);
+    }
+}
+
+// set by -f and -x
+static int filtered;
+static int indexed;
+
+// runs one command per key and returns the number of commands per second;
+// op 'm' queries for each key with an 'x' after it, which isn't there, and
+// op 'c' adds and removes each key with a 'c' after it
+static double run_phase(char op, char (*keys)[KEYLEN], int nkeys) {
+    char command[RESPLEN];
+    char response[RESPLEN];
+    double start = now();
+
+    for (int i = 0; i < nkeys; i++) {
+        if (op == 'a') {
+            snprintf(command, sizeof(command), "a %s %s\n", keys[i], keys[i]);
+        } else if (op == 'm') {
+            snprintf(command, sizeof(command), "q %sx\n", keys[i]);
+        } else if (op == 'c') {
+            snprintf(command, sizeof(command), "a %sc %s\n", keys[i], keys[i]);
+            interpret_command(command, response, sizeof(response), 0);
+            snprintf(command, sizeof(command), "d %sc\n", keys[i]);
+        } else {
+            snprintf(command, sizeof(command), "%c %s\n", op, keys[i]);
+        }
+        interpret_command(command, response, sizeof(response), 0);
+    }
+
+    return nkeys / (now() - start);
+}
+
+static void run_order(const char *label, char (*keys)[KEYLEN], int nkeys) {
+    if (filtered)
+        db_filter(nkeys);
+    if (indexed)
+        db_index(nkeys);
+    double add = run_phase('a', keys, nkeys);
+    double query = run_phase('q', keys, nkeys);
+    double miss = run_phase('m', keys, nkeys);
+    double churn = 2 * run_phase('c', keys, nkeys);
+    double query_after = run_phase('q', keys, nkeys);
+    double miss_after = run_phase('m', keys, nkeys);
+    printf("%-8s %12.0f %12.0f %12.0f %12.0f %12.0f %12.0f\n", label, add, query, miss,
+            churn, query_after, miss_after);
+    if (filtered || indexed)
+        db_stats(stdout);
+    db_cleanup();
+}
+
+// a binary tree node with its own allocation for the name, like node_t
+typedef struct chain_node {
+    char *name;
+    struct chain_node *lchild;
+    struct chain_node *rchild;
+} chain_node_t;
+
+// the keys of one full btree node, laid out the way btree.c keeps them
+typedef struct wide_node {
+    uint64_t prefix[NODEKEYS + 1];
+    char *names[NODEKEYS + 1];
+} wide_node_t;
+
+// builds a balanced binary tree over the sorted keys[lo..hi)
+static chain_node_t *chain_build(char (*keys)[KEYLEN], int lo, int hi) {
+    chain_node_t *node;
+    int mid = (lo + hi) / 2;
+
+    if (lo >= hi)
+        return NULL;
+    if ((node = malloc(sizeof(chain_node_t))) == NULL || (node->name = strdup(keys[mid])) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    node->lchild = chain_build(keys, lo, mid);
+    node->rchild = chain_build(keys, mid + 1, hi);
+    return node;
+}
+
+static int by_name(const void *a, const void *b) {
+    return strcmp((const char *) a, (const char *) b);
+}
+
+// returns the depth at which name is found, walking down with strcmp
+static int chain_search(chain_node_t *node, char *name) {
+    int depth = 0;
+    int cmp;
+
+    while (node != NULL && (cmp = strcmp(name, node->name)) != 0) {
+        node = (cmp < 0)? node->lchild: node->rchild;
+        depth++;
+    }
+    return depth;
+}
+
+// returns the index of name in a wide node, like node_search in btree.c
+static int wide_search(int (*rank)(const uint64_t *, int, uint64_t),
+        wide_node_t *node, uint64_t prefix, char *name) {
+    int i = rank(node->prefix, NODEKEYS, prefix);
+
+    for (; i < NODEKEYS && node->prefix[i] == prefix && strcmp(node->names[i], name) < 0; i++) {
+    }
+    return i;
+}
+
+/* Times LOOKUPS searches in NODESETS sets of NODEKEYS random keys and prints
+ * ns per search. There are enough sets that they don't all fit in cache. As
+ * in btree.c, the prefix of the key being searched for is computed once,
+ * outside the search. */
+static void run_search(void) {
+    char (*keys)[NODEKEYS][KEYLEN] = malloc(sizeof(*keys) * NODESETS);
+    chain_node_t **chains = malloc(sizeof(chain_node_t *) * NODESETS);
+    wide_node_t *nodes = malloc(sizeof(wide_node_t) * NODESETS);
+    int *sets = malloc(sizeof(int) * TARGETS);
+    char **targets = malloc(sizeof(char *) * TARGETS);
+    uint64_t *prefixes = malloc(sizeof(uint64_t) * TARGETS);
+    long sink = 0;
+    double start;
+
+    if (keys == NULL || chains == NULL || nodes == NULL || sets == NULL ||
+            targets == NULL || prefixes == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    srand(42);
+    for (int s = 0; s < NODESETS; s++) {
+        for (int i = 0; i < NODEKEYS; i++) {
+            for (int j = 0; j < 12; j++) {
+                keys[s][i][j] = 'a' + rand() % 26;
+            }
+            keys[s][i][12] = '\0';
+        }
+        qsort(keys[s], NODEKEYS, KEYLEN, by_name);
+        chains[s] = chain_build(keys[s], 0, NODEKEYS);
+        for (int i = 0; i < NODEKEYS; i++) {
+            if ((nodes[s].names[i] = strdup(keys[s][i])) == NULL) {
+                perror("strdup");
+                exit(1);
+            }
+            nodes[s].prefix[i] = key_prefix(keys[s][i]);
+        }
+    }
+    for (int t = 0; t < TARGETS; t++) {
+        sets[t] = rand() % NODESETS;
+        targets[t] = keys[sets[t]][rand() % NODEKEYS];
+        prefixes[t] = key_prefix(targets[t]);
+    }
+
+    printf("%d keys per node, %d nodes\n%-8s %12s\n", NODEKEYS, NODESETS, "search", "ns/search");
+
+    start = now();
+    for (int i = 0; i < LOOKUPS; i++) {
+        int t = i % TARGETS;
+        sink += chain_search(chains[sets[t]], targets[t]);
+    }
+    printf("%-8s %12.1f\n", "strcmp", (now() - start) * 1e9 / LOOKUPS);
+
+    start = now();
+    for (int i = 0; i < LOOKUPS; i++) {
+        int t = i % TARGETS;
+        sink += wide_search(prefix_rank_scalar, &nodes[sets[t]], prefixes[t], targets[t]);
+    }
+    printf("%-8s %12.1f\n", "scalar", (now() - start) * 1e9 / LOOKUPS);
+
+    if (prefix_rank_avx2_supported()) {
+        start = now();
+        for (int i = 0; i < LOOKUPS; i++) {
+            int t = i % TARGETS;
+            sink += wide_search(prefix_rank_avx2, &nodes[sets[t]], prefixes[t], targets[t]);
+        }
+        printf("%-8s %12.1f\n", "avx2", (now() - start) * 1e9 / LOOKUPS);
+    }
+
+    if (sink == 0)
+        printf("\n");
+}
+
+// connects to the server on this machine at port, exiting if it can't
+static int churn_connect(int port) {
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0
+            || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// Arguments of churn_loop.
+typedef struct churn {
+    int port;
+    double end;
+    long connections;
+} churn_t;
+
+// Code executed by the churning threads: connects, queries a key and
+// disconnects until the time is up.
+static void *churn_loop(void *arg) {
+    churn_t *churn = (churn_t *) arg;
+    char command[] = "q churn\n";
+    char response[RESPLEN];
+
+    while (now() < churn->end) {
+        int fd = churn_connect(churn->port);
+        ssize_t len;
+
+        if (write(fd, command, sizeof(command) - 1) != sizeof(command) - 1) {
+            perror("write");
+            exit(1);
+        }
+        // the response is one line
+        while ((len = read(fd, response, sizeof(response))) > 0 && response[len - 1] != '\n') {
+        }
+        if (len <= 0) {
+            fprintf(stderr, "bench: connection dropped\n");
+            exit(1);
+        }
+        close(fd);
+        churn->connections++;
+    }
+    return NULL;
+}
+
+/* Holds idle connections open to the server at port and has nthreads
+ * threads open and close connections for CHURN_SECONDS, then prints how many
+ * they got through per second. */
+static void run_churn(int port, int idle, int nthreads) {
+    int *fds = malloc(sizeof(int) * (idle + 1));
+    pthread_t *threads = malloc(sizeof(pthread_t) * nthreads);
+    churn_t *churns = malloc(sizeof(churn_t) * nthreads);
+    long total = 0;
+    double start;
+
+    if (fds == NULL || threads == NULL || churns == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < idle; i++) {
+        fds[i] = churn_connect(port);
+    }
+
+    start = now();
+    for (int i = 0; i < nthreads; i++) {
+        churns[i].port = port;
+        churns[i].end = start + CHURN_SECONDS;
+        churns[i].connections = 0;
+        if (pthread_create(&threads[i], 0, churn_loop, &churns[i])) {
+            fprintf(stderr, "bench: pthread_create failed\n");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+        total += churns[i].connections;
+    }
+    printf("%d idle connections, %d threads: %.0f connections/s\n",
+            idle, nthreads, total / (now() - start));
+
+    for (int i = 0; i < idle; i++) {
+        close(fds[i]);
+    }
+    free(fds);
+    free(threads);
+    free(churns);
+}
+
+int main(int argc, char *argv[]) {
+    int nkeys = 20000;
+    char *engine_name = NULL;
+    if (argc == 2 && strcmp(argv[1], "-s") == 0) {
+        run_search();
+        return 0;
+    }
+    if (argc >= 3 && argc <= 5 && strcmp(argv[1], "-c") == 0) {
+        int idle = (argc >= 4)? atoi(argv[3]): 1000;
+        int nthreads = (argc == 5)? atoi(argv[4]): 4;
+        if (atoi(argv[2]) <= 0 || idle < 0 || nthreads <= 0) {
+            fprintf(stderr, "%s\n", "usage: bench -c <port> [<idle connections> [<threads>]]");
+            exit(1);
+        }
+        run_churn(atoi(argv[2]), idle, nthreads);
+        return 0;
+    }
+    while (argc >= 2 && (strcmp(argv[1], "-f") == 0 || strcmp(argv[1], "-x") == 0)) {
+        if (argv[1][1] == 'f') {
+            filtered = 1;
+        } else {
+            indexed = 1;
+        }
+        argv++;
+        argc--;
+    }
+    if (argc > 3) {
+        fprintf(stderr, "%s\n", "usage: bench [-f] [-x] [<number of keys> [<engine>]] | bench -s | "
+                "bench -c <port> [<idle connections> [<threads>]]");
+        exit(1);
+    }
+    if (argc >= 2 && (nkeys = atoi(argv[1])) <= 0) {
+        fprintf(stderr, "%s\n", "bench: number of keys must be positive");
+        exit(1);
+    }
+
+    if (argc == 3)
+        engine_name = argv[2];
+    if (db_init(engine_name) < 0) {
+        fprintf(stderr, "bench: unknown engine %s\n", engine_name);
+        exit(1);
+    }
+    char (*keys)[KEYLEN] = make_keys(nkeys);
+    printf("%d keys\n%-8s %12s %12s %12s %12s %12s %12s\n", nkeys, "order", "add/s", "query/s",
+            "miss/s", "churn/s", "query/s", "miss/s");
+    run_order("sorted", keys, nkeys);
+    shuffle_keys(keys, nkeys);
+    run_order("random", keys, nkeys);
+
+    free(keys);
+    return 0;
+}
@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "./blob.h"
+#include "./epoch.h"
+
+#define BLOB_CHUNK (4 << 20)  // bytes mapped from the OS at a time
+
+// The start of every chunk. A blob too big to share a chunk gets one of its
+// own, sealed from the start.
+struct blob_chunk {
+    blob_chunk_t *next;   // all chunks, for blob_release
+    blob_chunk_t *prev;
+    size_t size;          // bytes mapped
+    size_t used;          // bytes handed out, from the start of the chunk
+    size_t live;          // blobs in it that haven't gone yet
+    int sealed;           // no more blobs go in it
+};
+
+// Everything below is protected by blob_lock.
+static pthread_mutex_t blob_lock = PTHREAD_MUTEX_INITIALIZER;
+static blob_chunk_t *chunks;
+static blob_chunk_t *current;  // the chunk blobs are appended to
+static size_t blobs;           // blobs that haven't gone yet, read without the lock
+
+// rounds size up to a multiple of 16
+static inline size_t align16(size_t size) {
+    return (size + 15) & ~(size_t) 15;
+}
+
+// unlinks a chunk and gives it back to the OS
+static void chunk_unmap(blob_chunk_t *chunk) {
+    if (chunk->prev != NULL) {
+        chunk->prev->next = chunk->next;
+    } else {
+        chunks = chunk->next;
+    }
+    if (chunk->next != NULL)
+        chunk->next->prev = chunk->prev;
+    munmap(chunk, chunk->size);
+}
+
+// maps a chunk of the given size and links it in
+static blob_chunk_t *chunk_map(size_t size) {
+    blob_chunk_t *chunk = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (chunk == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    chunk->size = size;
+    chunk->used = align16(sizeof(blob_chunk_t));
+    chunk->live = 0;
+    chunk->sealed = 0;
+    chunk->prev = NULL;
+    chunk->next = chunks;
+    if (chunks != NULL)
+        chunks->prev = chunk;
+    chunks = chunk;
+    return chunk;
+}
+
+// Frees a blob once no thread can be looking at it (called by the epochs).
+static void blob_reclaim(void *arg) {
+    blob_t *blob = (blob_t *) arg;
+    blob_chunk_t *chunk = blob->chunk;
+
+    pthread_mutex_lock(&blob_lock);
+    __atomic_sub_fetch(&blobs, 1, __ATOMIC_RELAXED);
+    if (--chunk->live == 0 && chunk->sealed)
+        chunk_unmap(chunk);
+    pthread_mutex_unlock(&blob_lock);
+}
+
+/* Copies the len bytes of value into a new blob, and writes a reference to
+ * it into ref, which holds BLOB_REF bytes. The blob starts with the one
+ * reference, which blob_drop lets go of.
+ *
+ * Returns ref. */
+char *blob_store(const char *value, size_t len, char *ref) {
+    size_t size = align16(sizeof(blob_t) + len + 1);
+    blob_chunk_t *chunk;
+    blob_t *blob;
+
+    pthread_mutex_lock(&blob_lock);
+    if (size > BLOB_CHUNK / 4) {
+        chunk = chunk_map(align16(sizeof(blob_chunk_t)) + size);
+        chunk->sealed = 1;
+    } else {
+        if (current == NULL || current->used + size > current->size) {
+            if (current != NULL) {
+                current->sealed = 1;
+                if (current->live == 0)
+                    chunk_unmap(current);
+            }
+            current = chunk_map(BLOB_CHUNK);
+        }
+        chunk = current;
+    }
+    blob = (blob_t *) (void *) ((char *) chunk + chunk->used);
+    chunk->used += size;
+    chunk->live++;
+    __atomic_add_fetch(&blobs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&blob_lock);
+
+    blob->len = len;
+    blob->refs = 1;
+    blob->chunk = chunk;
+    memcpy(blob->data, value, len);
+    blob->data[len] = '\0';
+    snprintf(ref, BLOB_REF, "%c%016lx", BLOB_TAG, (unsigned long) (uintptr_t) blob);
+    return ref;
+}
+
+/* Returns the blob a value from an engine refers to, or NULL if it is the
+ * value itself. */
+blob_t *blob_of(const char *stored) {
+    if (stored[0] != BLOB_TAG)
+        return NULL;
+    return (blob_t *) (uintptr_t) strtoul(stored + 1, NULL, 16);
+}
+
+/* Returns the value a value from an engine stands for. The caller must make
+ * sure a blob it refers to can't go meanwhile (see blob.h). */
+const char *blob_value(const char *stored) {
+    blob_t *blob = blob_of(stored);
+
+    return (blob != NULL)? blob->data: stored;
+}
+
+/* Adds a reference to a blob that already has one the caller can count on. */
+void blob_hold(blob_t *blob) {
+    __atomic_add_fetch(&blob->refs, 1, __ATOMIC_RELAXED);
+}
+
+/* Adds a reference to a blob found without a reference to count on, such
+ * as in a lock-free scan. Returns 1 if it did, or 0 if the last reference
+ * had already gone and the blob is only waiting to be freed. */
+int blob_try_hold(blob_t *blob) {
+    unsigned long refs = __atomic_load_n(&blob->refs, __ATOMIC_RELAXED);
+
+    do {
+        if (refs == 0)
+            return 0;
+    } while (!__atomic_compare_exchange_n(&blob->refs, &refs, refs + 1, 0,
+            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    return 1;
+}
+
+/* Drops a reference to a blob; the blob goes once no thread can be looking
+ * at it after the last one. */
+void blob_drop(blob_t *blob) {
+    if (__atomic_sub_fetch(&blob->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        epoch_retire(blob, blob_reclaim);
+}
+
+/* Returns 1 if there may be blobs, so that a change that would have to drop
+ * one can skip looking for it otherwise. A blob added under a lock is seen
+ * by whoever takes the lock next. */
+int blob_any(void) {
+    return __atomic_load_n(&blobs, __ATOMIC_RELAXED) > 0;
+}
+
+/* Gives every chunk back to the OS at once. No thread may be using a blob,
+ * and none may be waiting to be freed (see epoch_barrier). */
+void blob_release(void) {
+    pthread_mutex_lock(&blob_lock);
+    while (chunks != NULL) {
+        chunk_unmap(chunks);
+    }
+    current = NULL;
+    __atomic_store_n(&blobs, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&blob_lock);
+}
@@ -0,0 +1,45 @@
+#ifndef BLOB_H_
+#define BLOB_H_
+
+#include <stddef.h>
+
+/*
+ * Out-of-line storage for values too long for the engines (which keep values
+ * up to MAXLEN-1 bytes in their nodes). A long value is copied once into a
+ * blob and the engine keeps a reference to it instead: BLOB_TAG and the
+ * blob's address in hex, a short string like any other value. A blob counts
+ * its references, the engine's and those of responses still being sent, and
+ * goes away after the last one is dropped.
+ *
+ * Blobs are appended to chunks mapped from the OS, and a chunk is given back
+ * once every blob in it has gone. A blob is freed through epoch_retire, so a
+ * thread that finds a reference inside an engine's scan or critical section
+ * can still read it after the key's removal has dropped it. Such a thread
+ * can only keep it with blob_try_hold, which fails once the last reference
+ * is gone; blob_hold is for a thread that already has a reference it can
+ * count on (such as the key's, under the key's lock).
+ */
+
+#define BLOB_TAG '\x01'      // first byte of a reference, and of no other value
+#define BLOB_REF 18          // bytes of a reference, with its '\0'
+#define BLOB_MAX (16 << 20)  // longest value
+
+typedef struct blob_chunk blob_chunk_t;
+
+typedef struct blob {
+    size_t len;
+    unsigned long refs;
+    blob_chunk_t *chunk;
+    char data[];             // the value, and a '\0'
+} blob_t;
+
+char *blob_store(const char *value, size_t len, char *ref);
+blob_t *blob_of(const char *stored);
+const char *blob_value(const char *stored);
+void blob_hold(blob_t *blob);
+int blob_try_hold(blob_t *blob);
+void blob_drop(blob_t *blob);
+int blob_any(void);
+void blob_release(void);
+
+#endif  // BLOB_H_
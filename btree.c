@@ -0,0 +1,646 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "./engine.h"
+#include "./blob.h"
+#include "./keysearch.h"
+
+#define BT_FANOUT 32               // children per inner node
+#define BT_MAXKEYS (BT_FANOUT - 1) // keys per node
+#define BT_MAXDEPTH 32
+#define BT_LOADKEYS (BT_MAXKEYS * 3 / 4)  // keys per node when loading, to leave room
+#define BT_LOADTASK 1024                   // leaves built by one loading task
+#define lock(lt, lk) ((lt) == l_read)? pthread_rwlock_rdlock(lk): pthread_rwlock_wrlock(lk)
+
+// The btree engine is a B+tree: every node holds up to BT_MAXKEYS keys, the
+// names and values live in the leaves, and inner nodes only hold separator
+// keys. The first 8 bytes of every key are also kept inline in the node as a
+// big-endian integer, so a search within a node mostly compares integers from
+// one array and only follows a key pointer when two prefixes are equal. With
+// 32 keys per node the tree is a handful of levels deep, and each level costs
+// a few cache lines rather than several misses per key.
+//
+// Readers lock hand over hand (latch crabbing) with read locks. Adds and
+// removes do the same but write-lock the leaf; only an add that finds its
+// leaf full starts over from the root with write locks, keeping every
+// ancestor that the split could reach locked. Removes never merge nodes:
+// a leaf can go empty, and the separators above it stay valid bounds.
+
+typedef struct bt_node {
+    pthread_rwlock_t lock;
+    int leaf;                     // set when the node is made, never changes
+    int nkeys;
+    // One spare slot past BT_MAXKEYS, so a full node can take one more key
+    // before it is split.
+    uint64_t prefix[BT_FANOUT];   // first 8 bytes of each key, big-endian
+    char *keys[BT_FANOUT];
+    union {
+        struct bt_node *children[BT_FANOUT + 1];  // inner nodes
+        char *values[BT_FANOUT];  // leaves: points into the key's allocation
+    } ptr;
+    struct bt_node *next;         // leaves: the leaf to the right
+} bt_node_t;
+
+static bt_node_t *root;
+static pthread_rwlock_t root_lock;  // protects the root pointer
+
+// type for locking
+enum locktype {l_read, l_write};
+
+// locks a node, exiting if that would deadlock
+static inline void node_lock(bt_node_t *node, enum locktype lt) {
+    if (lock(lt, &node->lock) == EDEADLK) {
+        fprintf(stderr, "%s\n", "lock failed. deadlock.");
+        exit(1);
+    }
+}
+
+// unlocks a node, exiting if it wasn't locked
+static inline void node_unlock(bt_node_t *node) {
+    if (pthread_rwlock_unlock(&node->lock) == EPERM) {
+        fprintf(stderr, "%s\n", "unlock failed. wasn't locked");
+        exit(1);
+    }
+}
+
+// Returns the index of the first key in node that is not smaller than name,
+// and sets *found if that key is name. The prefixes narrow it down (with
+// SIMD where the CPU has it, see keysearch.c); strcmp only breaks ties.
+static int node_search(bt_node_t *node, uint64_t prefix, char *name, int *found) {
+    int i = prefix_rank(node->prefix, node->nkeys, prefix);
+    int cmp;
+
+    *found = 0;
+    for (; i < node->nkeys && node->prefix[i] == prefix; i++) {
+        if ((cmp = strcmp(node->keys[i], name)) >= 0) {
+            *found = (cmp == 0);
+            break;
+        }
+    }
+    return i;
+}
+
+// returns the index of the child of an inner node that name belongs under
+static inline int child_index(bt_node_t *node, uint64_t prefix, char *name) {
+    int found;
+    int i = node_search(node, prefix, name, &found);
+    return found? i + 1: i;
+}
+
+// constructs an empty node, exiting if there is no memory left
+static bt_node_t *node_constructor(int leaf) {
+    bt_node_t *node;
+
+    if ((node = (bt_node_t *) malloc(sizeof(bt_node_t))) == 0) {
+        perror("malloc");
+        exit(1);
+    }
+    pthread_rwlock_init(&node->lock, 0);
+    node->leaf = leaf;
+    node->nkeys = 0;
+    node->next = 0;
+    return node;
+}
+
+// destroys a node and the keys (and values) it owns
+static void node_destructor(bt_node_t *node) {
+    for (int i = 0; i < node->nkeys; i++) {
+        free(node->keys[i]);
+    }
+    pthread_rwlock_destroy(&node->lock);
+    free(node);
+}
+
+// Returns name and value copied back to back into one allocation, with
+// *valuep set to the value, or 0 if they are too long.
+static char *entry_constructor(char *name, char *value, char **valuep) {
+    size_t name_len = strlen(name);
+    size_t val_len = strlen(value);
+    char *entry;
+
+    if (name_len > MAXLEN || val_len > MAXLEN)
+        return 0;
+
+    if ((entry = (char *) malloc(name_len + val_len + 2)) == 0)
+        return 0;
+
+    memcpy(entry, name, name_len + 1);
+    memcpy(entry + name_len + 1, value, val_len + 1);
+    *valuep = entry + name_len + 1;
+    return entry;
+}
+
+// Walks down to the leaf that name belongs in, locking hand over hand, and
+// returns it locked with lt. Inner nodes are only read-locked. If hip isn't
+// 0, it is set to the separator that bounds the leaf on the right (0 for the
+// last leaf): while the leaf stays locked, every name smaller than that
+// belongs in it, since only a split of the leaf itself could move its keys.
+static bt_node_t *descend(uint64_t prefix, char *name, enum locktype lt, char **hip) {
+    bt_node_t *node;
+    bt_node_t *child;
+    int i;
+
+    pthread_rwlock_rdlock(&root_lock);
+    node = root;
+    node_lock(node, node->leaf? lt: l_read);
+    pthread_rwlock_unlock(&root_lock);
+
+    if (hip != 0)
+        *hip = 0;
+    while (!node->leaf) {
+        i = child_index(node, prefix, name);
+        if (hip != 0 && i < node->nkeys)
+            *hip = node->keys[i];  // separators are never freed
+        child = node->ptr.children[i];
+        node_lock(child, child->leaf? lt: l_read);
+        node_unlock(node);
+        node = child;
+    }
+    return node;
+}
+
+// Queries for a key.
+static void btree_query(char *name, char *result, int len) {
+    uint64_t prefix = key_prefix(name);
+    bt_node_t *leaf = descend(prefix, name, l_read, 0);
+    int found;
+    int i = node_search(leaf, prefix, name, &found);
+
+    if (found) {
+        snprintf(result, len, "%s", leaf->ptr.values[i]);
+    } else {
+        result[0] = '\0';
+    }
+    node_unlock(leaf);
+}
+
+// inserts an entry into a leaf at index i; the leaf must have a free slot
+static void leaf_insert(bt_node_t *leaf, int i, uint64_t prefix, char *entry, char *value) {
+    int n = leaf->nkeys - i;
+
+    memmove(&leaf->prefix[i + 1], &leaf->prefix[i], n * sizeof(uint64_t));
+    memmove(&leaf->keys[i + 1], &leaf->keys[i], n * sizeof(char *));
+    memmove(&leaf->ptr.values[i + 1], &leaf->ptr.values[i], n * sizeof(char *));
+    leaf->prefix[i] = prefix;
+    leaf->keys[i] = entry;
+    leaf->ptr.values[i] = value;
+    leaf->nkeys++;
+}
+
+// inserts a separator key at index i of an inner node, with child to its right
+static void inner_insert(bt_node_t *node, int i, uint64_t prefix, char *key, bt_node_t *child) {
+    int n = node->nkeys - i;
+
+    memmove(&node->prefix[i + 1], &node->prefix[i], n * sizeof(uint64_t));
+    memmove(&node->keys[i + 1], &node->keys[i], n * sizeof(char *));
+    memmove(&node->ptr.children[i + 2], &node->ptr.children[i + 1], n * sizeof(bt_node_t *));
+    node->prefix[i] = prefix;
+    node->keys[i] = key;
+    node->ptr.children[i + 1] = child;
+    node->nkeys++;
+}
+
+// Splits an overfull node in two, returning the new right half. The key that
+// separates the halves is returned in *keyp; for a leaf it is a copy of the
+// right half's first name, for an inner node it moves up out of the node.
+static bt_node_t *node_split(bt_node_t *node, char **keyp) {
+    bt_node_t *right = node_constructor(node->leaf);
+    int mid = node->nkeys / 2;
+
+    if (node->leaf) {
+        right->nkeys = node->nkeys - mid;
+        memcpy(right->prefix, &node->prefix[mid], right->nkeys * sizeof(uint64_t));
+        memcpy(right->keys, &node->keys[mid], right->nkeys * sizeof(char *));
+        memcpy(right->ptr.values, &node->ptr.values[mid], right->nkeys * sizeof(char *));
+        right->next = node->next;
+        node->next = right;
+        if ((*keyp = strdup(right->keys[0])) == 0) {
+            perror("strdup");
+            exit(1);
+        }
+    } else {
+        right->nkeys = node->nkeys - mid - 1;
+        memcpy(right->prefix, &node->prefix[mid + 1], right->nkeys * sizeof(uint64_t));
+        memcpy(right->keys, &node->keys[mid + 1], right->nkeys * sizeof(char *));
+        memcpy(right->ptr.children, &node->ptr.children[mid + 1],
+                (right->nkeys + 1) * sizeof(bt_node_t *));
+        *keyp = node->keys[mid];
+    }
+    node->nkeys = mid;
+    return right;
+}
+
+// The slow path of btree_add, for when the leaf is full. Starts over from the
+// root with write locks, letting go of everything above a node that has room
+// for one more key, since a split below it can't reach further up.
+static int btree_add_split(uint64_t prefix, char *name, char *entry, char *value) {
+    bt_node_t *path[BT_MAXDEPTH];
+    int slot[BT_MAXDEPTH];        // child index taken at each level
+    int depth = 0;
+    int first = 0;                // path[first..depth-1] are locked
+    int root_locked = 1;
+    int found;
+    int i;
+    bt_node_t *node;
+
+    pthread_rwlock_wrlock(&root_lock);
+    node = root;
+    while (1) {
+        node_lock(node, l_write);
+        path[depth++] = node;
+        if (node->nkeys < BT_MAXKEYS) {
+            for (; first < depth - 1; first++) {
+                node_unlock(path[first]);
+            }
+            if (root_locked) {
+                pthread_rwlock_unlock(&root_lock);
+                root_locked = 0;
+            }
+        }
+        if (node->leaf)
+            break;
+        slot[depth - 1] = child_index(node, prefix, name);
+        node = node->ptr.children[slot[depth - 1]];
+    }
+
+    i = node_search(node, prefix, name, &found);
+    if (found) {
+        for (; first < depth; first++) {
+            node_unlock(path[first]);
+        }
+        if (root_locked)
+            pthread_rwlock_unlock(&root_lock);
+        free(entry);
+        return 0;
+    }
+    leaf_insert(node, i, prefix, entry, value);
+
+    // Split upwards. Only the topmost locked node can be the root, and if it
+    // overflows the root lock is still held.
+    for (int level = depth - 1; path[level]->nkeys > BT_MAXKEYS; level--) {
+        char *key;
+        bt_node_t *right = node_split(path[level], &key);
+
+        if (level == first) {
+            bt_node_t *newroot = node_constructor(0);
+            newroot->nkeys = 1;
+            newroot->prefix[0] = key_prefix(key);
+            newroot->keys[0] = key;
+            newroot->ptr.children[0] = path[level];
+            newroot->ptr.children[1] = right;
+            root = newroot;
+            break;
+        }
+        inner_insert(path[level - 1], slot[level - 1], key_prefix(key), key, right);
+    }
+
+    for (; first < depth; first++) {
+        node_unlock(path[first]);
+    }
+    if (root_locked)
+        pthread_rwlock_unlock(&root_lock);
+    return 1;
+}
+
+// adds a new key into the tree
+static int btree_add(char *name, char *value) {
+    uint64_t prefix = key_prefix(name);
+    bt_node_t *leaf;
+    char *entry;
+    char *entry_value;
+    int found;
+    int i;
+
+    if ((entry = entry_constructor(name, value, &entry_value)) == 0)
+        return 0;
+
+    leaf = descend(prefix, name, l_write, 0);
+    i = node_search(leaf, prefix, name, &found);
+    if (found) {
+        node_unlock(leaf);
+        free(entry);
+        return 0;
+    }
+    if (leaf->nkeys < BT_MAXKEYS) {
+        leaf_insert(leaf, i, prefix, entry, entry_value);
+        node_unlock(leaf);
+        return 1;
+    }
+    node_unlock(leaf);
+    return btree_add_split(prefix, name, entry, entry_value);
+}
+
+// removes the entry at index i from a leaf
+static void leaf_remove(bt_node_t *leaf, int i) {
+    int n = leaf->nkeys - i - 1;
+
+    free(leaf->keys[i]);
+    memmove(&leaf->prefix[i], &leaf->prefix[i + 1], n * sizeof(uint64_t));
+    memmove(&leaf->keys[i], &leaf->keys[i + 1], n * sizeof(char *));
+    memmove(&leaf->ptr.values[i], &leaf->ptr.values[i + 1], n * sizeof(char *));
+    leaf->nkeys--;
+}
+
+// removes the input argument from the tree. Leaves are never merged.
+static int btree_remove(char *name) {
+    uint64_t prefix = key_prefix(name);
+    bt_node_t *leaf = descend(prefix, name, l_write, 0);
+    int found;
+    int i = node_search(leaf, prefix, name, &found);
+
+    if (found)
+        leaf_remove(leaf, i);
+    node_unlock(leaf);
+    return found;
+}
+
+// Returns the leaf for a key of a batch, going back to the root only when the
+// key is past the right bound of the leaf the previous key was in. The leaf
+// from before is passed in locked, and unlocked if it isn't the one.
+static bt_node_t *batch_leaf(bt_node_t *leaf, char **hip, uint64_t prefix, char *name,
+        enum locktype lt) {
+    if (leaf != 0) {
+        if (*hip == 0 || strcmp(name, *hip) < 0)
+            return leaf;
+        node_unlock(leaf);
+    }
+    return descend(prefix, name, lt, hip);
+}
+
+// Queries a sorted batch of keys, descending once per leaf rather than once
+// per key.
+static void btree_query_batch(db_op_t *ops, int n) {
+    bt_node_t *leaf = 0;
+    char *hi;
+    int i;
+
+    for (int k = 0; k < n; k++) {
+        uint64_t prefix = key_prefix(ops[k].name);
+
+        leaf = batch_leaf(leaf, &hi, prefix, ops[k].name, l_read);
+        i = node_search(leaf, prefix, ops[k].name, &ops[k].done);
+        if (ops[k].done)
+            snprintf(ops[k].value, MAXLEN, "%s", leaf->ptr.values[i]);
+    }
+    if (leaf != 0)
+        node_unlock(leaf);
+}
+
+// Adds a sorted batch of keys, descending once per leaf rather than once per
+// key. A key that would split its leaf lets go of the leaf and takes the slow
+// path of btree_add on its own.
+static void btree_add_batch(db_op_t *ops, int n) {
+    bt_node_t *leaf = 0;
+    char *hi;
+    char *entry;
+    char *entry_value;
+    int i;
+
+    for (int k = 0; k < n; k++) {
+        uint64_t prefix = key_prefix(ops[k].name);
+
+        if ((entry = entry_constructor(ops[k].name, ops[k].value, &entry_value)) == 0) {
+            ops[k].done = 0;
+            continue;
+        }
+        leaf = batch_leaf(leaf, &hi, prefix, ops[k].name, l_write);
+        i = node_search(leaf, prefix, ops[k].name, &ops[k].done);
+        if (ops[k].done) {
+            free(entry);
+            ops[k].done = 0;
+        } else if (leaf->nkeys < BT_MAXKEYS) {
+            leaf_insert(leaf, i, prefix, entry, entry_value);
+            ops[k].done = 1;
+        } else {
+            node_unlock(leaf);
+            leaf = 0;
+            ops[k].done = btree_add_split(prefix, ops[k].name, entry, entry_value);
+        }
+    }
+    if (leaf != 0)
+        node_unlock(leaf);
+}
+
+// Removes a sorted batch of keys, descending once per leaf rather than once
+// per key.
+static void btree_remove_batch(db_op_t *ops, int n) {
+    bt_node_t *leaf = 0;
+    char *hi;
+    int i;
+
+    for (int k = 0; k < n; k++) {
+        uint64_t prefix = key_prefix(ops[k].name);
+
+        leaf = batch_leaf(leaf, &hi, prefix, ops[k].name, l_write);
+        i = node_search(leaf, prefix, ops[k].name, &ops[k].done);
+        if (ops[k].done)
+            leaf_remove(leaf, i);
+    }
+    if (leaf != 0)
+        node_unlock(leaf);
+}
+
+// Visits the keys from start up to end in order: goes down to the leaf that
+// start belongs in and then follows the leaves to the right, locking them
+// hand over hand with read locks. Only the leaf being read is locked, so a
+// long scan holds up writers one leaf at a time. Every lock is taken either
+// below or to the right of the ones held, as adds and removes (which only
+// go down) also do, so this can't deadlock with them.
+static void btree_scan(char *start, char *end, int (*visit)(void *, char *, char *), void *arg) {
+    uint64_t prefix = key_prefix(start);
+    bt_node_t *leaf = descend(prefix, start, l_read, 0);
+    bt_node_t *next;
+    int found;
+    int i = node_search(leaf, prefix, start, &found);
+
+    while (1) {
+        for (; i < leaf->nkeys; i++) {
+            if ((end != 0 && strcmp(leaf->keys[i], end) >= 0)
+                    || visit(arg, leaf->keys[i], leaf->ptr.values[i])) {
+                node_unlock(leaf);
+                return;
+            }
+        }
+        if ((next = leaf->next) == 0)
+            break;
+        node_lock(next, l_read);
+        node_unlock(leaf);
+        leaf = next;
+        i = 0;
+    }
+    node_unlock(leaf);
+}
+
+// Arguments of load_leaves.
+typedef struct bt_load {
+    db_entry_t *entries;
+    size_t n;
+    bt_node_t **leaves;
+    size_t nleaves;
+} bt_load_t;
+
+// Builds BT_LOADTASK of the leaves for btree_load, spreading the entries
+// evenly over all the leaves.
+static void load_leaves(void *arg, int task) {
+    bt_load_t *load = (bt_load_t *) arg;
+    size_t last = (size_t) (task + 1) * BT_LOADTASK;
+
+    for (size_t l = (size_t) task * BT_LOADTASK; l < last && l < load->nleaves; l++) {
+        bt_node_t *leaf = node_constructor(1);
+        size_t from = l * load->n / load->nleaves;
+        size_t to = (l + 1) * load->n / load->nleaves;
+        for (size_t e = from; e < to; e++) {
+            char *entry = entry_constructor(load->entries[e].name, load->entries[e].value,
+                    &leaf->ptr.values[leaf->nkeys]);
+            if (entry == 0) {
+                perror("malloc");
+                exit(1);
+            }
+            leaf->prefix[leaf->nkeys] = key_prefix(entry);
+            leaf->keys[leaf->nkeys++] = entry;
+        }
+        load->leaves[l] = leaf;
+    }
+}
+
+/* Builds the tree bottom up from sorted entries: the leaves first, in
+ * parallel, then each level of inner nodes over the one below. Every node is
+ * filled to BT_LOADKEYS keys, so the first adds don't all split. The tree
+ * must be empty and nobody else may be using it. */
+static void btree_load(db_entry_t *entries, size_t n) {
+    bt_load_t load = {entries, n, 0, (n + BT_LOADKEYS - 1) / BT_LOADKEYS};
+    bt_node_t **level;
+    char **mins;         // the smallest key below each node of the level
+    size_t count;
+
+    if (n == 0)
+        return;
+    if ((load.leaves = malloc(load.nleaves * sizeof(bt_node_t *))) == 0
+            || (mins = malloc(load.nleaves * sizeof(char *))) == 0) {
+        perror("malloc");
+        exit(1);
+    }
+    engine_parallel((int) ((load.nleaves + BT_LOADTASK - 1) / BT_LOADTASK), load_leaves, &load);
+
+    level = load.leaves;
+    for (count = 0; count < load.nleaves; count++) {
+        if (count > 0)
+            level[count - 1]->next = level[count];
+        mins[count] = level[count]->keys[0];
+    }
+
+    // Each pass puts a level of parents over the nodes in level, in place,
+    // spreading the children evenly so every parent gets at least two.
+    while (count > 1) {
+        size_t parents = (count + BT_LOADKEYS) / (BT_LOADKEYS + 1);
+        for (size_t p = 0; p < parents; p++) {
+            bt_node_t *parent = node_constructor(0);
+            size_t from = p * count / parents;
+            size_t to = (p + 1) * count / parents;
+            for (size_t c = from; c < to; c++) {
+                parent->ptr.children[c - from] = level[c];
+                if (c == from)
+                    continue;
+                if ((parent->keys[parent->nkeys] = strdup(mins[c])) == 0) {
+                    perror("strdup");
+                    exit(1);
+                }
+                parent->prefix[parent->nkeys++] = key_prefix(mins[c]);
+            }
+            mins[p] = mins[from];
+            level[p] = parent;
+        }
+        count = parents;
+    }
+
+    node_destructor(root);
+    root = level[0];
+    free(load.leaves);
+    free(mins);
+}
+
+static inline void print_spaces(int lvl, FILE *out) {
+    for (int i = 0; i < lvl; i++) {
+        fprintf(out, " ");
+    }
+}
+
+/* Recursively prints the tree pre-order: an inner node as its separator keys
+ * in brackets, a leaf as one line per key. The caller holds node's read
+ * lock. */
+static void btree_print_recurs(bt_node_t *node, int lvl, FILE *out) {
+    if (node->leaf) {
+        for (int i = 0; i < node->nkeys; i++) {
+            print_spaces(lvl, out);
+            fprintf(out, "%s %s\n", node->keys[i], blob_value(node->ptr.values[i]));
+        }
+        return;
+    }
+
+    print_spaces(lvl, out);
+    fprintf(out, "[");
+    for (int i = 0; i < node->nkeys; i++) {
+        fprintf(out, (i == 0)? "%s": " %s", node->keys[i]);
+    }
+    fprintf(out, "]\n");
+
+    for (int i = 0; i <= node->nkeys; i++) {
+        node_lock(node->ptr.children[i], l_read);
+        btree_print_recurs(node->ptr.children[i], lvl + 1, out);
+        node_unlock(node->ptr.children[i]);
+    }
+}
+
+static void btree_print(FILE *out) {
+    bt_node_t *node;
+
+    pthread_rwlock_rdlock(&root_lock);
+    node = root;
+    node_lock(node, l_read);
+    pthread_rwlock_unlock(&root_lock);
+
+    fprintf(out, "(btree)\n");
+    btree_print_recurs(node, 1, out);
+    node_unlock(node);
+}
+
+/* Recursively destroys node and all its children. */
+static void btree_cleanup_recurs(bt_node_t *node) {
+    if (!node->leaf) {
+        for (int i = 0; i <= node->nkeys; i++) {
+            btree_cleanup_recurs(node->ptr.children[i]);
+        }
+    }
+    node_destructor(node);
+}
+
+/* Sets up an empty root leaf. */
+static void btree_init(void) {
+    pthread_rwlock_init(&root_lock, 0);
+    root = node_constructor(1);
+}
+
+/* Destroys every node and starts over with an empty root leaf.
+ * No threads should be using the database when this is called. */
+static void btree_cleanup(void) {
+    btree_cleanup_recurs(root);
+    root = node_constructor(1);
+}
+
+db_engine_t btree_engine = {
+    "btree",
+    btree_init,
+    btree_query,
+    btree_add,
+    btree_remove,
+    btree_scan,
+    btree_load,
+    btree_print,
+    btree_cleanup,
+    btree_query_batch,
+    btree_add_batch,
+    btree_remove_batch
+};
@@ -11,9 +11,20 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include "./comm.h"
 
 #define BUFSIZE 1024
 
+// Shared by the sender and the reader of a pipelined connection.
+typedef struct pipeline {
+    FILE *cxn_in;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int outstanding;  // commands sent that haven't had a response yet
+    int closed;       // the server has closed the connection
+} pipeline_t;
+
 /*
  * Helper that opens a TCP socket representing the server.
  * Returns the file descriptor on success, -1 on failure. 
@@ -58,6 +69,166 @@ int get_socket(const char *server, const char *port) {
     return sock;
 }
 
+/*
+ * Prints responses as they come back, letting the sender know about each.
+ */
+void *pipeline_reader(void *arg) {
+    pipeline_t *pl = (pipeline_t *) arg;
+    char rbuf[BUFSIZE];
+
+    while (fgets(rbuf, BUFSIZE, pl->cxn_in) != NULL) {
+        printf("%s", rbuf);
+        // a long value comes in more than one piece
+        if (strchr(rbuf, '\n') == NULL)
+            continue;
+        pthread_mutex_lock(&pl->mutex);
+        pl->outstanding--;
+        pthread_cond_signal(&pl->cond);
+        pthread_mutex_unlock(&pl->mutex);
+    }
+
+    pthread_mutex_lock(&pl->mutex);
+    pl->closed = 1;
+    pthread_cond_signal(&pl->cond);
+    pthread_mutex_unlock(&pl->mutex);
+    return NULL;
+}
+
+/*
+ * Prints the responses to binary requests as they come back, as the lines
+ * the server would have sent for the same commands.
+ */
+void *binary_reader(void *arg) {
+    pipeline_t *pl = (pipeline_t *) arg;
+    comm_frame_t frame;
+    char *value = NULL;
+    size_t capacity = 0;
+    int ack = fgetc(pl->cxn_in);
+
+    while (ack == COMM_BINARY && fread(&frame, sizeof(frame), 1, pl->cxn_in) == 1) {
+        size_t len = ntohl(frame.value_len);
+        if (len + 1 > capacity) {
+            capacity = len + 1;
+            if ((value = realloc(value, capacity)) == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        if (fread(value, 1, len + 1, pl->cxn_in) != len + 1)
+            break;
+        if (frame.status == COMM_BAD) {
+            printf("ill-formed command\n");
+        } else if (frame.op == 'q') {
+            printf("%s\n", (frame.status == COMM_OK)? value: "not found");
+        } else if (frame.op == 'a') {
+            printf("%s\n", (frame.status == COMM_OK)? "added": "already in database");
+        } else {
+            printf("%s\n", (frame.status == COMM_OK)? "removed": "not in database");
+        }
+        pthread_mutex_lock(&pl->mutex);
+        pl->outstanding--;
+        pthread_cond_signal(&pl->cond);
+        pthread_mutex_unlock(&pl->mutex);
+    }
+
+    free(value);
+    pthread_mutex_lock(&pl->mutex);
+    pl->closed = 1;
+    pthread_cond_signal(&pl->cond);
+    pthread_mutex_unlock(&pl->mutex);
+    return NULL;
+}
+
+// writes a command line of the script (q, a or d) to out as a binary request
+int put_request(char *line, uint32_t id, FILE *out) {
+    char key[BUFSIZE] = "";
+    char value[BUFSIZE] = "";
+    comm_frame_t frame;
+
+    memset(&frame, 0, sizeof(frame));
+    frame.op = line[0];
+    if (line[0] == 'a') {
+        sscanf(&line[1], "%s %s", key, value);
+    } else {
+        sscanf(&line[1], "%s", key);
+    }
+    frame.key_len = htons(strlen(key));
+    frame.value_len = htonl(strlen(value));
+    frame.id = htonl(id);
+    if (fwrite(&frame, sizeof(frame), 1, out) != 1
+            || fwrite(key, 1, strlen(key) + 1, out) != strlen(key) + 1
+            || fwrite(value, 1, strlen(value) + 1, out) != strlen(value) + 1)
+        return EOF;
+    return 0;
+}
+
+/*
+ * Sends the commands in infile without waiting for their responses, keeping
+ * up to window of them in flight, while another thread prints the responses.
+ */
+void run_pipelined(FILE *infile, int sock, int window, int binary) {
+    pipeline_t pl;
+    pthread_t reader;
+    char qbuf[BUFSIZE];
+    FILE *cxn_out;
+    int closed = 0;
+    int err;
+
+    if ((pl.cxn_in = fdopen(sock, "r")) == NULL
+            || (cxn_out = fdopen(dup(sock), "w")) == NULL) {
+        perror("fdopen");
+        exit(1);
+    }
+    pthread_mutex_init(&pl.mutex, NULL);
+    pthread_cond_init(&pl.cond, NULL);
+    pl.outstanding = 0;
+    pl.closed = 0;
+    if ((err = pthread_create(&reader, NULL, binary? binary_reader: pipeline_reader, &pl))) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        exit(1);
+    }
+
+    if (binary)
+        fputc(COMM_BINARY, cxn_out);
+    for (uint32_t id = 0; !closed && fgets(qbuf, sizeof(qbuf), infile) != NULL; id++) {
+        // wait for room in the window, sending what we have first
+        pthread_mutex_lock(&pl.mutex);
+        if (pl.outstanding >= window) {
+            pthread_mutex_unlock(&pl.mutex);
+            fflush(cxn_out);
+            pthread_mutex_lock(&pl.mutex);
+            while (pl.outstanding >= window && !pl.closed) {
+                pthread_cond_wait(&pl.cond, &pl.mutex);
+            }
+        }
+        closed = pl.closed;
+        pl.outstanding++;
+        pthread_mutex_unlock(&pl.mutex);
+
+        // the last command needs its newline too, or the server waits for it
+        if (strchr(qbuf, '\n') == NULL && strlen(qbuf) < sizeof(qbuf) - 1)
+            strcat(qbuf, "\n");
+        if (!closed && (binary? put_request(qbuf, id, cxn_out): fputs(qbuf, cxn_out)) == EOF) {
+            fprintf(stderr, "No connection!\n");
+            exit(1);
+        }
+    }
+
+    // we're done sending; the server closes once it has answered everything
+    fflush(cxn_out);
+    shutdown(sock, SHUT_WR);
+    pthread_join(reader, NULL);
+    if (closed) {
+        fprintf(stderr, "Connection terminated.\n");
+        exit(1);
+    }
+    fclose(cxn_out);
+    fclose(pl.cxn_in);
+    fclose(infile);
+    printf("Client terminated cleanly.\n");
+    exit(0);
+}
+
 /*
  * Forks off a process that attempts to connect to the server, and then run the
  * script in the file provided.
@@ -65,7 +236,9 @@ int get_socket(const char *server, const char *port) {
  */
 pid_t create_occurence(const char *server,
         const char *port,
-        const char *script) {
+        const char *script,
+        int window,
+        int binary) {
     pid_t pid;
 
     // create a process for the client
@@ -88,6 +261,9 @@ pid_t create_occurence(const char *server,
         }
 
         // Step 4: loop, sending queries and printing responses
+        if (window > 0)
+            run_pipelined(infile, sock, window, binary);
+
         FILE *cxn = fdopen(sock, "w+");
         char rbuf[BUFSIZE], qbuf[BUFSIZE];
         rbuf[0] = '\0';
@@ -111,12 +287,15 @@ pid_t create_occurence(const char *server,
                 fflush(cxn);
             }
 
-            // wait for the response and print it
-            if (fgets(rbuf, BUFSIZE, cxn) == NULL) {
-                fprintf(stderr, "Connection terminated.\n");
-                exit(1);
-            }
-            printf("%s", rbuf);
+            // wait for the response and print it, however many pieces it
+            // takes
+            do {
+                if (fgets(rbuf, BUFSIZE, cxn) == NULL) {
+                    fprintf(stderr, "Connection terminated.\n");
+                    exit(1);
+                }
+                printf("%s", rbuf);
+            } while (strchr(rbuf, '\n') == NULL);
         }
     }
 
@@ -128,13 +307,17 @@ pid_t create_occurence(const char *server,
  * Prints a usage tip.
  */
 void usage_error(const char *cmd) {
-    fprintf(stderr, "Usage: %s <servername> <port> "
-        "[<script> <occurences>]\n", cmd);
+    fprintf(stderr, "Usage: %s [-b] <servername> <port> "
+        "[<script> <occurences> [<window>]]\n", cmd);
 }
 
 /*
  * The arguments to the client should be servername, port number,
- * [script-file, number of occurences].
+ * [script-file, number of occurences, [window]]. Without a window every client
+ * waits for each response before sending the next command; with one it keeps
+ * up to window commands in flight (pipelining). With -b the clients speak the
+ * binary protocol, which takes q, a and d commands only, pipelined with a
+ * window of 1 if none is given.
  *
  * Step 1: fork to create as many clients as number of occurences argument
  *
@@ -147,24 +330,36 @@ void usage_error(const char *cmd) {
  */
 int main(int argc, const char *argv[]) {
     // parse args
-    if (argc != 3 && argc != 5) {
+    int binary = (argc > 1 && strcmp(argv[1], "-b") == 0);
+    if (binary) {
+        argv[1] = argv[0];
+        argc--;
+        argv++;
+    }
+    if (argc != 3 && argc != 5 && argc != 6) {
         usage_error(argv[0]);
         return 1;
     }
 
-    int i, occurences = 1;
+    int i, occurences = 1, window = 0;
     const char *script = NULL;
     const char *server = argv[1];
     const char *port = argv[2];
     
-    if (argc == 5) {
+    if (argc >= 5) {
         script = argv[3];
         occurences = atoi(argv[4]);
     }
+    if (argc == 6 && (window = atoi(argv[5])) < 1) {
+        usage_error(argv[0]);
+        return 1;
+    }
+    if (binary && window == 0)
+        window = 1;
 
     // Step 1: create clients, they'll do the rest
     for (i = 0; i < occurences; i++) {
-        if (create_occurence(server, port, script) == -1) {
+        if (create_occurence(server, port, script, window, binary) == -1) {
             perror("Error forking off process");
             return 1;
         }
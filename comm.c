@@ -2,41 +2,179 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
+#include <sys/epoll.h>
+#include <poll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
 #include "./comm.h"
+#include "./pool.h"
 
 /* Serverside I/O functions */
 
+/*
+ * Connections are served by a fixed set of I/O threads, one per core, each
+ * with its own epoll instance. The listener thread accepts connections, makes
+ * them non-blocking and hands each one to the next I/O thread in turn, which
+ * then does all the reading and writing for it. Every connection buffers its
+ * input until it has whole command lines, and buffers responses that the
+ * socket won't take yet. While a connection has responses waiting, its
+ * thread stops reading from it, so a client that doesn't read can't make the
+ * server buffer without bound.
+ *
+ * Clients don't have to wait for a response before sending the next command
+ * (pipelining). Every command that has arrived is run in order, and their
+ * responses are collected and only written out once there are no more whole
+ * commands to run, or the output buffer is full, so a burst of commands gets
+ * its responses back in as few writes as possible. A connection that starts
+ * with COMM_BINARY speaks the binary protocol (see comm.h) instead of lines,
+ * and its requests are run straight from the input buffer, or from a buffer
+ * of their own if they don't fit in it.
+ *
+ * A response can go out partly from somewhere else (an extent from the
+ * handler, such as a long value where the database keeps it). Extents wait
+ * in a queue next to the output buffer, each with the place in the output
+ * it goes at, and are sent with the bytes around them in one sendmsg.
+ *
+ * A response must not go out before handler->sync says the changes behind
+ * it are durable (see wal.c). So an I/O thread runs the commands of every
+ * connection that epoll reported first, holding their responses back, then
+ * calls sync once for all of them, and only then writes them out: one wait
+ * for the log covers every client the thread served in that round.
+ *
+ * If the server started a worker pool (see pool.c), the I/O threads only
+ * read and write: the commands of the connections in a round are handed to
+ * the pool, one task per connection so that its commands still run in
+ * order, and the I/O thread waits for the round's tasks before it syncs. How
+ * many threads run commands is then the size of the pool, however many I/O
+ * threads and clients there are.
+ *
+ * A command that would hold up a thread for long, such as a file load, can
+ * be run somewhere else: the handler says so, and the connection is parked
+ * (taken out of epoll once its earlier responses are out) until
+ * comm_resume gives it the response.
+ */
+
+#define COMM_INBUF 4096   // bytes of unprocessed input per connection
+#define COMM_OUTBUF 4096  // bytes of unsent responses per connection
+#define COMM_EVENTS 64    // events taken from epoll at once
+#define COMM_READS 16     // reads from one connection before serving others
+#define COMM_EXTENTS 16   // extents waiting to be sent per connection
+#define COMM_BACKOFF 10000  // microseconds the listener waits after accept fails
+
+// An extent in the output. Its place is counted in bytes of the output
+// buffer from the start of the connection, so it doesn't move when the
+// buffer does.
+typedef struct out_extent {
+    comm_extent_t extent;
+    size_t at;          // output buffer bytes before it
+    size_t sent;        // of its own bytes
+} out_extent_t;
+
+struct comm_conn {
+    int fd;
+    int epfd;           // of the I/O thread that serves this connection
+    int writing;        // waiting for the socket to take more output
+    int eof;            // the client has finished sending
+    int negotiated;     // the first byte has been looked at
+    int binary;         // speaks the binary protocol
+    void *client;       // from handler->connect
+    size_t in_len;
+    size_t out_start;
+    size_t out_len;
+    size_t held;        // bytes at the end of out waiting for handler->sync
+    size_t out_base;    // output buffer bytes sent before out[out_start]
+    out_extent_t extents[COMM_EXTENTS];
+    int nextents;
+    char *big;          // a request too big for in, being read
+    size_t big_len;
+    size_t big_size;
+    pool_task_t task;   // runs conn_task on a worker
+    int failed;         // set by conn_task if the connection should be closed
+    uint64_t mark;      // from handler->mark after the commands last run
+    int parked;         // a command is finishing elsewhere (see comm_resume)
+    int resumed;        // 1 while comm_resume runs, 2 once it is done
+    int broken;         // the socket failed while parked
+    char late[BUFLEN];  // the response comm_resume was given
+    char in[COMM_INBUF];
+    char out[COMM_OUTBUF];
+};
+
+typedef struct io_thread {
+    pthread_t thread;
+    int epfd;
+} io_thread_t;
+
 int lsock;
 
-static void *listener(void (*server)(FILE *));
+static void *listener(void *arg);
 
 static int comm_port;
+static int spare_fd = -1;  // given up to turn a connection away when out of fds
+static comm_handler_t *comm_handler;
+static pthread_t listener_thread;
+static io_thread_t *io_threads;
+static int num_io_threads;
 
-pthread_t start_listener(int port, void (*server)(FILE *)) {
-    comm_port = port;
-    pthread_t tid;
+static void *io_loop(void *arg);
+static void conn_task(void *arg);
+
+// Starts the I/O threads and the listener thread, which serve connections
+// on port through handler.
+pthread_t start_listener(int port, comm_handler_t *handler) {
     int err;
 
-    if ((err = pthread_create(&tid, 0, (void * (*)(void *)) listener, (void *) server) ))
+    comm_port = port;
+    comm_handler = handler;
+
+    if ((num_io_threads = (int) sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        num_io_threads = 1;
+    if ((io_threads = calloc(num_io_threads, sizeof(io_thread_t))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i < num_io_threads; i++) {
+        if ((io_threads[i].epfd = epoll_create1(0)) < 0) {
+            perror("epoll_create1");
+            exit(1);
+        }
+        if ((err = pthread_create(&io_threads[i].thread, 0, io_loop, &io_threads[i])))
+            handle_error_en(err, "pthread_create");
+    }
+
+    if ((err = pthread_create(&listener_thread, 0, listener, NULL)))
         handle_error_en(err, "pthread_create");
-    if ((err = pthread_detach(tid)))
-        handle_error_en(err, "pthread_detach");
 
-    return tid;
+    return listener_thread;
 }
 
-void *listener(void (*server)(FILE *)) {
+// returns 1 if a connection is waiting to be accepted (only the listener
+// accepts, so accept won't block then)
+static int conn_waiting(void) {
+    struct pollfd pfd = {lsock, POLLIN, 0};
+
+    return poll(&pfd, 1, 0) > 0;
+}
+
+void *listener(void *arg) {
+    int next = 0;
+    int failing = 0;  // errno of the accepts failing since the last that didn't
+    (void) arg;
+
     if ((lsock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {  // make a new socket
         perror("socket");
         exit(1);
     }
 
+    int one = 1;
+    setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
@@ -48,57 +186,682 @@ void *listener(void (*server)(FILE *)) {
         if (close(lsock) < 0) perror("close");
         exit(1);
     }
- 
-    if (listen(lsock, 100) < 0) {  // start listening
+
+    if (listen(lsock, SOMAXCONN) < 0) {  // start listening
         perror("listen");
         if (close(lsock) < 0) perror("close");
         exit(1);
     }
 
     fprintf(stderr, "listening on port %d\n", comm_port);
+    if ((spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0)
+        perror("open");
 
     while (1) {
         int csock;
         struct sockaddr_in client_addr;
         socklen_t client_len = sizeof(client_addr);
+        comm_conn_t *conn;
+        struct epoll_event ev;
 
         if ((csock = accept(lsock, (struct sockaddr *) &client_addr, &client_len)) < 0) {
-            perror("accept");
+            int err = errno;
+            // interrupted, or the connection was gone before we got to it
+            if (err == EINTR || err == ECONNABORTED || err == EPROTO)
+                continue;
+            if (err != failing)
+                perror("accept");  // once until accept works again
+            failing = err;
+            if ((err == EMFILE || err == ENFILE) && spare_fd >= 0 && conn_waiting()) {
+                // Out of descriptors, with a connection waiting, so accept
+                // would fail again at once: take it with the spare one and
+                // close it, turning the client away.
+                close(spare_fd);
+                if ((csock = accept(lsock, NULL, NULL)) >= 0)
+                    close(csock);
+                spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            } else {
+                usleep(COMM_BACKOFF);  // rather than spin on what's wrong
+            }
             continue;
         }
+        failing = 0;
 
         fprintf(stderr, "received connection from %s#%hu\n",
             inet_ntoa(client_addr.sin_addr), client_addr.sin_port);
 
-        FILE *cxstr;
-        if (!(cxstr = fdopen(csock, "w+"))) {
-            perror("fdopen");
+        if (fcntl(csock, F_SETFL, fcntl(csock, F_GETFL) | O_NONBLOCK) < 0) {
+            perror("fcntl");
+            if (close(csock) < 0) perror("close");
+            continue;
+        }
+        setsockopt(csock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        if ((conn = malloc(sizeof(comm_conn_t))) == NULL) {
+            perror("malloc");
             if (close(csock) < 0) perror("close");
             continue;
         }
+        conn->fd = csock;
+        conn->epfd = io_threads[next].epfd;
+        conn->writing = 0;
+        conn->eof = 0;
+        conn->negotiated = 0;
+        conn->binary = 0;
+        conn->in_len = 0;
+        conn->out_start = 0;
+        conn->out_len = 0;
+        conn->out_base = 0;
+        conn->nextents = 0;
+        conn->big = NULL;
+        conn->held = 0;
+        conn->task.run = conn_task;
+        conn->task.arg = conn;
+        conn->failed = 0;
+        conn->mark = 0;
+        conn->parked = 0;
+        conn->resumed = 0;
+        conn->broken = 0;
+        next = (next + 1) % num_io_threads;
 
-        server(cxstr);
+        if ((conn->client = comm_handler->connect(conn)) == NULL) {
+            if (close(csock) < 0) perror("close");
+            free(conn);
+            continue;
+        }
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(conn->epfd, EPOLL_CTL_ADD, csock, &ev) < 0) {
+            perror("epoll_ctl");
+            comm_handler->disconnect(conn->client);
+            if (close(csock) < 0) perror("close");
+            free(conn);
+        }
     }
 
     return NULL;
 }
 
-void comm_shutdown(FILE *cxstr) {
-    if (fclose(cxstr) < 0) perror("fclose");
+// Closes a connection for good, from the thread that serves it.
+static void conn_close(comm_conn_t *conn) {
+    comm_handler->disconnect(conn->client);
+    fprintf(stderr, "client connection terminated\n");
+    // A child of db_print may still have the socket open, which would keep it
+    // in the epoll set after it is closed here.
+    epoll_ctl(conn->epfd, EPOLL_CTL_DEL, conn->fd, 0);
+    if (close(conn->fd) < 0) perror("close");
+    for (int i = 0; i < conn->nextents; i++) {
+        conn->extents[i].extent.release(conn->extents[i].extent.arg);
+    }
+    free(conn->big);
+    free(conn);
+}
+
+// Takes written bytes off the front of the output: buffered bytes and the
+// extents between them, releasing the extents that are all sent.
+static void conn_consume(comm_conn_t *conn, size_t written) {
+    while (written > 0) {
+        out_extent_t *next = (conn->nextents > 0)? &conn->extents[0]: NULL;
+        size_t take;
+
+        if (next != NULL && next->at == conn->out_base) {
+            take = next->extent.len - next->sent;
+            take = (written < take)? written: take;
+            next->sent += take;
+            if (next->sent == next->extent.len) {
+                next->extent.release(next->extent.arg);
+                memmove(&conn->extents[0], &conn->extents[1],
+                        --conn->nextents * sizeof(out_extent_t));
+            }
+        } else {
+            take = (next != NULL)? next->at - conn->out_base: conn->out_len;
+            take = (written < take)? written: take;
+            conn->out_start += take;
+            conn->out_len -= take;
+            conn->out_base += take;
+        }
+        written -= take;
+    }
+}
+
+// Writes as much buffered output as the socket will take, apart from what is
+// held back. Returns -1 if the connection is gone.
+static int conn_flush(comm_conn_t *conn) {
+    struct iovec iov[2 * COMM_EXTENTS + 1];
+    struct msghdr msg;
+    ssize_t written;
+
+    while (conn->out_len > conn->held) {
+        size_t ready = conn->out_len - conn->held;
+        size_t done = 0;
+        int n = 0;
+
+        // an extent at the held part belongs to a held response
+        for (int i = 0; i < conn->nextents && conn->extents[i].at < conn->out_base + ready; i++) {
+            out_extent_t *ext = &conn->extents[i];
+            size_t before = ext->at - conn->out_base - done;
+            if (before > 0) {
+                iov[n].iov_base = conn->out + conn->out_start + done;
+                iov[n++].iov_len = before;
+                done += before;
+            }
+            iov[n].iov_base = (char *) (uintptr_t) ext->extent.data + ext->sent;
+            iov[n++].iov_len = ext->extent.len - ext->sent;
+        }
+        if (ready > done) {
+            iov[n].iov_base = conn->out + conn->out_start + done;
+            iov[n++].iov_len = ready - done;
+        }
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        written = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        conn_consume(conn, written);
+    }
+    if (conn->out_len == 0)
+        conn->out_start = 0;
+    return 0;
+}
+
+// returns the size of the binary request at the start of buf, which holds len
+// bytes, or 0 if not even its header is there yet
+static size_t frame_size(char *buf, size_t len) {
+    comm_frame_t frame;
+
+    if (len < sizeof(frame))
+        return 0;
+    memcpy(&frame, buf, sizeof(frame));
+    return sizeof(frame) + ntohs(frame.key_len) + 1 + (size_t) ntohl(frame.value_len) + 1;
+}
+
+// makes room for len more bytes of output right after what's there
+static char *conn_reserve(comm_conn_t *conn, size_t len) {
+    if (conn->out_start + conn->out_len + len > COMM_OUTBUF) {
+        memmove(conn->out, conn->out + conn->out_start, conn->out_len);
+        conn->out_start = 0;
+    }
+    return conn->out + conn->out_start + conn->out_len;
+}
+
+// Makes sure there is room for one more response, writing out what we have
+// if we must. Returns 1 if there is, 0 if not, and -1 if the connection is
+// gone.
+static int conn_room(comm_conn_t *conn, size_t len) {
+    if (COMM_OUTBUF - conn->out_len >= len && conn->nextents < COMM_EXTENTS)
+        return 1;
+    if (conn_flush(conn) < 0)
+        return -1;
+    return COMM_OUTBUF - conn->out_len >= len && conn->nextents < COMM_EXTENTS;
+}
+
+// queues an extent to go right after the output that's there
+static void conn_extent(comm_conn_t *conn, comm_extent_t *extent) {
+    out_extent_t *ext = &conn->extents[conn->nextents++];
+
+    ext->extent = *extent;
+    ext->at = conn->out_base + conn->out_len;
+    ext->sent = 0;
+}
+
+// Runs the binary request at buf, whose whole frame is there, appending its
+// response. Returns -1 if the connection should be closed.
+static int conn_run_frame(comm_conn_t *conn, char *buf) {
+    comm_frame_t frame;
+    comm_extent_t extent;
+    char *reply = conn_reserve(conn, sizeof(frame) + BUFLEN);
+    char *result = reply + sizeof(frame);
+    int status = COMM_BAD;
+    size_t len = 0;
+
+    memcpy(&frame, buf, sizeof(frame));
+    char *key = buf + sizeof(frame);
+    size_t key_len = ntohs(frame.key_len);
+    char *value = key + key_len + 1;
+    size_t value_len = ntohl(frame.value_len);
+
+    result[0] = '\0';
+    extent.data = NULL;
+    if (key[key_len] == '\0' && value[value_len] == '\0'
+            && strlen(key) == key_len && strlen(value) == value_len) {
+        status = comm_handler->request(conn->client, frame.op, key, value, result, &extent);
+        if (status < 0)
+            return -1;
+        if (extent.data != NULL) {
+            len = extent.len;
+        } else if (status == COMM_OK && frame.op == 'q') {
+            len = strlen(result);
+        }
+    }
+
+    frame.status = status;
+    frame.key_len = 0;
+    frame.value_len = htonl(len);
+    memcpy(reply, &frame, sizeof(frame));
+    conn->out_len += sizeof(frame);
+    conn->held += sizeof(frame);
+    if (extent.data != NULL) {
+        // the value goes out from where the handler keeps it, before its '\0'
+        conn_extent(conn, &extent);
+        len = 0;
+    }
+    result[len] = '\0';
+    conn->out_len += len + 1;
+    conn->held += len + 1;
+    return 0;
+}
+
+// Runs the binary requests in the input buffer, in order, as long as there
+// is room for their responses, like conn_process does command lines. The key
+// and value of a request are passed on where they are, since each is
+// already followed by its '\0'. A request too big for the input buffer is
+// moved to a buffer of its own, big, which is read into until the request
+// is all there. Returns -1 if the connection should be closed.
+static int conn_process_binary(comm_conn_t *conn) {
+    size_t start = 0;
+    size_t size;
+    int room;
+
+    while (1) {
+        char *buf = (conn->big != NULL)? conn->big: conn->in + start;
+        size_t len = (conn->big != NULL)? conn->big_len: conn->in_len - start;
+
+        if ((size = frame_size(buf, len)) == 0)
+            break;
+        if (size > COMM_FRAME_MAX)
+            return -1;  // not a request we'll take
+        if (size > COMM_INBUF && conn->big == NULL) {
+            if ((conn->big = malloc(size)) == NULL)
+                return -1;
+            memcpy(conn->big, buf, len);
+            conn->big_len = len;
+            conn->big_size = size;
+            start = conn->in_len;
+            continue;
+        }
+        if (size > len)
+            break;  // wait for the rest of it
+
+        if ((room = conn_room(conn, sizeof(comm_frame_t) + BUFLEN)) <= 0) {
+            if (room < 0)
+                return -1;
+            break;
+        }
+        if (conn_run_frame(conn, buf) < 0)
+            return -1;
+        if (conn->big != NULL) {
+            free(conn->big);
+            conn->big = NULL;
+        } else {
+            start += size;
+        }
+    }
+
+    conn->in_len -= start;
+    memmove(conn->in, conn->in + start, conn->in_len);
+    return 0;
 }
 
-int comm_serve(FILE *cxstr, char *response, char *command) {
-    if (strlen(response) > 0) {
-        if (fputs(response, cxstr) == EOF || fputc('\n', cxstr) == EOF || fflush(cxstr) == EOF) {
-            fprintf(stderr, "client connection terminated\n");
+// Runs the command lines in the input buffer, in order, as long as there is
+// room for their responses. The responses are only written out when the
+// output buffer fills up. A line that is too long is cut into commands of
+// BUFLEN - 1 bytes, and a last line without a newline is run once the client
+// has finished sending, the way fgets would. Returns -1 if the connection
+// should be closed.
+static int conn_process(comm_conn_t *conn) {
+    char command[BUFLEN];
+    char response[BUFLEN];
+    comm_extent_t extent;
+    char *line;
+    size_t start = 0;
+    int room;
+
+    // a binary client says so with its first byte, which gets echoed
+    if (!conn->negotiated && conn->in_len > 0) {
+        conn->negotiated = 1;
+        if ((unsigned char) conn->in[0] == COMM_BINARY) {
+            conn->binary = 1;
+            memmove(conn->in, conn->in + 1, --conn->in_len);
+            *conn_reserve(conn, 1) = (char) COMM_BINARY;
+            conn->out_len++;
+            conn->held++;
+        }
+    }
+    if (conn->binary)
+        return conn_process_binary(conn);
+    if (conn->parked)
+        return 0;
+
+    while (1) {
+        char *newline = memchr(conn->in + start, '\n', conn->in_len - start);
+        size_t len = (newline != NULL)? (size_t) (newline - (conn->in + start)) + 1: conn->in_len - start;
+
+        if (len > BUFLEN - 1)
+            len = BUFLEN - 1;
+        else if (newline == NULL && (!conn->eof || len == 0))
+            break;  // wait for the rest of the line
+
+        // make room for the response, writing out what we have if we must
+        if ((room = conn_room(conn, BUFLEN + 1)) <= 0) {
+            if (room < 0)
+                return -1;
+            break;
+        }
+
+        // a whole line is run where it is, with its newline as its end
+        if (newline != NULL && len == (size_t) (newline - (conn->in + start)) + 1) {
+            line = conn->in + start;
+            *newline = '\0';
+        } else {
+            line = command;
+            memcpy(command, conn->in + start, len);
+            command[len] = '\0';
+        }
+        start += len;
+
+        response[0] = '\0';
+        extent.data = NULL;
+        if ((room = comm_handler->command(conn->client, line, response, &extent)) < 0)
             return -1;
+        if (room > 0) {
+            // the response comes from comm_resume, and the lines after wait
+            conn->parked = 1;
+            break;
         }
+
+        len = strlen(response);
+        memcpy(conn_reserve(conn, len + 1), response, len);
+        conn->out_len += len;
+        conn->held += len;
+        if (extent.data != NULL)
+            conn_extent(conn, &extent);
+        conn->out[conn->out_start + conn->out_len] = '\n';
+        conn->out_len++;
+        conn->held++;
     }
 
-    if (fgets(command, BUFLEN, cxstr) == NULL) {
-        fprintf(stderr, "client connection terminated\n");
+    conn->in_len -= start;
+    memmove(conn->in, conn->in + start, conn->in_len);
+    return 0;
+}
+
+// Takes the response to a parked command once comm_resume has given it,
+// holding it back like any other. Until then it only writes out the
+// responses that went before, and keeps the connection whatever happens to
+// the socket, since the command still has it. Returns 1 once the connection
+// is no longer parked, -1 if it should be closed, and 0 otherwise.
+static int conn_unpark(comm_conn_t *conn) {
+    size_t len;
+    int room;
+
+    if (!__atomic_load_n(&conn->resumed, __ATOMIC_ACQUIRE)) {
+        if (!conn->broken && conn_flush(conn) < 0)
+            conn->broken = 1;
+        return 0;
+    }
+    while (__atomic_load_n(&conn->resumed, __ATOMIC_ACQUIRE) != 2) {
+        sched_yield();  // comm_resume is in its last epoll_ctl
+    }
+    if (conn->broken)
         return -1;
+    if ((room = conn_room(conn, BUFLEN + 1)) <= 0)
+        return room;
+
+    len = strlen(conn->late);
+    memcpy(conn_reserve(conn, len + 1), conn->late, len);
+    conn->out[conn->out_start + conn->out_len + len] = '\n';
+    conn->out_len += len + 1;
+    conn->held += len + 1;
+    conn->parked = 0;
+    conn->resumed = 0;
+    return 1;
+}
+
+// Handles the events epoll reported for a connection, holding back the
+// responses to the commands it runs, or only reading if run is 0 (the
+// commands are then left to conn_task). Returns -1 if the connection should
+// be closed.
+static int conn_service(comm_conn_t *conn, int run) {
+    int reads = 0;
+    ssize_t got;
+    int unparked;
+
+    if (conn->parked && (unparked = conn_unpark(conn)) <= 0)
+        return unparked;
+    if (conn->out_len > 0 && conn_flush(conn) < 0)
+        return -1;
+
+    // Only read more once the client has taken all our responses. Then keep
+    // reading and running commands until the socket has nothing more for us,
+    // and write all their responses out together.
+    if (conn->out_len == 0) {
+        while (!conn->eof && reads++ < COMM_READS) {
+            if (conn->big != NULL) {
+                if (conn->big_len == conn->big_size)
+                    break;
+                got = read(conn->fd, conn->big + conn->big_len, conn->big_size - conn->big_len);
+            } else {
+                if (conn->in_len == COMM_INBUF)
+                    break;
+                got = read(conn->fd, conn->in + conn->in_len, COMM_INBUF - conn->in_len);
+            }
+            if (got < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                return -1;
+            }
+            if (got == 0)
+                conn->eof = 1;
+            if (conn->big != NULL) {
+                conn->big_len += got;
+            } else {
+                conn->in_len += got;
+            }
+            if (run && conn_process(conn) < 0)
+                return -1;
+            if (COMM_OUTBUF - conn->out_len < BUFLEN + 1)
+                break;  // the socket isn't keeping up
+        }
     }
 
+    if ((run && conn_process(conn) < 0) || conn_flush(conn) < 0)
+        return -1;
     return 0;
 }
+
+// Code executed by a worker for a connection: runs the commands that have
+// come in, holding back their responses.
+static void conn_task(void *arg) {
+    comm_conn_t *conn = (comm_conn_t *) arg;
+
+    conn->failed = (conn_process(conn) < 0);
+    conn->mark = comm_handler->mark();
+}
+
+// returns 1 if the input holds a whole command line or binary request
+static int conn_runnable(comm_conn_t *conn) {
+    size_t size;
+
+    if (conn->parked)
+        return 0;
+    if (!conn->negotiated)
+        return 1;
+    if (conn->big != NULL)
+        return conn->big_len == conn->big_size;
+    if (conn->binary) {
+        // a request too big for in is ready to be moved out of it
+        size = frame_size(conn->in, conn->in_len);
+        return size > 0 && (size <= conn->in_len || size > COMM_INBUF);
+    }
+    return conn->eof || conn->in_len >= BUFLEN - 1 || memchr(conn->in, '\n', conn->in_len) != NULL;
+}
+
+// Waits for the socket to take the output a parked connection has left, and
+// then for comm_resume, with the connection taken out of epoll so that
+// nothing else about it wakes the thread up. Returns 1 if comm_resume has
+// already been called, and 0 otherwise.
+static int conn_park(comm_conn_t *conn) {
+    struct epoll_event ev;
+    int writing = (conn->out_len > 0 && !conn->broken)? 1: -1;
+
+    if (conn->writing != writing) {
+        conn->writing = writing;
+        ev.events = (writing > 0)? EPOLLOUT: EPOLLONESHOT;
+        ev.data.ptr = conn;
+        if (epoll_ctl(conn->epfd, EPOLL_CTL_MOD, conn->fd, &ev) < 0)
+            conn->broken = 1;
+    }
+    if (writing > 0)
+        return 0;
+    // comm_resume sets resumed before it asks for EPOLLOUT: if it isn't set
+    // yet, that comes after the epoll_ctl above
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&conn->resumed, __ATOMIC_ACQUIRE) != 0;
+}
+
+// Lets the held responses of a connection go once they're durable, and waits
+// for the socket to take any output that's left, or else for more input.
+// Returns -1 if the connection should be closed, 1 if there is input left
+// over that can be run now, and 0 otherwise.
+static int conn_release(comm_conn_t *conn) {
+    struct epoll_event ev;
+
+    conn->held = 0;
+    if (conn->parked)
+        return conn_park(conn);
+    if (conn_flush(conn) < 0)
+        return -1;
+
+    if (conn->out_len == 0 && (conn->in_len > 0 || conn->big != NULL) && conn_runnable(conn))
+        return 1;
+
+    // The client is done sending and has all its responses.
+    if (conn->eof && conn->out_len == 0)
+        return -1;
+
+    if (conn->writing != (conn->out_len > 0)) {
+        conn->writing = (conn->out_len > 0);
+        ev.events = conn->writing? EPOLLOUT: EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(conn->epfd, EPOLL_CTL_MOD, conn->fd, &ev) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Code executed by an I/O thread
+static void *io_loop(void *arg) {
+    io_thread_t *self = (io_thread_t *) arg;
+    struct epoll_event events[COMM_EVENTS];
+    comm_conn_t *ready[COMM_EVENTS];
+    pool_task_t *tasks[COMM_EVENTS];
+    int pooled = pool_running();
+    uint64_t mark;
+    int n;
+    int r;
+
+    while (1) {
+        if ((n = epoll_wait(self->epfd, events, COMM_EVENTS, -1)) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            exit(1);
+        }
+        for (int i = 0; i < n; i++) {
+            ready[i] = (comm_conn_t *) events[i].data.ptr;
+        }
+
+        // A connection whose output filled up may have commands left that it
+        // can run once the output is out: it goes around again.
+        while (n > 0) {
+            int t = 0;
+            for (int i = 0; i < n; i++) {
+                if (conn_service(ready[i], !pooled) < 0) {
+                    conn_close(ready[i]);
+                    ready[i] = NULL;
+                } else if (pooled && (ready[i]->in_len > 0 || ready[i]->big != NULL)) {
+                    tasks[t++] = &ready[i]->task;
+                }
+            }
+            if (pooled) {
+                pool_run(tasks, t);
+                mark = 0;
+                for (int i = 0; i < n; i++) {
+                    if (ready[i] == NULL)
+                        continue;
+                    if (ready[i]->failed) {
+                        conn_close(ready[i]);
+                        ready[i] = NULL;
+                    } else if (ready[i]->mark > mark) {
+                        mark = ready[i]->mark;
+                    }
+                }
+            } else {
+                mark = comm_handler->mark();
+            }
+            comm_handler->sync(mark);
+            r = n;
+            n = 0;
+            for (int i = 0; i < r; i++) {
+                int left;
+                if (ready[i] == NULL)
+                    continue;
+                if ((left = conn_release(ready[i])) < 0) {
+                    conn_close(ready[i]);
+                } else if (left > 0) {
+                    ready[n++] = ready[i];
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// Shuts a connection down from any thread. The thread that serves it sees
+// the connection end and closes it, calling handler->disconnect; until then
+// the caller must make sure the connection isn't closed under it.
+void comm_close(comm_conn_t *conn) {
+    shutdown(conn->fd, SHUT_RDWR);
+}
+
+// Gives a connection the response to the command that handler->command
+// returned 1 for, from any thread, and has the thread that serves it send
+// the response and go on with the commands after it.
+void comm_resume(comm_conn_t *conn, const char *response) {
+    struct epoll_event ev;
+
+    snprintf(conn->late, BUFLEN, "%s", response);
+    __atomic_store_n(&conn->resumed, 1, __ATOMIC_SEQ_CST);
+    ev.events = EPOLLOUT;
+    ev.data.ptr = conn;
+    epoll_ctl(conn->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+    // the connection may be closed as soon as this is seen
+    __atomic_store_n(&conn->resumed, 2, __ATOMIC_RELEASE);
+}
+
+// Stops the listener and the I/O threads. Every connection must already be
+// closed.
+void comm_stop(void) {
+    pthread_cancel(listener_thread);
+    pthread_join(listener_thread, NULL);
+    for (int i = 0; i < num_io_threads; i++) {
+        pthread_cancel(io_threads[i].thread);
+        pthread_join(io_threads[i].thread, NULL);
+        close(io_threads[i].epfd);
+    }
+    close(lsock);
+    if (spare_fd >= 0)
+        close(spare_fd);
+    free(io_threads);
+}
@@ -2,14 +2,83 @@
 #define COMM_H_
 
 #include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <errno.h>
 
-#define BUFLEN 256 
+#define BUFLEN 1024  // longest command or response line, with its newline
 #define handle_error_en(en, msg) \
         do { errno = en; perror(msg); exit(EXIT_FAILURE); } while (0)
 
-pthread_t start_listener(int port, void (*serve_func)(FILE *));
-void comm_shutdown(FILE * cxstr);
-int comm_serve(FILE *cxstr, char *resp, char *cmd);
+typedef struct comm_conn comm_conn_t;
+
+/*
+ * The binary protocol, for programs. A client that sends COMM_BINARY as the
+ * first byte on a connection gets the same byte back, and from then on sends
+ * requests and gets responses as frames: a comm_frame_t with every field in
+ * network byte order, then the key and then the value, each followed by a
+ * '\0' that their lengths don't count. Responses have no key, and a value
+ * only for a query that found one. They come back in the order of the
+ * requests, with their ops and ids. Keys and values can hold any byte but
+ * '\0', and a whole request can be up to COMM_FRAME_MAX bytes.
+ */
+#define COMM_BINARY 0xb1
+#define COMM_FRAME_MAX (17 << 20)
+#define COMM_OK 0   // found, added or removed
+#define COMM_NO 1   // not found, already there or not there
+#define COMM_BAD 2  // not a request that can be run
+
+typedef struct comm_frame {
+    uint8_t op;         // 'q', 'a' or 'd'
+    uint8_t status;     // of a response
+    uint16_t key_len;
+    uint32_t value_len;
+    uint32_t id;        // chosen by the client
+} comm_frame_t;
+
+/*
+ * Bytes to be sent as part of a response from where they are, rather than
+ * copied into the connection's output. release(arg) is called once they are
+ * sent, or the connection is gone.
+ */
+typedef struct comm_extent {
+    const char *data;   // NULL for none
+    size_t len;
+    void (*release)(void *arg);
+    void *arg;
+} comm_extent_t;
+
+/*
+ * What the server does with its connections. connect is called for every
+ * new connection and returns the server's state for it, or NULL to turn the
+ * connection away; command and disconnect get that state back. command runs
+ * one command line (without its newline, and which it may change) and
+ * writes the response line (without its newline) into response, which holds
+ * BUFLEN bytes. It returns -1 to close the connection, or 1 if the command
+ * goes on somewhere else: its response is then given later with
+ * comm_resume, and the connection runs nothing more until then.
+ * mark returns a mark for the changes made by the commands the calling
+ * thread has run, and sync waits until the changes up to a mark are durable;
+ * responses are only sent after that. Commands may run on a different thread
+ * than the one that syncs for them. request runs a binary request (op and
+ * key and value, which are '\0'-terminated), writing a query's value into
+ * result, which holds BUFLEN bytes, and returns its status, or -1 to close
+ * the connection. Either may set extent to have bytes sent after what it
+ * wrote (the response line, or the value in result), as part of it.
+ */
+typedef struct comm_handler {
+    void *(*connect)(comm_conn_t *conn);
+    int (*command)(void *client, char *command, char *response, comm_extent_t *extent);
+    int (*request)(void *client, int op, char *key, char *value, char *result,
+            comm_extent_t *extent);
+    void (*disconnect)(void *client);
+    uint64_t (*mark)(void);
+    void (*sync)(uint64_t mark);
+} comm_handler_t;
+
+pthread_t start_listener(int port, comm_handler_t *handler);
+void comm_close(comm_conn_t *conn);
+void comm_resume(comm_conn_t *conn, const char *response);
+void comm_stop(void);
 
 #endif  // COMM_H_
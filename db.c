@@ -1,457 +1,1446 @@
-#include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <sched.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include <pthread.h>
 #include "./db.h"
+#include "./engine.h"
+#include "./blob.h"
+#include "./epoch.h"
+#include "./filter.h"
+#include "./keyindex.h"
+#include "./keysearch.h"
+#include "./snapshot.h"
+#include "./wal.h"
 
-#define MAXLEN 256
-#define lock(lt, lk) ((lt) == l_read)? pthread_rwlock_rdlock(lk): pthread_rwlock_wrlock(lk)
+// The storage engines the database can run on; the first one is the default.
+static db_engine_t *engines[] = {&tree_engine, &skiplist_engine, &btree_engine, &art_engine, 0};
 
-// The root node of the binary tree, unlike all 
-// other nodes in the tree, this one is never 
-// freed (it's allocated in the data region).
-node_t head = {"", "", 0, 0, PTHREAD_RWLOCK_INITIALIZER};
-// constructs a node
-node_t *node_constructor(char *arg_name, char *arg_value, node_t *arg_left, node_t *arg_right) {
-    size_t name_len = strlen(arg_name);
-    size_t val_len = strlen(arg_value);
+static db_engine_t *engine;
 
-    if (name_len > MAXLEN || val_len > MAXLEN)
-        return 0;
+#define DB_BATCH_MAX 256  // keys in one batch command
+#define DB_KEY_LOCKS 64   // locks that keep the changes to a key in log order
+#define DB_LOAD_CHUNK (1 << 20)   // bytes of a file parsed by one task
+#define DB_LOAD_PROGRESS 1000000  // keys between progress reports of a file load
 
-    node_t *new_node = (node_t *)malloc(sizeof(node_t));
-    
-    if (new_node == 0)
-        return 0;
-    
-    if ((new_node->name = (char *)malloc(name_len+1)) == 0) {
-        free(new_node);
-        return 0;
+// A change to a key is made under the key's lock (picked by hash) whenever
+// something needs changes held off or kept in order. With a log, the
+// change's record is appended under it too, so that the log has the changes
+// to every key in the order they were made, and replaying it gives the same
+// result. The index and blobs need a key's changes one at a time, and
+// db_print takes all of them to stop changes for a moment. Each of those
+// counts in lock_changes while it needs the locks (the log, the index and
+// blobs for good). Otherwise a change only counts itself in unlocked, at its
+// lock's number, so the engine's own concurrency is all it relies on, and
+// whoever counts in to lock_changes can wait for it to be done.
+static int logging;
+static pthread_mutex_t key_locks[DB_KEY_LOCKS];
+static int lock_changes;
+static int blobs_locked;       // BLOBS_LOCKED once a blob has made the locks needed
+
+#define BLOBS_LOCKING 1        // blobs_locked while the locks are being made needed
+#define BLOBS_LOCKED 2
+
+// The changes being made without a key lock, under one lock's hash. Each is
+// on a cache line of its own, as the locks are.
+typedef struct db_unlocked {
+    unsigned long n;
+} __attribute__((aligned(64))) db_unlocked_t;
+
+static db_unlocked_t unlocked[DB_KEY_LOCKS];
+
+// A checkpoint writes every key to the snapshot at snap_path so that the log
+// before it can go; one runs at a time.
+static char snap_path[4096];
+static pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// One thread at a time rebuilds the index, when it gets crowded.
+static pthread_mutex_t rebuild_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Tasks handed out by engine_parallel.
+typedef struct parallel {
+    void (*fn)(void *arg, int task);
+    void *arg;
+    int tasks;
+    int next;               // the next task to hand out
+} parallel_t;
+
+// An add from a file being loaded in bulk, with the first bytes of its name
+// to sort by.
+typedef struct load_op {
+    uint64_t prefix;        // see key_prefix
+    db_op_t op;
+} load_op_t;
+
+// A part of a file being loaded in bulk, cut off at the end of a line.
+typedef struct load_chunk {
+    char *start;
+    char *end;
+    load_op_t *ops;         // the adds in it, in file order
+    unsigned char *locks;   // the key lock of each add
+    size_t n;
+    size_t capacity;
+    size_t first;           // number of its first add in the file
+    size_t at[DB_KEY_LOCKS];  // adds under each key lock, then where they go
+} load_chunk_t;
+
+// A file being loaded in bulk (see load_file).
+typedef struct file_load {
+    char *name;
+    load_chunk_t *chunks;
+    int nchunks;
+    int other;              // set if a line isn't one a bulk load can run
+    load_op_t *ops;         // every add, grouped by key lock
+    size_t groups[DB_KEY_LOCKS + 1];  // where each key lock's adds start
+    size_t done;            // adds run so far
+    size_t added;
+    uint64_t marks[DB_KEY_LOCKS];     // db_mark of each group's last change
+} file_load_t;
+
+// One page of a range or prefix scan, filled in by scan_visit.
+typedef struct scan_page {
+    char *buf;              // the pairs, each with a space before it
+    int len;
+    int used;
+    int n;
+    int limit;              // most pairs to return, or -1 for no limit
+    int more;               // set if the scan stopped before the end
+    char cursor[MAXLEN];    // the first key that wasn't returned
+} scan_page_t;
+
+/* Sets up the storage engine with the given name, or the default one if
+ * name is NULL. Must be called once, before any other database function.
+ *
+ * Returns 0 on success, or -1 if there is no engine with that name. */
+int db_init(char *name) {
+    for (int i = 0; i < DB_KEY_LOCKS; i++) {
+        pthread_mutex_init(&key_locks[i], 0);
     }
-    
-    if ((new_node->value = (char *)malloc(val_len+1)) == 0) {
-        free(new_node->name);
-        free(new_node);
-        return 0;
+    for (int i = 0; engines[i] != 0; i++) {
+        if (name == NULL || strcmp(name, engines[i]->name) == 0) {
+            engine = engines[i];
+            engine->init();
+            return 0;
+        }
     }
+    return -1;
+}
 
-    if ((snprintf(new_node->name, MAXLEN, "%s", arg_name)) < 0) {
-        free(new_node->value);
-        free(new_node->name);
-        free(new_node);
-        return 0;
-    } else if ((snprintf(new_node->value, MAXLEN, "%s", arg_value)) < 0) {
-        free(new_node->value);
-        free(new_node->name);
-        free(new_node);
-        return 0;
+// Code executed by the threads of engine_parallel: runs tasks until there
+// are none left.
+static void *parallel_worker(void *arg) {
+    parallel_t *work = (parallel_t *) arg;
+    int task;
+
+    while ((task = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) < work->tasks) {
+        work->fn(work->arg, task);
     }
+    return NULL;
+}
+
+void engine_parallel(int tasks, void (*fn)(void *arg, int task), void *arg) {
+    parallel_t work = {fn, arg, tasks, 0};
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = (cpus < tasks)? (int) cpus: tasks;
+    pthread_t threads[nthreads > 1? nthreads - 1: 1];
+    int err;
 
-    new_node->lchild = arg_left;
-    new_node->rchild = arg_right;
-    return new_node;
+    // the calling thread takes tasks too
+    for (int i = 0; i < nthreads - 1; i++) {
+        if ((err = pthread_create(&threads[i], 0, parallel_worker, &work))) {
+            errno = err;
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    parallel_worker(&work);
+    for (int i = 0; i < nthreads - 1; i++) {
+        pthread_join(threads[i], NULL);
+    }
 }
 
-// destroys a node
-void node_destructor(node_t *node) {
-    if (node->name != 0)
-        free(node->name);
-    if (node->value != 0)
-        free(node->value);
-    free(node);
+// Keys and values from the binary protocol can hold whitespace, which would
+// split a field of a log record, and values can be longer than a record
+// read with sscanf's "%255s". Records for them ('A' and 'D' instead of 'a'
+// and 'd') have every whitespace character and '\\' in their fields written
+// as '\\' and two hex digits.
+
+// returns 1 if field can't go into a record as it is
+static int needs_escape(char *field) {
+    for (; *field != '\0'; field++) {
+        if (isspace((unsigned char) *field) || *field == '\\')
+            return 1;
+    }
+    return 0;
 }
 
-// type for locking
-enum locktype {l_read, l_write};
+// writes field escaped to out, which must hold 3 * strlen(field) + 1 bytes
+static void escape_field(char *out, char *field) {
+    for (; *field != '\0'; field++) {
+        if (isspace((unsigned char) *field) || *field == '\\') {
+            out += sprintf(out, "\\%02x", (unsigned char) *field);
+        } else {
+            *out++ = *field;
+        }
+    }
+    *out = '\0';
+}
 
-node_t *search(char *, node_t *, node_t **, enum locktype);
+// undoes escape_field in place; returns -1 if field wasn't escaped right
+// or is max bytes or longer
+static int unescape_field(char *field, size_t max) {
+    char *out = field;
+    unsigned int c;
 
-// queries for a key
-void db_query(char *name, char *result, int len) {
-    node_t *target;
-    if (lock(l_read, &head.lock) == EDEADLK) {
-        fprintf(stderr, "%s\n", "lock failed. deadlock1.");
-        exit(1);
-    }  
-    target = search(name, &head, 0, l_read);
-    
-    if (target == 0) {
-        snprintf(result, len, "not found");
-        return;
+    for (char *in = field; *in != '\0'; out++) {
+        if (*in == '\\') {
+            if (!isxdigit((unsigned char) in[1]) || !isxdigit((unsigned char) in[2])
+                    || sscanf(in + 1, "%2x", &c) != 1 || c == 0)
+                return -1;
+            *out = (char) c;
+            in += 3;
+        } else {
+            *out = *in++;
+        }
+    }
+    *out = '\0';
+    return ((size_t) (out - field) < max)? 0: -1;
+}
+
+// Makes every change take its key lock from now on, until unrequire_locks,
+// and waits for the changes being made without one to be done.
+static void require_locks(void) {
+    __atomic_add_fetch(&lock_changes, 1, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < DB_KEY_LOCKS; i++) {
+        while (__atomic_load_n(&unlocked[i].n, __ATOMIC_SEQ_CST) > 0) {
+            sched_yield();
+        }
+    }
+}
+
+static void unrequire_locks(void) {
+    __atomic_sub_fetch(&lock_changes, 1, __ATOMIC_RELEASE);
+}
+
+// Takes key lock i for a change if anything needs it (see lock_changes), or
+// else counts the change in without it. Returns 1 if it took the lock. The
+// count goes up before lock_changes is read, and require_locks counts in
+// before it reads the counts, so one of them sees the other.
+static int change_lock(int i) {
+    if (!__atomic_load_n(&lock_changes, __ATOMIC_SEQ_CST)) {
+        __atomic_add_fetch(&unlocked[i].n, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&lock_changes, __ATOMIC_SEQ_CST))
+            return 0;
+        __atomic_sub_fetch(&unlocked[i].n, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_lock(&key_locks[i]);
+    return 1;
+}
+
+// ends a change that change_lock let start
+static void change_unlock(int i, int locked) {
+    if (locked) {
+        pthread_mutex_unlock(&key_locks[i]);
     } else {
-        snprintf(result, len, "%s", target->value);
-        // UNLOCK thing that is found.
-        if (pthread_rwlock_unlock(&target->lock) == EPERM) {
-            fprintf(stderr, "%s\n", "unlock failed. wasn't locked");
-            exit(1);
-        }  
+        __atomic_sub_fetch(&unlocked[i].n, 1, __ATOMIC_RELEASE);
+    }
+}
+
+// returns 1 if value goes into a blob: it's too long, or could be taken for
+// a reference
+static inline int goes_in_blob(char *value) {
+    return value[0] == BLOB_TAG || strlen(value) >= MAXLEN;
+}
+
+// Makes every change take its key lock for good, once a value is about to
+// go into a blob. Removes look up the blob to drop before removing, and
+// fetch holds it under the lock, so neither may race an unlocked change.
+// The first thread to get here raises lock_changes and waits out the
+// unlocked changes before it publishes BLOBS_LOCKED; others wait for that,
+// so none stores a blob while a change may still go without its lock. Must
+// be called without a key lock.
+static void lock_for_blobs(void) {
+    int state = 0;
+
+    if (__atomic_load_n(&blobs_locked, __ATOMIC_ACQUIRE) == BLOBS_LOCKED)
         return;
+    if (__atomic_compare_exchange_n(&blobs_locked, &state, BLOBS_LOCKING, 0,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        require_locks();
+        __atomic_store_n(&blobs_locked, BLOBS_LOCKED, __ATOMIC_RELEASE);
+        return;
+    }
+    while (__atomic_load_n(&blobs_locked, __ATOMIC_ACQUIRE) != BLOBS_LOCKED) {
+        sched_yield();
+    }
+}
+
+// returns the value to hand to the engine for value: value itself, or a
+// reference written into ref (BLOB_REF bytes) to a new blob holding it if
+// it's too long or could be taken for a reference
+static char *store_value(char *value, char *ref) {
+    if (!goes_in_blob(value))
+        return value;
+    return blob_store(value, strlen(value), ref);
+}
+
+// lets go of the blob a value from the engine refers to, if it does
+static void drop_value(char *stored) {
+    blob_t *blob = blob_of(stored);
+
+    if (blob != NULL)
+        blob_drop(blob);
+}
+
+// Copies the value of name, as the engine keeps it, into result, or "" if
+// it isn't there: from the index if it can tell, and otherwise from the
+// engine.
+static inline void lookup(char *name, char *result, int len) {
+    if (keyindex_query(name, result, len) < 0)
+        engine->query(name, result, len);
+}
+
+// adds a key to the engine, storing a long value out of line, and then to
+// the index. The key is counted into the filter first, and out again if it
+// was already there.
+static int add_key(char *name, char *value) {
+    char ref[BLOB_REF];
+    char *stored = store_value(value, ref);
+    int added;
+
+    filter_add(name);
+    if ((added = engine->add(name, stored))) {
+        keyindex_add(name, stored);
+    } else {
+        filter_remove(name);
+        if (stored == ref)
+            drop_value(stored);
     }
+    return added;
 }
 
-// adds a new node into the tree
-int db_add(char *name, char *value) {
-    node_t *parent;
-    node_t *target;
-    node_t *newnode;
-    pthread_rwlock_wrlock(&head.lock);
-    if ((target = search(name, &head, &parent, l_write)) != 0) {
-        pthread_rwlock_unlock(&target->lock);
-        pthread_rwlock_unlock(&parent->lock);
-        return(0);
+// removes a key from the engine, dropping the blob its value was in, and
+// then from the index and the filter
+static int remove_key(char *name) {
+    char old[MAXLEN];
+    int removed;
+
+    old[0] = '\0';
+    if (blob_any())
+        lookup(name, old, MAXLEN);
+    if ((removed = engine->remove(name))) {
+        drop_value(old);
+        keyindex_remove(name);
+        filter_remove(name);
     }
+    return removed;
+}
 
-    newnode = node_constructor(name, value, 0, 0);
-    pthread_rwlock_init(&newnode->lock, 0);
+// splits the next field off a record at *pos: up to end (a space or the
+// newline), which is overwritten. Returns NULL if there is no end.
+static char *record_field(char **pos, char end) {
+    char *field = *pos;
+    char *stop = strchr(field, end);
 
-    if (strcmp(name, parent->name) < 0)
-        parent->lchild = newnode;
-    else
-        parent->rchild = newnode;
-    pthread_rwlock_unlock(&parent->lock);
-    return(1);
+    if (stop == NULL || stop == field)
+        return NULL;
+    *stop = '\0';
+    *pos = stop + 1;
+    return field;
 }
-// removes a the input argument from the tree.
-int db_remove(char *name) {
-    node_t *parent;
-    node_t *dnode;
-    node_t *next;
 
-    // first, find the node to be removed 
-    // rdlock the head before search.
-    if (lock(l_read, &head.lock) == EDEADLK) {
-        fprintf(stderr, "%s\n", "lock failed. deadlock2.");
-        exit(1);
-    }  
-    if ((dnode = search(name, &head, &parent, l_write)) == 0) {
-        // it's not there
-        // unlock the parent
-        if (pthread_rwlock_unlock(&parent->lock) == EPERM) {
-            fprintf(stderr, "%s\n", "unlock failed. wasn't locked");
-            exit(1);
-        }  
-        return(0);
+// applies a record from the log at startup
+static void replay_record(char *record) {
+    char name[MAXLEN];
+    char value[MAXLEN];
+    char *pos = &record[2];
+    char *field[2];
+
+    if (record[0] == 'a' && sscanf(&record[1], "%255s %255s", name, value) == 2) {
+        add_key(name, value);
+    } else if (record[0] == 'd' && sscanf(&record[1], "%255s", name) == 1) {
+        remove_key(name);
+    } else if (record[0] == 'A' && record[1] == ' '
+            && (field[0] = record_field(&pos, ' ')) != NULL
+            && (field[1] = record_field(&pos, '\n')) != NULL
+            && unescape_field(field[0], MAXLEN) == 0 && unescape_field(field[1], BLOB_MAX + 1) == 0) {
+        add_key(field[0], field[1]);
+    } else if (record[0] == 'D' && record[1] == ' '
+            && (field[0] = record_field(&pos, '\n')) != NULL
+            && unescape_field(field[0], MAXLEN) == 0) {
+        remove_key(field[0]);
     }
+}
 
-    // We found it, if the node has no
-    // right child, then we can merely replace its parent's pointer to
-    // it with the node's left child.
+/* Sets up a filter in front of the engine for about keys keys (see
+ * filter.h), so that most queries for keys that aren't there are answered
+ * without going into the engine. Does nothing if keys is 0. Must be called
+ * after db_init, before db_open_log and before any command is run. */
+void db_filter(size_t keys) {
+    filter_init(keys);
+}
 
-    if (dnode->rchild == 0) {
-        if (strcmp(dnode->name, parent->name) < 0)
-            parent->lchild = dnode->lchild;
-        else
-            parent->rchild = dnode->lchild;
+/* Sets up a hash index next to the engine for about keys keys (see
+ * keyindex.h), so that point queries don't have to walk the engine. Does
+ * nothing if keys is 0. Must be called after db_init, before db_open_log
+ * and before any command is run. */
+void db_index(size_t keys) {
+    keyindex_init(keys);
+    if (keys > 0)
+        require_locks();
+}
 
-        // done with dnode,  unlock dnode. 
-        if (pthread_rwlock_unlock(&dnode->lock) == EPERM) {
-            fprintf(stderr, "%s\n", "unlock failed. wasn't locked");
-            exit(1);
-        }  
-        node_destructor(dnode);
-        // unlock the parent after destroying dnode.
-        if (pthread_rwlock_unlock(&parent->lock) == EPERM) {
-            fprintf(stderr, "%s\n", "unlock failed. wasn't locked");
-            exit(1);
-        }  
-    } else if (dnode->lchild == 0) {
-        // ditto if the node had no left child
-
-        if (strcmp(dnode->name, parent->name) < 0)
-            parent->lchild = dnode->rchild;
-        else
-            parent->rchild = dnode->rchild;
-        
-        // done with dnode,  unlock dnode. 
-        if (pthread_rwlock_unlock(&dnode->lock) == EPERM) {
-            fprintf(stderr, "%s\n", "unlock failed. wasn't locked");
-            exit(1);
-        }  
-        node_destructor(dnode);
-        
-        // unloock the parent 
-        if (pthread_rwlock_unlock(&parent->lock) == EPERM) {
-            exit(1);
-        }  
-    } else { // DNODE AND DNODE PARENT ARE LOCKED HERE.
-
-        // Find the lexicographically smallest node in the right subtree and
-        // replace the node to be deleted with that node. This new node thus is
-        // lexicographically smaller than all nodes in its right subtree, and
-        // greater than all nodes in its left subtree
-        
-        // wrlock the right child.
-        if (lock(l_write, &dnode->rchild->lock) == EDEADLK) {
-            fprintf(stderr, "%s\n", "lock failed. deadlock3.");
-            exit(1);
-        }  
-        next = dnode->rchild;
-        node_t **pnext = &dnode->rchild; // pnext is the connection between dnode and the child you're moving in the direction of. 
-        // // make a node_t* pparent; 
-        // node_t* next_parent = NULL;
-        // next_parent = dnode;
-
-
-        while (next->lchild != 0) {
-            // work our way down the lchild chain, finding the smallest node
-            // in the subtree.
-            //  writelock the left child. 
-            if (lock(l_write, &next->lchild->lock) == EDEADLK) { 
-                fprintf(stderr, "%s\n", "lock failed. deadlock4.");
-                exit(1);
-            }  
-            //  unlock the next. 
-            if (pthread_rwlock_unlock(&next->lock) == EPERM) {
-            fprintf(stderr, "%s\n", "unlock failed. wasn't locked");
-            exit(1);
-        }
-            
-            
-            node_t *nextl = next->lchild;
-            pnext = &next->lchild;
-            next = nextl;
-        }
-        // NEXT IS LOCKD ON OUTSIDE OF WHILE LOOP
-        dnode->name = realloc(dnode->name, strlen(next->name)+1);
-        dnode->value = realloc(dnode->value, strlen(next->value)+1);
-        
-        snprintf(dnode->name, MAXLEN, "%s", next->name);
-        snprintf(dnode->value, MAXLEN, "%s", next->value);
-        *pnext = next->rchild;
-        // : unlock the next_parent. 
-        if (pthread_rwlock_unlock(&next->lock) == EPERM) {
-            fprintf(stderr, "%s\n", "unlock failed. wasn't locked");
-            exit(1);
-        }  
-        node_destructor(next);
-        // : unlock original parent. 
-        if (pthread_rwlock_unlock(&parent->lock) == EPERM) {
-            fprintf(stderr, "%s\n", "unlock failed. wasn't locked");
-            exit(1);
-        }  
-        //  : unlock dnode. 
-        if (pthread_rwlock_unlock(&dnode->lock) == EPERM) {
-            fprintf(stderr, "%s\n", "unlock failed. wasn't locked");
-            exit(1);
-        }  
+/* Prints the size of the filter and how its checks have gone, and the size
+ * of the index and the memory it takes, to out. */
+void db_stats(FILE *out) {
+    filter_stats(out);
+    keyindex_stats(out);
+}
+
+/* Loads the last snapshot (the path with ".snap" after it), replays the
+ * write-ahead log at path on top of it and logs every change from now on
+ * (see wal.c). The log is written out at the latest interval microseconds
+ * after a change, or once batch changes have built up, or as soon as
+ * possible if interval is 0. Must be called after db_init, before any
+ * command is run.
+ *
+ * Returns 0 on success, or -1 if the snapshot could not be read or the log
+ * could not be opened. */
+int db_open_log(char *path, int interval, int batch) {
+    snprintf(snap_path, sizeof(snap_path), "%s.snap", path);
+    if (snapshot_load(snap_path, engine) < 0
+            || wal_open(path, replay_record, interval, batch) < 0)
+        return -1;
+    logging = 1;
+    require_locks();
+    return 0;
+}
+
+/* Writes a snapshot of the database and drops the log from before it, so
+ * that the next start loads the snapshot and replays only the changes made
+ * since. Clients keep running while it is written: the snapshot may or may
+ * not have the changes made meanwhile, but those stay in the log, and
+ * replaying a change the snapshot already has changes nothing, since a key
+ * is only ever added when it's absent and removed when it's present.
+ *
+ * Returns 0 on success, or -1 if there is no log or the snapshot could not
+ * be written. */
+int db_checkpoint(void) {
+    int ret = -1;
+
+    if (!logging)
+        return -1;
+    pthread_mutex_lock(&checkpoint_lock);
+    if (wal_rotate() >= 0 && snapshot_write(snap_path, engine) == 0) {
+        wal_drop_old();
+        ret = 0;
     }
-    return(1);
+    pthread_mutex_unlock(&checkpoint_lock);
+    return ret;
 }
-    // Search the tree, starting at parent, for a node containing
-    // name (the "target node").  Return a pointer to the node,
-    // if found, otherwise return 0.  If parentpp is not 0, then it points
-    // to a location at which the address of the parent of the target node
-    // is stored.  If the target node is not found, the location pointed to
-    // by parentpp is set to what would be the the address of the parent of
-    // the target node, if it were there.
-    //
-node_t *search(char *name, node_t *parent, node_t **parentpp, enum locktype lt) {
 
-    node_t *next;
-    node_t *result;
+/* Returns a mark for the last change the calling thread has made, to pass
+ * to db_sync, possibly from another thread. */
+uint64_t db_mark(void) {
+    return logging? wal_mark(): 0;
+}
 
-    if (strcmp(name, parent->name) < 0) {
-        next = parent->lchild;
-    } else {
-        next = parent->rchild;
+/* Waits until every change up to mark (from db_mark) is in the log on
+ * disk. Responses to commands must not be sent before then. */
+void db_sync(uint64_t mark) {
+    if (mark > 0)
+        wal_sync(mark);
+}
+
+// returns the index of the key lock for name (FNV-1a hash)
+static inline int key_lock_index(char *name) {
+    unsigned int hash = 2166136261u;
+
+    for (; *name != '\0'; name++) {
+        hash ^= (unsigned char) *name;
+        hash *= 16777619u;
     }
+    return hash % DB_KEY_LOCKS;
+}
 
-    if (next == NULL) {
-        result = NULL;
-    } else {
-    if (lock(lt, &next->lock) == EDEADLK) {
-        fprintf(stderr, "%s\n", "lock failed. deadlock5.");
-        exit(1);
-    }      
-    if (strcmp(name, next->name) == 0) {
-        result = next;
-        } else {
-            if (pthread_rwlock_unlock(&parent->lock) == EPERM) {
-                fprintf(stderr, "%s\n", "unlock failed. wasn't locked");
-                exit(1);
-            }  
-            return search(name, next, parentpp, lt);
+// appends the record of a change to the log
+static void log_change(char *name, char *value) {
+    char record[6 * MAXLEN + 4];
+    char escaped[2][3 * MAXLEN];
+    char *big;
+    int len;
+
+    if (value != 0 && strlen(value) >= MAXLEN) {
+        // a long value gets a record built on the heap
+        if ((big = malloc(3 * (strlen(name) + strlen(value)) + 5)) == NULL) {
+            perror("malloc");
+            exit(1);
         }
+        escape_field(big + 2, name);
+        len = strlen(big + 2) + 2;
+        big[0] = 'A';
+        big[1] = ' ';
+        big[len++] = ' ';
+        escape_field(big + len, value);
+        len += strlen(big + len);
+        big[len++] = '\n';
+        wal_append(big, len);
+        free(big);
+        return;
     }
-
-    if (parentpp != NULL) {
-        *parentpp = parent;
+    if (needs_escape(name) || (value != 0 && needs_escape(value))) {
+        escape_field(escaped[0], name);
+        if (value != 0) {
+            escape_field(escaped[1], value);
+            len = snprintf(record, sizeof(record), "A %s %s\n", escaped[0], escaped[1]);
+        } else {
+            len = snprintf(record, sizeof(record), "D %s\n", escaped[0]);
+        }
+    } else if (value != 0) {
+        len = snprintf(record, sizeof(record), "a %s %s\n", name, value);
     } else {
-        // unlock parent
-        if (pthread_rwlock_unlock(&parent->lock) == EPERM) {
-            fprintf(stderr, "%s\n", "unlock failed. wasn't locked");
-            exit(1);
-        }  
+        len = snprintf(record, sizeof(record), "d %s\n", name);
     }
-    return result;
+    wal_append(record, len);
 }
 
-static inline void print_spaces(int lvl, FILE *out) {
-    for (int i = 0; i < lvl; i++) {
-        fprintf(out, " ");
+// Rebuilds the index once it has got crowded (see keyindex.h). The new
+// table is filled from a scan while changes go on, and every key lock is
+// held, as db_print does, only to catch up with the changes made during the
+// scan and swap the tables. Queries go on throughout. The thread that gets
+// there first does it, and others go on without waiting. Called after a
+// change, never on the query path, and must be called without a key lock.
+static void tidy_index(void) {
+    int cancel;
+
+    if (!keyindex_crowded() || pthread_mutex_trylock(&rebuild_lock) != 0)
+        return;
+    // the key locks must not be left held by a cancelled thread
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel);
+    if (keyindex_crowded()) {
+        keyindex_rebuild_scan(engine);
+        for (int i = 0; i < DB_KEY_LOCKS; i++) {
+            pthread_mutex_lock(&key_locks[i]);
+        }
+        keyindex_rebuild_swap(engine);
+        for (int i = 0; i < DB_KEY_LOCKS; i++) {
+            pthread_mutex_unlock(&key_locks[i]);
+        }
     }
+    pthread_setcancelstate(cancel, 0);
+    pthread_mutex_unlock(&rebuild_lock);
 }
 
-/* Recursively traverses the database tree and prints nodes
- * pre-order. */
-void db_print_recurs(node_t *node, int lvl, FILE *out) {
-    // print spaces to differentiate levels
-    print_spaces(lvl, out);
+// adds a key, logging the change if there is a log
+static int db_add(char *name, char *value) {
+    int lock = key_lock_index(name);
+    int locked;
+    int added;
 
-    // print out the current node
-    if (node == NULL) {
-        fprintf(out, "(null)\n");
-        return;
+    if (goes_in_blob(value))
+        lock_for_blobs();
+    locked = change_lock(lock);
+    if ((added = add_key(name, value)) && logging)
+        log_change(name, value);
+    change_unlock(lock, locked);
+    tidy_index();
+    return added;
+}
+
+// removes a key, logging the change if there is a log
+static int db_remove(char *name) {
+    int lock = key_lock_index(name);
+    int locked = change_lock(lock);
+    int removed;
+
+    if ((removed = remove_key(name)) && logging)
+        log_change(name, 0);
+    change_unlock(lock, locked);
+    tidy_index();
+    return removed;
+}
+
+// Finds the value of a key. With value set, a value kept in a blob is not
+// copied but handed back in value, held until db_release; otherwise up to
+// len-1 bytes of it are copied into result, like any other. Returns the
+// length of the value, or -1 if the key isn't there.
+static int fetch(char *name, char *result, int len, db_value_t *value) {
+    pthread_mutex_t *lock;
+    blob_t *blob;
+    int found;
+
+    if (!filter_check(name)) {
+        result[0] = '\0';
+        return -1;
+    }
+    lookup(name, result, len);
+    if (blob_of(result) == NULL) {
+        if (result[0] == '\0')
+            filter_missed();
+        return (result[0] != '\0')? (int) strlen(result): -1;
     }
 
-    if (node == &head) {
-        fprintf(out, "(root)\n");
+    // The reference is only good while the key keeps it: look again with
+    // the key locked, so it can't be removed meanwhile.
+    lock = &key_locks[key_lock_index(name)];
+    pthread_mutex_lock(lock);
+    lookup(name, result, len);
+    if ((blob = blob_of(result)) == NULL) {
+        found = (result[0] != '\0')? (int) strlen(result): -1;
+    } else if (value != NULL) {
+        blob_hold(blob);
+        value->data = blob->data;
+        value->len = blob->len;
+        value->blob = blob;
+        result[0] = '\0';
+        found = (int) blob->len;
     } else {
-        fprintf(out, "%s %s\n", node->name, node->value);
+        snprintf(result, len, "%s", blob->data);
+        found = (int) blob->len;
     }
+    pthread_mutex_unlock(lock);
+    return found;
+}
 
-    db_print_recurs(node->lchild, lvl + 1, out);
-    db_print_recurs(node->rchild, lvl + 1, out);
+/* Lets go of a value handed out by interpret_command or db_request, once
+ * it has been sent. */
+void db_release(void *blob) {
+    blob_drop((blob_t *) blob);
 }
 
-/* Prints the whole database, using db_print_recurs, to a file with
+// Closes every file descriptor but keep, in the child of a print. It
+// inherits all of the server's: the listener, the client sockets, the epoll
+// set and the log. Held there, a socket a client closes wouldn't go away
+// until the print was done, and nothing in the child may write to the log.
+// close_range does it in two calls; without it, the descriptors that are
+// open are read from /proc/self/fd, since the open file limit may be in the
+// millions. Only where neither is there is every number up to it closed.
+static void close_others(int keep) {
+    struct dirent *entry;
+    DIR *dir;
+    long max;
+
+#if defined(__linux__) && defined(SYS_close_range)
+    if ((keep == 0 || syscall(SYS_close_range, 0, keep - 1, 0) == 0)
+            && syscall(SYS_close_range, keep + 1, ~0U, 0) == 0)
+        return;
+#endif
+    if ((dir = opendir("/proc/self/fd")) != NULL) {
+        while ((entry = readdir(dir)) != NULL) {
+            int fd = atoi(entry->d_name);
+            if (entry->d_name[0] != '.' && fd != keep && fd != dirfd(dir))
+                close(fd);
+        }
+        closedir(dir);
+        return;
+    }
+    if ((max = sysconf(_SC_OPEN_MAX)) < 0)
+        max = 1024;
+    for (long fd = 0; fd < max; fd++) {
+        if (fd != keep)
+            close((int) fd);
+    }
+}
+
+/* Prints the whole database, using the engine's print function, to a file with
  * the given filename, or to stdout if the filename is empty or NULL.
  * If the file does not exist, it is created. The file is truncated
  * in all cases.
  *
+ * The database is printed as it was at one point in time: every key lock is
+ * taken just long enough to fork, so no change is half made in the child's
+ * copy of memory, and the child prints from that copy while the server goes
+ * on. Queries don't wait, but changes do, for as long as the fork takes to
+ * copy the page tables, which grows with the server's memory: about 1-2.5ms
+ * at 76MB (600k keys) and 5-16ms at 408MB (3M keys). Returns once the child
+ * has started; the output may still be coming for a while (db_cleanup waits
+ * for it).
+ *
  * Returns 0 on success, or -1 if the file could not be opened
- * for writing. */
+ * for writing or the child could not be started. */
 int db_print(char *filename) {
     FILE *out;
-    if (filename == NULL) {
-        db_print_recurs(&head, 0, stdout);
-        return 0;
-    }
-    
+    pid_t pid;
+    int fd;
+
     // skip over leading whitespace
-    while (isspace(*filename)) {
+    while (filename != NULL && isspace(*filename)) {
         filename++;
     }
 
-    if (*filename == '\0') {
-        db_print_recurs(&head, 0, stdout);
-        return 0;
+    if (filename == NULL || *filename == '\0') {
+        fd = dup(STDOUT_FILENO);
+    } else {
+        fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
     }
-
-    if ((out = fopen(filename, "w+")) == NULL) {
+    if (fd < 0) {
         return -1;
     }
 
-    db_print_recurs(&head, 0, out);
-    fclose(out);
+    // reap the children of earlier prints that are done
+    while (waitpid(-1, 0, WNOHANG) > 0) {
+    }
 
-    return 0;
+    fflush(stdout);
+    require_locks();
+    for (int i = 0; i < DB_KEY_LOCKS; i++) {
+        pthread_mutex_lock(&key_locks[i]);
+    }
+    pid = fork();
+    if (pid == 0) {
+        // Only this thread exists in the child, so nothing the other threads
+        // held (such as stdout's lock) is touched: the output gets a stream
+        // of its own.
+        close_others(fd);
+        if ((out = fdopen(fd, "w")) == NULL)
+            _exit(1);
+        engine->print(out);
+        fclose(out);
+        _exit(0);
+    }
+    for (int i = 0; i < DB_KEY_LOCKS; i++) {
+        pthread_mutex_unlock(&key_locks[i]);
+    }
+    unrequire_locks();
+    close(fd);
+
+    return (pid < 0)? -1: 0;
 }
 
-/* Recursively destroys node and all its children. */
-void db_cleanup_recurs(node_t *node) {
-    if (node == NULL) {
-        return;
+/* Destroys all nodes in the database.
+ * No threads should be using the database when this is called. */
+void db_cleanup() {
+    // let prints that are still going finish
+    while (wait(0) > 0) {
     }
+    wal_close();
+    // the index goes first, as the engine may give back the slab memory its
+    // entries are in
+    keyindex_release();
+    engine->cleanup();
+    filter_release();
+    // blobs can only go once nothing is left waiting to be freed
+    epoch_barrier();
+    blob_release();
+    // with no log, index or blobs left, changes need no locks again
+    logging = 0;
+    lock_changes = 0;
+    blobs_locked = 0;
+}
 
-    db_cleanup_recurs(node->lchild);
-    db_cleanup_recurs(node->rchild);
+// orders batch keys by name, and keys that repeat by where they come in the command
+static int op_compare(const void *a, const void *b) {
+    const db_op_t *x = (const db_op_t *) a;
+    const db_op_t *y = (const db_op_t *) b;
+    int cmp = strcmp(x->name, y->name);
 
-    node_destructor(node);
+    return (cmp != 0)? cmp: x->index - y->index;
 }
 
-/* Destroys all nodes in the database other than the head.
- * No threads should be using the database when this is called. */
-void db_cleanup() {
-    db_cleanup_recurs(head.lchild);
-    db_cleanup_recurs(head.rchild);
+// Runs a batch of adds (kind 'A') or removes. The locks of all the keys are
+// taken first, in order, if they are needed (see change_lock), and with a
+// log the changes are logged before they are let go.
+static void batch_change(char kind, db_op_t *ops, int n) {
+    char used[DB_KEY_LOCKS] = {0};
+    char locked[DB_KEY_LOCKS];
+    char refs[DB_BATCH_MAX][BLOB_REF];
+    char *values[DB_BATCH_MAX];
+    blob_t *gone[DB_BATCH_MAX];
+
+    for (int i = 0; i < n; i++) {
+        used[key_lock_index(ops[i].name)] = 1;
+        if (kind == 'A' && goes_in_blob(ops[i].value))
+            lock_for_blobs();
+    }
+    for (int i = 0; i < DB_KEY_LOCKS; i++) {
+        if (used[i])
+            locked[i] = (char) change_lock(i);
+    }
+
+    // values that could be taken for references go into blobs, and the
+    // blobs of removed keys are let go of afterwards
+    for (int i = 0; i < n; i++) {
+        gone[i] = NULL;
+        if (kind == 'A') {
+            values[i] = ops[i].value;
+            ops[i].value = store_value(ops[i].value, refs[i]);
+            filter_add(ops[i].name);
+        } else if (blob_any()) {
+            char old[MAXLEN];
+            lookup(ops[i].name, old, MAXLEN);
+            gone[i] = blob_of(old);
+        }
+    }
+
+    if (kind == 'A' && engine->add_batch != 0) {
+        engine->add_batch(ops, n);
+    } else if (kind != 'A' && engine->remove_batch != 0) {
+        engine->remove_batch(ops, n);
+    } else {
+        for (int i = 0; i < n; i++) {
+            ops[i].done = (kind == 'A')? engine->add(ops[i].name, ops[i].value):
+                    engine->remove(ops[i].name);
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (kind == 'A') {
+            if (!ops[i].done && ops[i].value == refs[i])
+                drop_value(refs[i]);
+            if (ops[i].done) {
+                keyindex_add(ops[i].name, ops[i].value);
+            } else {
+                filter_remove(ops[i].name);
+            }
+            ops[i].value = values[i];
+        } else if (ops[i].done) {
+            if (gone[i] != NULL)
+                blob_drop(gone[i]);
+            keyindex_remove(ops[i].name);
+            filter_remove(ops[i].name);
+        }
+    }
+    for (int i = 0; logging && i < n; i++) {
+        if (ops[i].done)
+            log_change(ops[i].name, (kind == 'A')? ops[i].value: 0);
+    }
+    for (int i = 0; i < DB_KEY_LOCKS; i++) {
+        if (used[i])
+            change_unlock(i, locked[i]);
+    }
+    tidy_index();
 }
 
-/* Interprets the given command string and calls the appropriate database
- * function. Writes up to len-1 bytes of the response message string produced 
- * by the database to the response buffer. */
-void interpret_command(char *command, char *response, int len) {
-    char value[MAXLEN];
-    char ibuf[MAXLEN];
-    char name[MAXLEN];
-    int sscanf_ret;
+// The characters next_word splits words on: those isspace takes in the C
+// locale, so a batch is cut up the way any other command is.
+#define DB_SPACES " \t\n\v\f\r"
 
-    if (strlen(command) <= 1) {
+/* Runs a batch command: Q name..., A name value ..., or D name... The keys are
+ * sorted and handed to the engine all at once, so it can share the work of
+ * finding keys that are close together. The response has one field per key,
+ * in command order, separated by single spaces: for Q the value, or nothing
+ * if the key isn't there; for A and D, 1 if the key was added/removed and 0
+ * if not. Writes up to len-1 bytes of the response to response. */
+static void interpret_batch(char *command, char *response, int len) {
+    char line[4 * MAXLEN];
+    db_op_t ops[DB_BATCH_MAX];
+    db_op_t *order[DB_BATCH_MAX];
+    db_op_t probes[DB_BATCH_MAX];
+    int at[DB_BATCH_MAX];
+    char *values = 0;
+    char *save;
+    char *token;
+    int n = 0;
+    int used = 0;
+    int got;
+
+    snprintf(line, sizeof(line), "%s", &command[1]);
+    for (token = strtok_r(line, DB_SPACES, &save); token != 0; token = strtok_r(0, DB_SPACES, &save)) {
+        if (n == DB_BATCH_MAX) {
+            snprintf(response, len, "batch too large");
+            return;
+        }
+        ops[n].name = token;
+        ops[n].value = 0;
+        if (command[0] == 'A' && (ops[n].value = strtok_r(0, DB_SPACES, &save)) == 0)
+            break;
+        if (strlen(token) >= MAXLEN || (ops[n].value != 0 && strlen(ops[n].value) >= MAXLEN))
+            break;
+        ops[n].done = 0;
+        ops[n].index = n;
+        n++;
+    }
+    if (n == 0 || token != 0) {
         snprintf(response, len, "ill-formed command");
         return;
     }
 
-    // which command is it?
+    qsort(ops, n, sizeof(db_op_t), op_compare);
+    for (int i = 0; i < n; i++) {
+        order[ops[i].index] = &ops[i];
+    }
+
     switch (command[0]) {
-    case 'q':
-         // Query
-        sscanf_ret = sscanf(&command[1], "%255s", name);
-        if (sscanf_ret < 1) {
-            snprintf(response, len, "ill-formed command");
+    case 'Q':
+        if ((values = malloc(n * MAXLEN)) == 0) {
+            snprintf(response, len, "out of memory");
             return;
         }
-        db_query(name, response, len);
-        if (strlen(response) == 0) {
-            snprintf(response, len, "not found");
+        // only the keys the filter lets through, and the index can't tell
+        // about, go to the engine, still in order
+        int m = 0;
+        for (int i = 0; i < n; i++) {
+            ops[i].value = values + i * MAXLEN;
+            ops[i].value[0] = '\0';
+            if (!filter_check(ops[i].name))
+                continue;
+            if ((got = keyindex_query(ops[i].name, ops[i].value, MAXLEN)) < 0) {
+                probes[m] = ops[i];
+                at[m++] = i;
+            } else if (!(ops[i].done = got)) {
+                filter_missed();
+            }
+        }
+        if (m > 0 && engine->query_batch != 0) {
+            engine->query_batch(probes, m);
+        } else {
+            for (int i = 0; i < m; i++) {
+                engine->query(probes[i].name, probes[i].value, MAXLEN);
+                probes[i].done = (probes[i].value[0] != '\0');
+            }
         }
+        for (int i = 0; i < m; i++) {
+            ops[at[i]].done = probes[i].done;
+            if (!probes[i].done)
+                filter_missed();
+        }
+        break;
 
-        return;
+    default:
+        batch_change(command[0], ops, n);
+        break;
+    }
 
-    case 'a':
-        // Add to the database
-        sscanf_ret = sscanf(&command[1], "%255s %255s", name, value);
-        if (sscanf_ret < 2) {
+    response[0] = '\0';
+    for (int i = 0; i < n && used < len; i++) {
+        char *field = (command[0] != 'Q')? (order[i]->done? "1": "0"):
+                (order[i]->done? order[i]->value: "");
+        if (blob_of(field) != NULL) {
+            // a long value is copied straight into the response
+            used += snprintf(response + used, len - used, (i == 0)? "": " ");
+            if (used < len && (got = fetch(order[i]->name, response + used, len - used, 0)) > 0)
+                used += got;
+            continue;
+        }
+        used += snprintf(response + used, len - used, (i == 0)? "%s": " %s", field);
+    }
+    if (used >= len)
+        snprintf(response, len, "response too long");
+    free(values);
+}
+
+/* Adds a pair to a scan page, or ends the page when it is full, keeping
+ * room for a cursor after the pairs. A value too long for any page is left
+ * out (an empty field), so the scan goes on past its key; the value can be
+ * had with q. Called by the engine's scan, possibly with locks held, so it
+ * only copies. */
+static int scan_visit(void *arg, char *name, char *value) {
+    scan_page_t *page = (scan_page_t *) arg;
+    const char *shown = blob_value(value);
+    int need = (int) (strlen(name) + strlen(shown)) + 2;
+
+    if (need + MAXLEN + 1 > page->len) {
+        shown = "";
+        need = (int) strlen(name) + 2;
+    }
+    if (page->n == page->limit || page->used + need + MAXLEN + 1 > page->len) {
+        snprintf(page->cursor, MAXLEN, "%s", name);
+        page->more = 1;
+        return 1;
+    }
+    page->used += snprintf(page->buf + page->used, page->len - page->used, " %s %s", name, shown);
+    page->n++;
+    return 0;
+}
+
+// Reads the limit of a scan from word, which must be all digits (after an
+// optional sign) for a number from 1 to INT_MAX. Returns -1 if it isn't.
+static int scan_limit(const char *word, int *limit) {
+    char *end;
+    long n;
+
+    errno = 0;
+    n = strtol(word, &end, 10);
+    if (end == word || *end != '\0' || errno == ERANGE || n < 1 || n > INT_MAX)
+        return -1;
+    *limit = (int) n;
+    return 0;
+}
+
+/* Runs a scan: r start end [limit] for the keys from start up to (but not
+ * including) end, or P prefix [limit [cursor]] for the keys that start with
+ * prefix, from cursor on if there is one. The response is the number of
+ * pairs, then each name and value, in order, with an empty value for a value
+ * too long to fit. It holds at most limit pairs and
+ * as many as fit in the response; if there are more keys to come, the last
+ * field is a cursor, the next key. r cursor end, or P prefix limit cursor,
+ * picks up from there. Writes up to len-1 bytes of the response to
+ * response. */
+static void interpret_scan(char *command, char *response, int len) {
+    char first[MAXLEN];
+    char second[MAXLEN];
+    char third[MAXLEN];
+    char pairs[4 * MAXLEN];
+    char *start = first;
+    char *end = second;
+    int limit = -1;
+    int got;
+    scan_page_t page;
+
+    got = sscanf(&command[1], "%255s %255s %255s", first, second, third);
+    if (command[0] == 'r') {
+        if (got < 2 || (got == 3 && scan_limit(third, &limit) < 0)) {
+            snprintf(response, len, "ill-formed command");
+            return;
+        }
+    } else {
+        if (got < 1 || (got >= 2 && scan_limit(second, &limit) < 0)) {
             snprintf(response, len, "ill-formed command");
             return;
         }
-        if (db_add(name, value)) {
-            snprintf(response, len, "added");
+        // The keys with the prefix come before the prefix with its last byte
+        // bumped up, after dropping any last bytes that can't be.
+        if (got == 3 && strcmp(third, first) > 0)
+            start = third;
+        size_t n = strlen(first);
+        memcpy(second, first, n + 1);
+        while (n > 0 && (unsigned char) second[n - 1] == 0xff) {
+            second[--n] = '\0';
+        }
+        if (n == 0) {
+            end = 0;
         } else {
-            snprintf(response, len, "already in database");
+            second[n - 1]++;
         }
+    }
+    page.buf = pairs;
+    page.len = (len < (int) sizeof(pairs))? len: (int) sizeof(pairs);
+    page.len -= 12;  // for the count in front
+    page.used = 0;
+    page.buf[0] = '\0';
+    page.n = 0;
+    page.limit = limit;
+    page.more = 0;
+    engine->scan(start, end, scan_visit, &page);
 
-        return;
+    snprintf(response, len, "%d%s%s%s", page.n, pairs, page.more? " ": "", page.more? page.cursor: "");
+}
+
+/* Runs a request from the binary protocol: op is 'q', 'a' or 'd', and name
+ * and value are taken as they are, so they may hold whitespace, and value
+ * may be up to BLOB_MAX bytes long. A query writes the value it finds (up to
+ * len-1 bytes) into result, or hands a long one back in found, as
+ * interpret_command does.
+ *
+ * Returns 0 if the key was found, added or removed, 1 if it wasn't, or -1
+ * if the request is ill-formed. */
+int db_request(int op, char *name, char *value, char *result, int len, db_value_t *found) {
+    size_t name_len = strlen(name);
+    size_t value_len = strlen(value);
 
+    result[0] = '\0';
+    if (name_len == 0 || name_len >= MAXLEN || value_len > BLOB_MAX)
+        return -1;
+    switch (op) {
+    case 'q':
+        if (value_len > 0)
+            return -1;
+        return (fetch(name, result, len, found) < 0);
+    case 'a':
+        if (value_len == 0)
+            return -1;
+        return !db_add(name, value);
     case 'd':
-        // Delete from the database
-        sscanf_ret = sscanf(&command[1], "%255s", name);
-        if (sscanf_ret < 1) {
-            snprintf(response, len, "ill-formed command");
+        if (value_len > 0)
+            return -1;
+        return !db_remove(name);
+    default:
+        return -1;
+    }
+}
+
+// Finds the next word at *pos the way sscanf's "%255s" does: skips
+// whitespace and takes up to MAXLEN-1 characters that aren't. The word is
+// terminated in place, over the whitespace after it, and *pos moves past
+// it. Only a word cut short at MAXLEN-1, whose next character belongs to
+// the following word, is copied, into spill (MAXLEN bytes). Returns NULL
+// if there are no more words.
+static char *next_word(char **pos, char *spill) {
+    char *p = *pos;
+    char *word;
+
+    while (isspace((unsigned char) *p)) {
+        p++;
+    }
+    if (*p == '\0')
+        return NULL;
+    word = p;
+    while (*p != '\0' && !isspace((unsigned char) *p) && p - word < MAXLEN - 1) {
+        p++;
+    }
+    if (*p == '\0') {
+        *pos = p;
+    } else if (isspace((unsigned char) *p)) {
+        *p = '\0';
+        *pos = p + 1;
+    } else {
+        memcpy(spill, word, MAXLEN - 1);
+        spill[MAXLEN - 1] = '\0';
+        *pos = p;
+        return spill;
+    }
+    return word;
+}
+
+// copies a fixed response (shorter than len) into response
+static inline void reply(char *response, int len, const char *text) {
+    size_t n = strlen(text);
+
+    if ((int) n < len) {
+        memcpy(response, text, n + 1);
+    } else {
+        snprintf(response, len, "%s", text);
+    }
+}
+
+// Finds the adds in one chunk of a file being loaded, the way
+// interpret_command would parse them. Lines that change nothing (queries,
+// scans, ill-formed commands) are skipped. A line that would change the
+// database some other way, or that interpret_command would see cut up
+// (longer than its line buffer, or with a word cut short), stops the load.
+static void load_parse(void *arg, int c) {
+    file_load_t *load = (file_load_t *) arg;
+    load_chunk_t *chunk = &load->chunks[c];
+    char spill[2][MAXLEN];
+    char *next;
+
+    for (char *line = chunk->start; line < chunk->end; line = next) {
+        char *end = memchr(line, '\n', chunk->end - line);
+        char *pos = line + 1;
+        char *name;
+        char *value;
+
+        next = end + 1;
+        if (next - line > 4 * MAXLEN - 1 || (line[0] != '\0' && strchr("dADf", line[0]) != NULL)
+                || __atomic_load_n(&load->other, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&load->other, 1, __ATOMIC_RELAXED);
             return;
         }
-        if (db_remove(name)) {
-            snprintf(response, len, "removed");
-        } else {
-            snprintf(response, len, "not in database");
+        *end = '\0';
+        if (line[0] != 'a' || line[1] == '\0'
+                || (name = next_word(&pos, spill[0])) == NULL
+                || (value = next_word(&pos, spill[1])) == NULL)
+            continue;
+        if (name == spill[0] || value == spill[1]) {
+            __atomic_store_n(&load->other, 1, __ATOMIC_RELAXED);
+            return;
         }
 
-        return;
+        if (chunk->n == chunk->capacity) {
+            chunk->capacity = (chunk->capacity == 0)? 1024: 2 * chunk->capacity;
+            if ((chunk->ops = realloc(chunk->ops, chunk->capacity * sizeof(load_op_t))) == NULL
+                    || (chunk->locks = realloc(chunk->locks, chunk->capacity)) == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        chunk->ops[chunk->n].prefix = key_prefix(name);
+        chunk->ops[chunk->n].op.name = name;
+        chunk->ops[chunk->n].op.value = value;
+        chunk->ops[chunk->n].op.done = 0;
+        chunk->locks[chunk->n] = (unsigned char) key_lock_index(name);
+        chunk->at[chunk->locks[chunk->n]]++;
+        chunk->n++;
+    }
+}
 
-    case 'f':
-        // process the commands in a file (silently)
-        sscanf_ret = sscanf(&command[1], "%255s", name);
-        if (sscanf_ret < 1) {
-            snprintf(response, len, "ill-formed command");
-            return;
+// moves the adds of one chunk to their key lock's group, numbering them in
+// file order
+static void load_group(void *arg, int c) {
+    file_load_t *load = (file_load_t *) arg;
+    load_chunk_t *chunk = &load->chunks[c];
+
+    for (size_t i = 0; i < chunk->n; i++) {
+        load_op_t *op = &load->ops[chunk->at[chunk->locks[i]]++];
+        *op = chunk->ops[i];
+        op->op.index = (int) (chunk->first + i);
+    }
+    free(chunk->ops);
+    free(chunk->locks);
+    chunk->ops = NULL;
+    chunk->locks = NULL;
+}
+
+// orders the adds of a file by name, and adds of the same key by where they
+// come in the file
+static int load_compare(const void *a, const void *b) {
+    const load_op_t *x = (const load_op_t *) a;
+    const load_op_t *y = (const load_op_t *) b;
+
+    if (x->prefix != y->prefix)
+        return (x->prefix < y->prefix)? -1: 1;
+    return op_compare(&x->op, &y->op);
+}
+
+// Runs the adds under one key lock. They are sorted, and only the first add
+// of a key is kept, since the ones after it could only fail. They then go to
+// batch_change in sorted runs, which take the lock once each.
+static void load_run(void *arg, int lock) {
+    file_load_t *load = (file_load_t *) arg;
+    load_op_t *ops = load->ops + load->groups[lock];
+    size_t n = load->groups[lock + 1] - load->groups[lock];
+    size_t kept = 0;
+    db_op_t batch[DB_BATCH_MAX];
+
+    qsort(ops, n, sizeof(load_op_t), load_compare);
+    for (size_t i = 0; i < n; i++) {
+        if (kept == 0 || strcmp(ops[i].op.name, ops[kept - 1].op.name) != 0)
+            ops[kept++] = ops[i];
+    }
+    // the duplicates count as run
+    __atomic_add_fetch(&load->done, n - kept, __ATOMIC_RELAXED);
+
+    for (size_t i = 0; i < kept; i += DB_BATCH_MAX) {
+        int run = (kept - i < DB_BATCH_MAX)? (int) (kept - i): DB_BATCH_MAX;
+        size_t added = 0;
+        size_t done;
+
+        for (int j = 0; j < run; j++) {
+            batch[j] = ops[i + j].op;
+        }
+        batch_change('A', batch, run);
+        for (int j = 0; j < run; j++) {
+            added += batch[j].done;
         }
+        __atomic_add_fetch(&load->added, added, __ATOMIC_RELAXED);
+        done = __atomic_add_fetch(&load->done, run, __ATOMIC_RELAXED);
+        if (done / DB_LOAD_PROGRESS != (done - run) / DB_LOAD_PROGRESS
+                && done < load->groups[DB_KEY_LOCKS])
+            fprintf(stderr, "f %s: %zu of %zu adds run\n", load->name, done,
+                    load->groups[DB_KEY_LOCKS]);
+    }
+    load->marks[lock] = db_mark();
+}
+
+// cuts the file mapped at map into chunks of about DB_LOAD_CHUNK bytes that
+// end with a '\n', the last one in tail (a copy of the last line, which may
+// not have one)
+static void load_split(file_load_t *load, char *map, size_t size, char **tail) {
+    char *end = map + size;
+    char *last = map + size;
+    size_t tail_len;
 
-        FILE *finput = fopen(name, "r");
-        if (!finput) {
-            snprintf(response, len, "bad file name");
+    while (last > map && last[-1] != '\n') {
+        last--;
+    }
+    tail_len = end - last;
+    if (tail_len >= 4 * MAXLEN) {
+        // too long for a line anyway
+        load->other = 1;
+        tail_len = 0;
+    }
+    if ((load->chunks = calloc(size / DB_LOAD_CHUNK + 2, sizeof(load_chunk_t))) == NULL
+            || (*tail = malloc(tail_len + 1)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (char *start = map; start < last; ) {
+        char *stop = (last - start > DB_LOAD_CHUNK)? start + DB_LOAD_CHUNK: last;
+        stop = (char *) memchr(stop - 1, '\n', last - (stop - 1)) + 1;
+        load->chunks[load->nchunks].start = start;
+        load->chunks[load->nchunks++].end = stop;
+        start = stop;
+    }
+    if (tail_len > 0) {
+        memcpy(*tail, last, tail_len);
+        (*tail)[tail_len] = '\n';
+        load->chunks[load->nchunks].start = *tail;
+        load->chunks[load->nchunks++].end = *tail + tail_len + 1;
+    }
+}
+
+// Loads a file in bulk, if it holds nothing but adds and commands that
+// change nothing: the same as running its lines in order, except that
+// other clients may see its keys show up in any order. The file is mapped
+// and its chunks are parsed in parallel. The adds are grouped by key lock,
+// and the groups are sorted and run in parallel, so adds neither wait for
+// each other's key locks nor walk the engine in random order.
+//
+// Returns 1 if the file was loaded, 0 if it has to be run a line at a time,
+// or -1 if it can't be opened.
+static int load_file(char *name) {
+    file_load_t load;
+    struct stat st;
+    char *map;
+    char *tail = NULL;
+    uint64_t mark = 0;
+    int fd;
+
+    if ((fd = open(name, O_RDONLY)) < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0
+            || (map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                    fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+    close(fd);
+
+    memset(&load, 0, sizeof(load));
+    load.name = name;
+    load_split(&load, map, st.st_size, &tail);
+    if (!load.other)
+        engine_parallel(load.nchunks, load_parse, &load);
+
+    if (!load.other) {
+        // each chunk's adds go after those of the chunks before it, in
+        // their key lock's group
+        for (int i = 0; i < DB_KEY_LOCKS; i++) {
+            load.groups[i + 1] = load.groups[i];
+            for (int c = 0; c < load.nchunks; c++) {
+                size_t n = load.chunks[c].at[i];
+                load.chunks[c].at[i] = load.groups[i + 1];
+                load.groups[i + 1] += n;
+            }
+        }
+        for (int c = 1; c < load.nchunks; c++) {
+            load.chunks[c].first = load.chunks[c - 1].first + load.chunks[c - 1].n;
+        }
+        if ((load.ops = malloc((load.groups[DB_KEY_LOCKS] + 1) * sizeof(load_op_t))) == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        engine_parallel(load.nchunks, load_group, &load);
+        engine_parallel(DB_KEY_LOCKS, load_run, &load);
+
+        // the changes were made on other threads, so their marks are waited
+        // for here
+        for (int i = 0; i < DB_KEY_LOCKS; i++) {
+            mark = (load.marks[i] > mark)? load.marks[i]: mark;
+        }
+        db_sync(mark);
+        if (load.groups[DB_KEY_LOCKS] >= DB_LOAD_PROGRESS)
+            fprintf(stderr, "f %s: %zu adds run, %zu keys added\n", name,
+                    load.groups[DB_KEY_LOCKS], load.added);
+    }
+
+    for (int c = 0; c < load.nchunks; c++) {
+        free(load.chunks[c].ops);
+        free(load.chunks[c].locks);
+    }
+    free(load.chunks);
+    free(load.ops);
+    free(tail);
+    munmap(map, st.st_size);
+    return !load.other;
+}
+
+// Runs the commands in a file, silently: in bulk if load_file can, and
+// otherwise a line at a time.
+static void interpret_file(char *name, char *response, int len) {
+    char ibuf[4 * MAXLEN];
+    FILE *finput;
+    int cancel;
+    int loaded;
+
+    // the load's threads use this thread's stack, so it must not be cancelled
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel);
+    loaded = load_file(name);
+    pthread_setcancelstate(cancel, 0);
+    if (loaded < 0) {
+        reply(response, len, "bad file name");
+        return;
+    }
+    if (loaded == 0) {
+        if ((finput = fopen(name, "r")) == NULL) {
+            reply(response, len, "bad file name");
             return;
         }
         while (fgets(ibuf, sizeof(ibuf), finput) != 0) {
             pthread_testcancel();  // fgets is not a cancellation point
-            interpret_command(ibuf, response, len);
+            interpret_command(ibuf, response, len, 0);
         }
         fclose(finput);
-        snprintf(response, len, "file processed");
+    }
+    reply(response, len, "file processed");
+}
+
+/* Interprets the given command string and calls the appropriate database
+ * function. Writes up to len-1 bytes of the response message string produced 
+ * by the database to the response buffer. The words of the command are cut
+ * out of it in place (see next_word), so it is changed.
+ *
+ * A query for a long value, kept in a blob, doesn't copy it: if found isn't
+ * NULL, the value is handed back in it instead, to be sent after the
+ * (empty) response and then let go of with db_release. */
+void interpret_command(char *command, char *response, int len, db_value_t *found) {
+    char spill[2][MAXLEN];
+    char *pos = &command[1];
+    char *name;
+    char *value;
+
+    if (command[0] == '\0' || command[1] == '\0') {
+        reply(response, len, "ill-formed command");
+        return;
+    }
+
+    // which command is it?
+    switch (command[0]) {
+    case 'q':
+        // Query
+        if ((name = next_word(&pos, spill[0])) == NULL) {
+            reply(response, len, "ill-formed command");
+            return;
+        }
+        if (fetch(name, response, len, found) < 0)
+            reply(response, len, "not found");
+        return;
+
+    case 'a':
+        // Add to the database
+        if ((name = next_word(&pos, spill[0])) == NULL
+                || (value = next_word(&pos, spill[1])) == NULL) {
+            reply(response, len, "ill-formed command");
+            return;
+        }
+        reply(response, len, db_add(name, value)? "added": "already in database");
+        return;
+
+    case 'd':
+        // Delete from the database
+        if ((name = next_word(&pos, spill[0])) == NULL) {
+            reply(response, len, "ill-formed command");
+            return;
+        }
+        reply(response, len, db_remove(name)? "removed": "not in database");
+        return;
+
+    case 'Q':
+    case 'A':
+    case 'D':
+        // Batches of queries, adds or removes
+        interpret_batch(command, response, len);
+        return;
+
+    case 'r':
+    case 'P':
+        // Range and prefix scans
+        interpret_scan(command, response, len);
+        return;
+
+    case 'f':
+        // process the commands in a file (silently)
+        if ((name = next_word(&pos, spill[0])) == NULL) {
+            reply(response, len, "ill-formed command");
+            return;
+        }
+        interpret_file(name, response, len);
         return;
 
     default:
-        snprintf(response, len, "ill-formed command");
+        reply(response, len, "ill-formed command");
         return;
     }
 }
@@ -1,19 +1,28 @@
 #ifndef DB_H_
 #define DB_H_
 
-#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
 
-typedef struct node {
-    char *name;
-    char *value;
-    struct node *lchild;
-    struct node *rchild;
-    pthread_rwlock_t lock;
-} node_t;
+// A value handed out to be sent from where it is kept (see interpret_command).
+typedef struct db_value {
+    const char *data;
+    size_t len;
+    void *blob;             // for db_release
+} db_value_t;
 
-extern node_t head;
-
-void interpret_command(char *command, char *response, int resp_capacity);
+int db_init(char *engine);
+void db_filter(size_t keys);
+void db_index(size_t keys);
+void db_stats(FILE *out);
+int db_open_log(char *path, int interval, int batch);
+int db_checkpoint(void);
+uint64_t db_mark(void);
+void db_sync(uint64_t mark);
+void interpret_command(char *command, char *response, int resp_capacity, db_value_t *found);
+int db_request(int op, char *name, char *value, char *result, int len, db_value_t *found);
+void db_release(void *blob);
 int db_print(char *filename);
 void db_cleanup(void);
 
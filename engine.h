@@ -0,0 +1,68 @@
+#ifndef ENGINE_H_
+#define ENGINE_H_
+
+#include <stdio.h>
+
+#define MAXLEN 256  // longest name or value an engine has to store
+
+/*
+ * A storage engine behind the database interface in db.h. The server runs
+ * exactly one of them, picked by name in db_init. Every engine keeps its
+ * keys in lexicographic order and must be safe to call from any number of
+ * threads at once, except for init and cleanup.
+ *
+ * The batch functions take a whole batch of keys sorted by name, so an engine
+ * can handle keys that sit next to each other in one pass. An engine may leave
+ * them 0, and then db.c runs the batch one key at a time.
+ *
+ * Longer values never reach an engine: db.c keeps them in blobs and gives
+ * the engine a short reference instead (see blob.h), which print shows as
+ * the value it stands for.
+ */
+
+// One key of a batch.
+typedef struct db_op {
+    char *name;
+    char *value;   // add: the value; query: gets a copy of it (MAXLEN bytes)
+    int done;      // set if the key was found/added/removed
+    int index;     // position in the command, for db.c
+} db_op_t;
+
+// One key and its value, for load.
+typedef struct db_entry {
+    char *name;
+    char *value;
+} db_entry_t;
+
+typedef struct db_engine {
+    char *name;
+    void (*init)(void);
+    // copies the value of name into result, or "" if it isn't there
+    void (*query)(char *name, char *result, int len);
+    // return 1 if the key was added/removed, 0 if it was already there/not there
+    int (*add)(char *name, char *value);
+    int (*remove)(char *name);
+    // calls visit on every key from start up to but not including end (0 for
+    // no end), in order, until visit returns nonzero
+    void (*scan)(char *start, char *end, int (*visit)(void *arg, char *name, char *value),
+            void *arg);
+    // builds the database from n entries sorted by name; it must be empty
+    void (*load)(db_entry_t *entries, size_t n);
+    void (*print)(FILE *out);
+    void (*cleanup)(void);
+    void (*query_batch)(db_op_t *ops, int n);
+    void (*add_batch)(db_op_t *ops, int n);
+    void (*remove_batch)(db_op_t *ops, int n);
+} db_engine_t;
+
+// Runs fn(arg, task) for every task from 0 to tasks - 1, spread over a
+// thread per core, and returns when they are all done (see db.c). For
+// engines to load in parallel.
+void engine_parallel(int tasks, void (*fn)(void *arg, int task), void *arg);
+
+extern db_engine_t tree_engine;
+extern db_engine_t skiplist_engine;
+extern db_engine_t btree_engine;
+extern db_engine_t art_engine;
+
+#endif  // ENGINE_H_
@@ -0,0 +1,194 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "./epoch.h"
+
+/*
+ * There is one global epoch counter. A thread entering a critical section
+ * publishes the epoch it saw; the epoch only moves forward once every thread
+ * that is inside a critical section has seen the current one. Memory retired
+ * while the global epoch is e can therefore be freed once it reaches e + 2:
+ * by then every thread that might have found it before it was unlinked has
+ * left its critical section.
+ *
+ * Every thread that uses this module gets an epoch record. Records are never
+ * freed, only handed to a new thread when their owner exits, so the list of
+ * records can be walked without locks.
+ */
+
+#define EPOCH_BATCH 64  // retirements between attempts to advance the epoch
+#define ACTIVE 1UL      // low bit of a record's state: in a critical section
+
+typedef struct retired {
+    void *ptr;
+    void (*reclaim)(void *);
+} retired_t;
+
+// memory retired during one epoch
+typedef struct limbo {
+    unsigned long epoch;
+    size_t count;
+    size_t capacity;
+    retired_t *entries;
+} limbo_t;
+
+typedef struct epoch_record {
+    unsigned long state;     // epoch seen at epoch_enter, shifted, | ACTIVE
+    int in_use;              // owned by a live thread
+    unsigned int retired;    // retirements since the last advance attempt
+    limbo_t limbo[3];        // indexed by epoch % 3
+    struct epoch_record *next;
+} epoch_record_t;
+
+static unsigned long global_epoch;
+static epoch_record_t *records;
+static pthread_key_t record_key;
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+static __thread epoch_record_t *my_record;
+
+// frees everything in a limbo list
+static void limbo_reclaim(limbo_t *limbo) {
+    for (size_t i = 0; i < limbo->count; i++) {
+        limbo->entries[i].reclaim(limbo->entries[i].ptr);
+    }
+    limbo->count = 0;
+}
+
+// frees the limbo lists of rec that are at least two epochs old
+static void record_reclaim(epoch_record_t *rec, unsigned long epoch) {
+    for (int i = 0; i < 3; i++) {
+        if (rec->limbo[i].count > 0 && rec->limbo[i].epoch + 2 <= epoch) {
+            limbo_reclaim(&rec->limbo[i]);
+        }
+    }
+}
+
+// Called when a thread exits: hands its record over to the next thread. Its
+// limbo lists stay with the record and are freed by the new owner.
+static void record_release(void *arg) {
+    epoch_record_t *rec = (epoch_record_t *) arg;
+    __atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void record_key_create(void) {
+    int err;
+    if ((err = pthread_key_create(&record_key, record_release))) {
+        fprintf(stderr, "%s\n", "pthread_key_create failed");
+        exit(1);
+    }
+}
+
+// returns the calling thread's record, taking over a free one or adding one
+static epoch_record_t *get_record(void) {
+    epoch_record_t *rec;
+
+    if (my_record != 0)
+        return my_record;
+
+    pthread_once(&record_key_once, record_key_create);
+
+    for (rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE); rec != 0; rec = rec->next) {
+        int free_record = 0;
+        if (__atomic_compare_exchange_n(&rec->in_use, &free_record, 1, 0,
+                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (rec == 0) {
+        if ((rec = (epoch_record_t *) calloc(1, sizeof(epoch_record_t))) == 0) {
+            perror("calloc");
+            exit(1);
+        }
+        rec->in_use = 1;
+        rec->next = __atomic_load_n(&records, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&records, &rec->next, rec, 0,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+
+    pthread_setspecific(record_key, rec);
+    my_record = rec;
+    return rec;
+}
+
+// Moves the global epoch forward if every thread in a critical section has
+// seen the current one. Returns the global epoch.
+static unsigned long epoch_try_advance(void) {
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    epoch_record_t *rec;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE); rec != 0; rec = rec->next) {
+        unsigned long state = __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE);
+        if ((state & ACTIVE) && (state >> 1) != epoch)
+            return epoch;
+    }
+
+    if (__atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, 0,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return epoch + 1;
+    return epoch;
+}
+
+// Starts a critical section: memory reachable from here on won't be freed
+// until epoch_exit.
+void epoch_enter(void) {
+    epoch_record_t *rec = get_record();
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+
+    __atomic_store_n(&rec->state, (epoch << 1) | ACTIVE, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+// ends a critical section
+void epoch_exit(void) {
+    __atomic_store_n(&my_record->state, 0, __ATOMIC_RELEASE);
+}
+
+// Frees ptr by calling reclaim(ptr) once no thread can be looking at it.
+// ptr must already be unreachable for threads entering a critical section.
+void epoch_retire(void *ptr, void (*reclaim)(void *)) {
+    epoch_record_t *rec = get_record();
+    unsigned long epoch;
+    limbo_t *limbo;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    if (++rec->retired >= EPOCH_BATCH) {
+        rec->retired = 0;
+        epoch = epoch_try_advance();
+    }
+    record_reclaim(rec, epoch);
+
+    // a list that was filled three or more epochs ago was just freed
+    limbo = &rec->limbo[epoch % 3];
+    assert(limbo->count == 0 || limbo->epoch == epoch);
+    if (limbo->count == limbo->capacity) {
+        size_t capacity = limbo->capacity? 2 * limbo->capacity: EPOCH_BATCH;
+        retired_t *entries = (retired_t *) realloc(limbo->entries, capacity * sizeof(retired_t));
+        if (entries == 0) {
+            perror("realloc");
+            exit(1);
+        }
+        limbo->entries = entries;
+        limbo->capacity = capacity;
+    }
+    limbo->epoch = epoch;
+    limbo->entries[limbo->count].ptr = ptr;
+    limbo->entries[limbo->count].reclaim = reclaim;
+    limbo->count++;
+}
+
+/* Frees everything that has been retired so far. No thread may be in a
+ * critical section or retiring memory when this is called. */
+void epoch_barrier(void) {
+    epoch_record_t *rec;
+
+    for (rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE); rec != 0; rec = rec->next) {
+        for (int i = 0; i < 3; i++) {
+            limbo_reclaim(&rec->limbo[i]);
+        }
+    }
+}
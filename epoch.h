@@ -0,0 +1,17 @@
+#ifndef EPOCH_H_
+#define EPOCH_H_
+
+/*
+ * Epoch-based memory reclamation. Threads that read a shared structure
+ * without taking locks bracket each access with epoch_enter() and
+ * epoch_exit(). Memory that has been unlinked from the structure is passed
+ * to epoch_retire(), which frees it only once every thread that could
+ * still be looking at it has left its critical section.
+ */
+
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(void *ptr, void (*reclaim)(void *));
+void epoch_barrier(void);
+
+#endif  // EPOCH_H_
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "./filter.h"
+#include "./keysearch.h"
+
+#define FILTER_PER_KEY 10    // counters per key the filter is sized for
+#define FILTER_BLOCK 8       // words of a block, one cache line
+#define FILTER_SLOTS 64      // stripes of the statistics
+
+// The counters are packed 16 to a word. The counters of a key all sit in
+// one block, picked by its hash, so a check misses the cache at most once.
+static uint64_t *words;
+static size_t blocks;
+static size_t sized_for;
+
+// Counts of checks and their outcomes, striped so that threads checking at
+// the same time don't fight over one cache line.
+typedef struct filter_count {
+    unsigned long checks;
+    unsigned long negatives;   // keys the filter said weren't there
+    unsigned long misses;      // keys it let through that weren't there
+} __attribute__((aligned(64))) filter_count_t;
+
+static filter_count_t counts[FILTER_SLOTS];
+static int next_slot;
+static __thread filter_count_t *my_count;
+
+// returns the calling thread's stripe of the statistics
+static inline filter_count_t *count_of_thread(void) {
+    if (my_count == NULL)
+        my_count = &counts[__atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED) % FILTER_SLOTS];
+    return my_count;
+}
+
+// Finds the counters of name: the block picked by the top 29 bits of its
+// hash, and 7 of the other bits for each probe, to pick one of the block's
+// 128 counters.
+static inline uint64_t *name_block(const char *name, uint64_t *probes) {
+    uint64_t hash = key_hash(name);
+
+    *probes = hash;
+    return &words[(size_t) (((hash >> 35) * blocks) >> 29) * FILTER_BLOCK];
+}
+
+// adds one to a count of the statistics; a stripe may be shared, but a
+// count lost now and then doesn't matter
+static inline void tally(unsigned long *n) {
+    __atomic_store_n(n, __atomic_load_n(n, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+// adds delta (1 or -1) to a counter, unless it has got stuck at 15
+static inline void bump(uint64_t *word, int shift, int delta) {
+    uint64_t old = __atomic_load_n(word, __ATOMIC_RELAXED);
+    uint64_t count;
+
+    do {
+        count = (old >> shift) & 15;
+        if (count == 15 || (count == 0 && delta < 0))
+            return;
+    } while (!__atomic_compare_exchange_n(word, &old,
+            (delta > 0)? old + ((uint64_t) 1 << shift): old - ((uint64_t) 1 << shift),
+            0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+}
+
+// adds delta to every counter of name
+static void count_name(const char *name, int delta) {
+    uint64_t probes;
+    uint64_t *block;
+
+    if (words == NULL)
+        return;
+    block = name_block(name, &probes);
+    for (int i = 0; i < FILTER_PROBES; i++, probes >>= 7) {
+        bump(&block[(probes & 127) / 16], (int) (probes & 15) * 4, delta);
+    }
+}
+
+/* Sets up a filter for about keys keys (it takes more, with more false
+ * positives). Without one, every key is let through. Must be called before
+ * any other filter function, from one thread. Exits if there is no memory. */
+void filter_init(size_t keys) {
+    size_t size;
+
+    if (keys == 0)
+        return;
+    blocks = (keys * FILTER_PER_KEY + 16 * FILTER_BLOCK - 1) / (16 * FILTER_BLOCK);
+    size = blocks * FILTER_BLOCK * sizeof(uint64_t);
+    words = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (words == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    sized_for = keys;
+}
+
+/* Counts name in, before it goes into the engine. */
+void filter_add(const char *name) {
+    count_name(name, 1);
+}
+
+/* Counts name out, after it has left the engine (or failed to go in). */
+void filter_remove(const char *name) {
+    count_name(name, -1);
+}
+
+/* Returns 0 if name is certainly not in the database, and 1 if it may be. */
+int filter_check(const char *name) {
+    filter_count_t *count;
+    uint64_t probes;
+    uint64_t *block;
+
+    if (words == NULL)
+        return 1;
+    count = count_of_thread();
+    tally(&count->checks);
+    block = name_block(name, &probes);
+    for (int i = 0; i < FILTER_PROBES; i++, probes >>= 7) {
+        uint64_t word = __atomic_load_n(&block[(probes & 127) / 16], __ATOMIC_RELAXED);
+        if (((word >> ((probes & 15) * 4)) & 15) == 0) {
+            tally(&count->negatives);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Notes that a key filter_check let through wasn't found after all. */
+void filter_missed(void) {
+    if (words != NULL)
+        tally(&count_of_thread()->misses);
+}
+
+/* Prints the size of the filter, how full it is and how its checks went.
+ * The counts are read while other threads may be adding to them, so they
+ * can be a little behind. */
+void filter_stats(FILE *out) {
+    unsigned long checks = 0;
+    unsigned long negatives = 0;
+    unsigned long misses = 0;
+    size_t set = 0;
+    size_t counters = blocks * FILTER_BLOCK * 16;
+
+    if (words == NULL) {
+        fprintf(out, "filter: off\n");
+        return;
+    }
+    for (int i = 0; i < FILTER_SLOTS; i++) {
+        checks += __atomic_load_n(&counts[i].checks, __ATOMIC_RELAXED);
+        negatives += __atomic_load_n(&counts[i].negatives, __ATOMIC_RELAXED);
+        misses += __atomic_load_n(&counts[i].misses, __ATOMIC_RELAXED);
+    }
+    for (size_t w = 0; w < blocks * FILTER_BLOCK; w++) {
+        uint64_t word = __atomic_load_n(&words[w], __ATOMIC_RELAXED);
+        for (int c = 0; c < 16; c++, word >>= 4) {
+            set += ((word & 15) != 0);
+        }
+    }
+    fprintf(out, "filter: %zu counters (%zu KB) for %zu keys, %.1f%% set\n",
+            counters, counters / 2048, sized_for, 100.0 * set / counters);
+    fprintf(out, "filter: %lu checks, %lu definite misses, %lu false positives (%.2f%%)\n",
+            checks, negatives, misses,
+            (negatives + misses > 0)? 100.0 * misses / (negatives + misses): 0.0);
+}
+
+/* Frees the filter and forgets its statistics; filter_init may set up a
+ * new one. No other thread may be using it. */
+void filter_release(void) {
+    if (words != NULL)
+        munmap(words, blocks * FILTER_BLOCK * sizeof(uint64_t));
+    words = NULL;
+    blocks = 0;
+    sized_for = 0;
+    for (int i = 0; i < FILTER_SLOTS; i++) {
+        counts[i].checks = 0;
+        counts[i].negatives = 0;
+        counts[i].misses = 0;
+    }
+}
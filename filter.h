@@ -0,0 +1,31 @@
+#ifndef FILTER_H_
+#define FILTER_H_
+
+#include <stdio.h>
+#include <stddef.h>
+
+/*
+ * A counting Bloom filter of the keys in the database, so that a lookup of a
+ * key that isn't there can usually be answered without going into the
+ * engine. Every key sets a counter in each of FILTER_PROBES places, and a key
+ * whose counters aren't all set is certainly not in the database. A key
+ * whose counters are all set may still not be there (a false positive), and
+ * then the engine has the last word.
+ *
+ * A key is counted in before the engine has it and counted out after the
+ * engine has let it go, so a key is never in the engine without being in
+ * the filter. The counters are 4 bits each and stay at 15 for good once they
+ * get there, which only ever makes for more false positives.
+ */
+
+#define FILTER_PROBES 5  // counters set by each key
+
+void filter_init(size_t keys);
+void filter_add(const char *name);
+void filter_remove(const char *name);
+int filter_check(const char *name);
+void filter_missed(void);
+void filter_stats(FILE *out);
+void filter_release(void);
+
+#endif  // FILTER_H_
@@ -0,0 +1,450 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "./keyindex.h"
+#include "./epoch.h"
+#include "./keysearch.h"
+#include "./slab.h"
+
+#define KEYINDEX_PER_KEY 2      // slots per key the index is sized for, at least
+#define KEYINDEX_GONE 1         // a slot whose key was removed
+#define KEYINDEX_ADDR_BITS 48   // bits of an address; the rest hold a tag
+#define KEYINDEX_REGIONS 64     // parts of a table whose used slots are counted
+#define KEYINDEX_REGION_MIN 64  // fewest slots in a region
+
+// A key and its value, in one allocation from the slab allocator.
+typedef struct keyindex_entry {
+    unsigned int size;         // bytes allocated
+    unsigned int value_len;
+    char *value;
+    char name[];               // the name, then the value
+} keyindex_entry_t;
+
+// The number of slots in a region of a table that have ever held a key. Each
+// is on a cache line of its own, so adds to different parts of the table
+// don't fight over one.
+typedef struct keyindex_region {
+    unsigned long used;
+} __attribute__((aligned(64))) keyindex_region_t;
+
+// A table of slots, mapped from the OS with its slots after it. A rebuild
+// puts a new one in its place and retires the old one through the epochs.
+typedef struct keyindex_table {
+    size_t mask;               // number of slots - 1
+    int shift;                 // a slot's index >> shift is its region's
+    unsigned long limit;       // used slots in a region that make a rebuild due
+    int partial;               // set once a key couldn't be placed
+    keyindex_region_t regions[KEYINDEX_REGIONS];
+    uint64_t slots[];
+} keyindex_table_t;
+
+// A table being filled by keyindex_rebuild.
+typedef struct keyindex_fill {
+    keyindex_table_t *table;
+    size_t keys;
+} keyindex_fill_t;
+
+static keyindex_table_t *table;
+static size_t sized_for;
+static int crowded;            // set once a rebuild is due
+static unsigned long rebuilds;
+
+// While a rebuild scans the engine, the keys added and removed meanwhile
+// are noted, to be redone in the new table before it is put in place.
+static keyindex_fill_t next;   // the table the rebuild is filling
+static int rebuilding;
+static pthread_mutex_t changed_lock = PTHREAD_MUTEX_INITIALIZER;
+static char **changed;
+static size_t nchanged;
+static size_t changed_capacity;
+
+// returns the slot word for entry: its address, tagged with the top bits of
+// hash
+static inline uint64_t slot_word(keyindex_entry_t *entry, uint64_t hash) {
+    return (uint64_t) (uintptr_t) entry | (hash >> KEYINDEX_ADDR_BITS << KEYINDEX_ADDR_BITS);
+}
+
+static inline keyindex_entry_t *slot_entry(uint64_t word) {
+    return (keyindex_entry_t *) (uintptr_t) (word & (((uint64_t) 1 << KEYINDEX_ADDR_BITS) - 1));
+}
+
+// returns 1 if the slot word is the entry of name, whose hash is hash; the
+// tag rules out most other keys without reading their entries
+static inline int slot_match(uint64_t word, uint64_t hash, const char *name) {
+    return word > KEYINDEX_GONE && (word >> KEYINDEX_ADDR_BITS) == (hash >> KEYINDEX_ADDR_BITS)
+            && strcmp(slot_entry(word)->name, name) == 0;
+}
+
+// notes that a rebuild is due; the flag is only written once, so searches
+// that find it set don't fight over its cache line
+static inline void note_crowded(void) {
+    if (!__atomic_load_n(&crowded, __ATOMIC_RELAXED))
+        __atomic_store_n(&crowded, 1, __ATOMIC_RELAXED);
+}
+
+// notes that name is being added or removed, if a rebuild is scanning the
+// engine; the change has already been made there
+static void note_changed(const char *name) {
+    if (!__atomic_load_n(&rebuilding, __ATOMIC_SEQ_CST))
+        return;
+    pthread_mutex_lock(&changed_lock);
+    if (nchanged == changed_capacity) {
+        changed_capacity = (changed_capacity == 0)? 64: 2 * changed_capacity;
+        if ((changed = realloc(changed, changed_capacity * sizeof(char *))) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    if ((changed[nchanged++] = strdup(name)) == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+    pthread_mutex_unlock(&changed_lock);
+}
+
+// frees an entry (passed to epoch_retire)
+static void entry_reclaim(void *ptr) {
+    keyindex_entry_t *entry = (keyindex_entry_t *) ptr;
+
+    slab_free(entry, entry->size);
+}
+
+// returns a new entry for name and value
+static keyindex_entry_t *entry_new(const char *name, const char *value) {
+    size_t name_len = strlen(name);
+    size_t value_len = strlen(value);
+    size_t size = sizeof(keyindex_entry_t) + name_len + value_len + 2;
+    keyindex_entry_t *entry = (keyindex_entry_t *) slab_alloc(size);
+
+    entry->size = (unsigned int) size;
+    entry->value_len = (unsigned int) value_len;
+    entry->value = entry->name + name_len + 1;
+    memcpy(entry->name, name, name_len + 1);
+    memcpy(entry->value, value, value_len + 1);
+    return entry;
+}
+
+// maps an empty table of n slots, a power of two, exiting if it can't
+static keyindex_table_t *table_new(size_t n) {
+    keyindex_table_t *t = mmap(NULL, sizeof(keyindex_table_t) + n * sizeof(uint64_t),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (t == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    size_t region = n / KEYINDEX_REGIONS;
+
+    if (region < KEYINDEX_REGION_MIN)
+        region = (n < KEYINDEX_REGION_MIN)? n: KEYINDEX_REGION_MIN;
+    t->mask = n - 1;
+    for (t->shift = 0; ((size_t) 1 << t->shift) < region; t->shift++) {
+    }
+    t->limit = 3 * region / 4;
+    t->partial = 0;
+    return t;
+}
+
+// gives a table back to the OS, without its entries
+static void table_unmap(keyindex_table_t *t) {
+    munmap(t, sizeof(keyindex_table_t) + (t->mask + 1) * sizeof(uint64_t));
+}
+
+// frees a table and the entries still in it (passed to epoch_retire)
+static void table_reclaim(void *ptr) {
+    keyindex_table_t *t = (keyindex_table_t *) ptr;
+
+    for (size_t i = 0; i <= t->mask; i++) {
+        if (t->slots[i] > KEYINDEX_GONE)
+            entry_reclaim(slot_entry(t->slots[i]));
+    }
+    table_unmap(t);
+}
+
+// Puts word, the slot word of a key with the given hash, in the first free
+// slot from the key's home on. Returns 1 if that slot had never been used
+// and its region is now crowded, 0 if not, or -1 if there is no free slot
+// within KEYINDEX_PROBES.
+static int place(keyindex_table_t *t, uint64_t word, uint64_t hash) {
+    for (size_t i = 0; i < KEYINDEX_PROBES; i++) {
+        size_t at = (hash + i) & t->mask;
+        uint64_t old = __atomic_load_n(&t->slots[at], __ATOMIC_RELAXED);
+        // a free slot may be taken by another key first
+        while (old <= KEYINDEX_GONE) {
+            if (__atomic_compare_exchange_n(&t->slots[at], &old, word, 0, __ATOMIC_RELEASE,
+                    __ATOMIC_RELAXED))
+                return old == 0
+                        && __atomic_add_fetch(&t->regions[at >> t->shift].used, 1,
+                                __ATOMIC_RELAXED) > t->limit;
+        }
+    }
+    return -1;
+}
+
+/* Sets up an index with room for about keys keys (it takes more, and is
+ * rebuilt bigger once they crowd it). Without one, every query goes to the
+ * engine. Must be called before any other index function, from one thread.
+ * Exits if there is no memory. */
+void keyindex_init(size_t keys) {
+    size_t n = 1;
+
+    if (keys == 0)
+        return;
+    while (n < keys * KEYINDEX_PER_KEY) {
+        n <<= 1;
+    }
+    table = table_new(n);
+    sized_for = keys;
+    crowded = 0;
+}
+
+/* Adds name, which the engine has just added, with value as the engine keeps
+ * it. It takes the first free slot from its home on, or, if there is none
+ * within KEYINDEX_PROBES, is left out. */
+void keyindex_add(const char *name, const char *value) {
+    keyindex_table_t *t = __atomic_load_n(&table, __ATOMIC_ACQUIRE);
+    keyindex_entry_t *entry;
+    uint64_t hash;
+    int placed;
+
+    if (t == NULL)
+        return;
+    note_changed(name);
+    hash = key_hash(name);
+    entry = entry_new(name, value);
+    if ((placed = place(t, slot_word(entry, hash), hash)) < 0) {
+        __atomic_store_n(&t->partial, 1, __ATOMIC_SEQ_CST);
+        slab_free(entry, entry->size);
+    }
+    if (placed != 0)
+        note_crowded();
+}
+
+/* Removes name, which the engine has just removed. Its slot is marked
+ * KEYINDEX_GONE rather than emptied, so that the keys placed past it can
+ * still be found; the next key added there reuses it. */
+void keyindex_remove(const char *name) {
+    keyindex_table_t *t = __atomic_load_n(&table, __ATOMIC_ACQUIRE);
+    uint64_t hash;
+
+    if (t == NULL)
+        return;
+    note_changed(name);
+    hash = key_hash(name);
+    for (size_t i = 0; i < KEYINDEX_PROBES; i++) {
+        uint64_t *slot = &t->slots[(hash + i) & t->mask];
+        uint64_t word = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+        if (word == 0)
+            return;
+        if (slot_match(word, hash, name)) {
+            __atomic_store_n(slot, KEYINDEX_GONE, __ATOMIC_RELEASE);
+            epoch_retire(slot_entry(word), entry_reclaim);
+            return;
+        }
+    }
+}
+
+/* Copies up to len-1 bytes of the value of name, as the engine keeps it,
+ * into result. A slot that has never held a key ends the search, since
+ * every key was placed before the first of them from its home.
+ *
+ * Returns 1 if the key was found, 0 if it isn't there (and result is ""), or
+ * -1 if the index can't tell and the engine has to be asked. */
+int keyindex_query(const char *name, char *result, int len) {
+    keyindex_table_t *t;
+    uint64_t hash;
+    int found = 0;
+    int partial;
+    size_t i;
+
+    if (__atomic_load_n(&table, __ATOMIC_RELAXED) == NULL)
+        return -1;
+    hash = key_hash(name);
+    epoch_enter();
+    t = __atomic_load_n(&table, __ATOMIC_ACQUIRE);
+    for (i = 0; i < KEYINDEX_PROBES; i++) {
+        uint64_t word = __atomic_load_n(&t->slots[(hash + i) & t->mask], __ATOMIC_ACQUIRE);
+        if (word == 0)
+            break;
+        if (slot_match(word, hash, name)) {
+            keyindex_entry_t *entry = slot_entry(word);
+            size_t n = ((int) entry->value_len < len)? entry->value_len: (size_t) len - 1;
+            memcpy(result, entry->value, n);
+            result[n] = '\0';
+            found = 1;
+            break;
+        }
+    }
+    partial = __atomic_load_n(&t->partial, __ATOMIC_SEQ_CST);
+    epoch_exit();
+    if (found)
+        return 1;
+    if (partial)
+        return -1;
+    result[0] = '\0';
+    return 0;
+}
+
+/* Returns 1 if the index should be rebuilt: a part of the table has few
+ * slots left that have never been used, or a key couldn't be placed. */
+int keyindex_crowded(void) {
+    return __atomic_load_n(&crowded, __ATOMIC_RELAXED);
+}
+
+// Moves the entries of the table being filled to a bigger one, doubling it
+// until all of them fit without crowding it. Nobody else can see the table
+// yet, so the entries just move over.
+static void fill_grow(keyindex_fill_t *fill) {
+    keyindex_table_t *from = fill->table;
+    size_t n = from->mask + 1;
+    int fits = 0;
+
+    while (!fits) {
+        n *= 2;
+        fill->table = table_new(n);
+        fits = 1;
+        for (size_t i = 0; i <= from->mask && fits; i++) {
+            if (from->slots[i] > KEYINDEX_GONE
+                    && place(fill->table, from->slots[i],
+                            key_hash(slot_entry(from->slots[i])->name)) != 0)
+                fits = 0;
+        }
+        if (!fits)
+            table_unmap(fill->table);
+    }
+    table_unmap(from);
+}
+
+// puts a key from the engine into the table being filled, making the table
+// bigger when the keys need more room or crowd it
+static int fill_visit(void *arg, char *name, char *value) {
+    keyindex_fill_t *fill = (keyindex_fill_t *) arg;
+    keyindex_entry_t *entry = entry_new(name, value);
+    uint64_t hash = key_hash(name);
+    int placed;
+
+    if ((fill->keys + 1) * KEYINDEX_PER_KEY > fill->table->mask + 1)
+        fill_grow(fill);
+    while ((placed = place(fill->table, slot_word(entry, hash), hash)) < 0) {
+        fill_grow(fill);
+    }
+    // the entry is in now, so it moves over with the rest
+    if (placed > 0)
+        fill_grow(fill);
+    fill->keys++;
+    return 0;
+}
+
+// takes name out of the table being filled, if it is there
+static void fill_take(keyindex_fill_t *fill, const char *name) {
+    keyindex_table_t *t = fill->table;
+    uint64_t hash = key_hash(name);
+
+    for (size_t i = 0; i < KEYINDEX_PROBES; i++) {
+        uint64_t *slot = &t->slots[(hash + i) & t->mask];
+        if (*slot == 0)
+            return;
+        if (slot_match(*slot, hash, name)) {
+            entry_reclaim(slot_entry(*slot));
+            *slot = KEYINDEX_GONE;
+            fill->keys--;
+            return;
+        }
+    }
+}
+
+/* Starts a rebuild: makes a new table, with no removed slots and with room
+ * for every key, from a scan of the engine. Adds, removes and queries go on
+ * meanwhile, on the old table, and the keys changed are noted for
+ * keyindex_rebuild_swap. One rebuild may run at a time, and no lock may be
+ * held that an add or remove needs. */
+void keyindex_rebuild_scan(db_engine_t *engine) {
+    keyindex_table_t *old = __atomic_load_n(&table, __ATOMIC_RELAXED);
+
+    if (old == NULL)
+        return;
+    __atomic_store_n(&rebuilding, 1, __ATOMIC_SEQ_CST);
+    next.table = table_new(old->mask + 1);
+    next.keys = 0;
+    engine->scan("", 0, fill_visit, &next);
+}
+
+/* Ends a rebuild: redoes the keys changed since keyindex_rebuild_scan began
+ * in the new table, as the engine has them now, and puts it in place of the
+ * old one. The caller must hold off every add and remove until it returns;
+ * this takes only as long as the changes made during the scan. */
+void keyindex_rebuild_swap(db_engine_t *engine) {
+    keyindex_table_t *old = __atomic_load_n(&table, __ATOMIC_RELAXED);
+    char value[MAXLEN];
+
+    if (old == NULL || !__atomic_load_n(&rebuilding, __ATOMIC_RELAXED))
+        return;
+    __atomic_store_n(&rebuilding, 0, __ATOMIC_SEQ_CST);
+    for (size_t i = 0; i < nchanged; i++) {
+        fill_take(&next, changed[i]);
+        engine->query(changed[i], value, MAXLEN);
+        if (value[0] != '\0')
+            fill_visit(&next, changed[i], value);
+        free(changed[i]);
+    }
+    nchanged = 0;
+    __atomic_store_n(&table, next.table, __ATOMIC_RELEASE);
+    __atomic_store_n(&crowded, 0, __ATOMIC_RELAXED);
+    rebuilds++;
+    epoch_retire(old, table_reclaim);
+}
+
+/* Prints the size of the index, the memory it takes and how full it is.
+ * Other threads may be changing it meanwhile, so the counts are only a
+ * rough picture. */
+void keyindex_stats(FILE *out) {
+    keyindex_table_t *t;
+    size_t keys = 0;
+    size_t gone = 0;
+    size_t bytes = 0;
+    size_t n;
+
+    if (__atomic_load_n(&table, __ATOMIC_RELAXED) == NULL) {
+        fprintf(out, "index: off\n");
+        return;
+    }
+    epoch_enter();
+    t = __atomic_load_n(&table, __ATOMIC_ACQUIRE);
+    n = t->mask + 1;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t word = __atomic_load_n(&t->slots[i], __ATOMIC_ACQUIRE);
+        if (word == KEYINDEX_GONE) {
+            gone++;
+        } else if (word != 0) {
+            keys++;
+            bytes += slot_entry(word)->size;
+        }
+    }
+    fprintf(out, "index: %zu slots (%zu KB) for %zu keys, %zu keys and %zu removed slots%s\n",
+            n, n * sizeof(uint64_t) / 1024, sized_for, keys, gone,
+            __atomic_load_n(&t->partial, __ATOMIC_RELAXED)? ", incomplete": "");
+    epoch_exit();
+    fprintf(out, "index: %zu KB of entries, %.1f bytes per key in all, %lu rebuilds\n",
+            bytes / 1024, (keys > 0)? (double) (bytes + n * sizeof(uint64_t)) / keys: 0.0,
+            __atomic_load_n(&rebuilds, __ATOMIC_RELAXED));
+}
+
+/* Frees the index and its entries; keyindex_init may set up a new one. No
+ * other thread may be using it. */
+void keyindex_release(void) {
+    if (table == NULL)
+        return;
+    table_reclaim(table);
+    table = NULL;
+    for (size_t i = 0; i < nchanged; i++) {
+        free(changed[i]);
+    }
+    nchanged = 0;
+    rebuilding = 0;
+    sized_for = 0;
+    crowded = 0;
+    rebuilds = 0;
+}
@@ -0,0 +1,47 @@
+#ifndef KEYINDEX_H_
+#define KEYINDEX_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include "./engine.h"
+
+/*
+ * A hash index of the keys in the database, next to the engine, so that a
+ * point query finds a key's value in a probe or two instead of walking the
+ * engine. The index keeps its own copy of each name and of the value as the
+ * engine keeps it (a short value or a blob reference). Ordered reads (scans
+ * and print) still go to the engine.
+ *
+ * The index is a table with linear probing. A slot is one word: 0 if it has
+ * never held a key, a mark if its key was removed, or else the address of
+ * the key's entry with the top bits of the key's hash in the bits the
+ * address doesn't use. Queries take no locks and removed entries are freed
+ * through epoch_retire. A key is added and removed under a lock of that key,
+ * once the engine has added or removed it; keys under different locks claim
+ * slots with compare-and-swap.
+ *
+ * A key is kept at most KEYINDEX_PROBES slots away from where its hash
+ * points. If none of them is free, the table stops being complete, and a key
+ * it doesn't have is looked for in the engine. Removed keys leave their
+ * marks behind, so adds and removes of ever new keys use up the slots that
+ * end a search. The slots that have ever been used are counted in each part
+ * of the table; once more than 3/4 of a part's are, or the table is
+ * incomplete, keyindex_crowded says so. keyindex_rebuild_scan then makes a
+ * new table from a scan of the engine's keys, bigger if they need it, while
+ * changes go on, and keyindex_rebuild_swap redoes the keys changed meanwhile
+ * and puts the new table in place, with changes held off only for that.
+ */
+
+#define KEYINDEX_PROBES 64   // slots a key may be kept away from its home
+
+void keyindex_init(size_t keys);
+void keyindex_add(const char *name, const char *value);
+void keyindex_remove(const char *name);
+int keyindex_query(const char *name, char *result, int len);
+int keyindex_crowded(void);
+void keyindex_rebuild_scan(db_engine_t *engine);
+void keyindex_rebuild_swap(db_engine_t *engine);
+void keyindex_stats(FILE *out);
+void keyindex_release(void);
+
+#endif  // KEYINDEX_H_
@@ -0,0 +1,85 @@
+#include <stdint.h>
+#include "./keysearch.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AVX2_BUILD 1
+#endif
+
+// Returns the first 8 bytes of key as a big-endian integer, padded with
+// zeros.
+uint64_t key_prefix(const char *key) {
+    uint64_t prefix = 0;
+
+    for (int i = 0; i < 8 && key[i] != '\0'; i++) {
+        prefix |= (uint64_t) (unsigned char) key[i] << (56 - 8 * i);
+    }
+    return prefix;
+}
+
+// FNV-1a, with its bits mixed after (the finalizer of MurmurHash3), so that
+// keys that differ only at the end still differ in the top bits.
+uint64_t key_hash(const char *key) {
+    uint64_t hash = 14695981039346656037ull;
+
+    for (; *key != '\0'; key++) {
+        hash ^= (unsigned char) *key;
+        hash *= 1099511628211ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// one comparison per prefix
+int prefix_rank_scalar(const uint64_t *prefixes, int n, uint64_t prefix) {
+    int i;
+
+    for (i = 0; i < n && prefixes[i] < prefix; i++) {
+    }
+    return i;
+}
+
+#ifdef HAVE_AVX2_BUILD
+// Compares four prefixes at a time. AVX2 only has a signed 64-bit compare,
+// so both sides get their sign bit flipped first, which makes it order them
+// as unsigned.
+__attribute__((target("avx2")))
+int prefix_rank_avx2(const uint64_t *prefixes, int n, uint64_t prefix) {
+    const __m256i bias = _mm256_set1_epi64x(INT64_MIN);
+    __m256i key = _mm256_xor_si256(_mm256_set1_epi64x((long long) prefix), bias);
+    int i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m256i chunk = _mm256_loadu_si256((const void *) &prefixes[i]);
+        __m256i less = _mm256_cmpgt_epi64(key, _mm256_xor_si256(chunk, bias));
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(less));
+        // the prefixes are sorted, so the smaller ones come first
+        if (mask != 0xf)
+            return i + __builtin_popcount(mask);
+    }
+    return i + prefix_rank_scalar(&prefixes[i], n - i, prefix);
+}
+
+int prefix_rank_avx2_supported(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#else
+int prefix_rank_avx2(const uint64_t *prefixes, int n, uint64_t prefix) {
+    return prefix_rank_scalar(prefixes, n, prefix);
+}
+
+int prefix_rank_avx2_supported(void) {
+    return 0;
+}
+#endif
+
+int (*prefix_rank)(const uint64_t *prefixes, int n, uint64_t prefix) = prefix_rank_scalar;
+
+// picks the version of prefix_rank to use before main runs
+__attribute__((constructor))
+static void prefix_rank_select(void) {
+    if (prefix_rank_avx2_supported())
+        prefix_rank = prefix_rank_avx2;
+}
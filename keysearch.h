@@ -0,0 +1,28 @@
+#ifndef KEYSEARCH_H_
+#define KEYSEARCH_H_
+
+#include <stdint.h>
+
+/*
+ * Search over the fixed-width key prefixes that wide tree nodes keep inline.
+ * A prefix is the first 8 bytes of a key as a big-endian integer, padded
+ * with zeros, so comparing two prefixes orders keys the same way strcmp
+ * does, up to ties.
+ */
+
+uint64_t key_prefix(const char *key);
+
+// Returns a 64-bit hash of key, with every bit depending on every byte, for
+// the filter and the index.
+uint64_t key_hash(const char *key);
+
+// Returns how many of the n sorted prefixes are smaller than prefix. Points
+// at the fastest version the CPU supports, picked when the program starts.
+extern int (*prefix_rank)(const uint64_t *prefixes, int n, uint64_t prefix);
+
+// the individual versions, for benchmarking
+int prefix_rank_scalar(const uint64_t *prefixes, int n, uint64_t prefix);
+int prefix_rank_avx2(const uint64_t *prefixes, int n, uint64_t prefix);
+int prefix_rank_avx2_supported(void);
+
+#endif  // KEYSEARCH_H_
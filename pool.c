@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include "./comm.h"
+#include "./pool.h"
+
+/*
+ * pool_run deals a batch of tasks out over the workers' deques in turn and
+ * waits for the batch to be done. A worker runs tasks from the back of its
+ * own deque, then steals from the front of the others' before it goes to
+ * sleep. Deques have a lock each, which is only ever contended by a thief.
+ *
+ * queued counts the tasks in all the deques and idle the workers that are
+ * asleep. A worker goes to sleep only if queued is 0 after it has counted
+ * itself idle, and pool_run wakes workers if idle is above 0 after it has
+ * counted its tasks queued, so a batch can't be left with every worker
+ * asleep.
+ */
+
+#define POOL_DEQUE 64  // tasks a deque has room for at first
+
+typedef struct pool_deque {
+    pthread_mutex_t lock;
+    pool_task_t **tasks;  // a ring of capacity slots
+    size_t head;          // slot of the task at the front
+    size_t len;
+    size_t capacity;
+} __attribute__((aligned(64))) pool_deque_t;
+
+struct pool_batch {
+    int pending;          // tasks not done yet, protected by lock
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+};
+
+static pthread_t *workers;
+static pool_deque_t *deques;
+static int num_workers;
+static unsigned int next_deque;  // where pool_run puts its next task
+
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static int idle;
+static int queued;
+static int stopping;
+
+static void *worker_loop(void *arg);
+
+// adds a task at the back of a deque
+static void deque_push(pool_deque_t *deque, pool_task_t *task) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->len == deque->capacity) {
+        size_t capacity = 2 * deque->capacity;
+        pool_task_t **tasks = malloc(capacity * sizeof(pool_task_t *));
+        if (tasks == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        for (size_t i = 0; i < deque->len; i++) {
+            tasks[i] = deque->tasks[(deque->head + i) % deque->capacity];
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->head = 0;
+        deque->capacity = capacity;
+    }
+    deque->tasks[(deque->head + deque->len) % deque->capacity] = task;
+    // len is peeked at without the lock by deque_pop
+    __atomic_store_n(&deque->len, deque->len + 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&deque->lock);
+}
+
+// takes a task from the back of a deque (its owner) or the front (a thief),
+// or returns NULL if it's empty
+static pool_task_t *deque_pop(pool_deque_t *deque, int back) {
+    pool_task_t *task = NULL;
+
+    if (__atomic_load_n(&deque->len, __ATOMIC_RELAXED) == 0)
+        return NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->len > 0) {
+        if (back) {
+            task = deque->tasks[(deque->head + deque->len - 1) % deque->capacity];
+        } else {
+            task = deque->tasks[deque->head];
+            deque->head = (deque->head + 1) % deque->capacity;
+        }
+        __atomic_store_n(&deque->len, deque->len - 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+/* Starts the given number of workers. With pin set, worker i only runs on
+ * core i (modulo the number of cores). Must be called once, before
+ * pool_run. */
+void pool_start(int nworkers, int pin) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int err;
+
+    num_workers = nworkers;
+    if ((workers = calloc(num_workers, sizeof(pthread_t))) == NULL
+            || (deques = calloc(num_workers, sizeof(pool_deque_t))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i < num_workers; i++) {
+        pthread_mutex_init(&deques[i].lock, 0);
+        deques[i].capacity = POOL_DEQUE;
+        if ((deques[i].tasks = malloc(POOL_DEQUE * sizeof(pool_task_t *))) == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+    for (long i = 0; i < num_workers; i++) {
+        if ((err = pthread_create(&workers[i], 0, worker_loop, (void *) i)))
+            handle_error_en(err, "pthread_create");
+#ifdef __linux__
+        if (pin && cores > 0) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(i % cores, &cpus);
+            if ((err = pthread_setaffinity_np(workers[i], sizeof(cpus), &cpus)))
+                handle_error_en(err, "pthread_setaffinity_np");
+        }
+#else
+        (void) pin;
+        (void) cores;
+#endif
+    }
+}
+
+/* Returns 1 if the workers have been started. */
+int pool_running(void) {
+    return num_workers > 0;
+}
+
+/* Runs the n tasks on the workers and returns once they have all run. */
+void pool_run(pool_task_t **tasks, int n) {
+    pool_batch_t batch;
+    int cancel;
+
+    if (n == 0)
+        return;
+    batch.pending = n;
+    pthread_mutex_init(&batch.lock, 0);
+    pthread_cond_init(&batch.done, 0);
+
+    for (int i = 0; i < n; i++) {
+        unsigned int deque = __atomic_fetch_add(&next_deque, 1, __ATOMIC_RELAXED);
+        tasks[i]->batch = &batch;
+        deque_push(&deques[deque % num_workers], tasks[i]);
+    }
+    __atomic_add_fetch(&queued, n, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&idle, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&idle_lock);
+        if (n == 1) {
+            pthread_cond_signal(&wake);
+        } else {
+            pthread_cond_broadcast(&wake);
+        }
+        pthread_mutex_unlock(&idle_lock);
+    }
+
+    // the batch is on this stack, so the wait must not be cancelled
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel);
+    pthread_mutex_lock(&batch.lock);
+    while (batch.pending > 0) {
+        pthread_cond_wait(&batch.done, &batch.lock);
+    }
+    pthread_mutex_unlock(&batch.lock);
+    pthread_setcancelstate(cancel, 0);
+
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.done);
+}
+
+// Code executed by the workers: runs tasks, its own first, until the pool is
+// stopped.
+static void *worker_loop(void *arg) {
+    int self = (int) (long) arg;
+    pool_task_t *task;
+
+    while (1) {
+        task = deque_pop(&deques[self], 1);
+        for (int i = 1; task == NULL && i < num_workers; i++) {
+            task = deque_pop(&deques[(self + i) % num_workers], 0);
+        }
+
+        if (task != NULL) {
+            pool_batch_t *batch = task->batch;
+            __atomic_sub_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+            task->run(task->arg);
+            // under the lock: the batch is gone as soon as pool_run sees it done
+            pthread_mutex_lock(&batch->lock);
+            if (--batch->pending == 0)
+                pthread_cond_signal(&batch->done);
+            pthread_mutex_unlock(&batch->lock);
+            continue;
+        }
+
+        pthread_mutex_lock(&idle_lock);
+        __atomic_add_fetch(&idle, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&queued, __ATOMIC_SEQ_CST) == 0 && !stopping) {
+            pthread_cond_wait(&wake, &idle_lock);
+        }
+        __atomic_sub_fetch(&idle, 1, __ATOMIC_SEQ_CST);
+        if (stopping) {
+            pthread_mutex_unlock(&idle_lock);
+            break;
+        }
+        pthread_mutex_unlock(&idle_lock);
+    }
+    return NULL;
+}
+
+/* Stops the workers. No tasks may be running. */
+void pool_stop(void) {
+    if (num_workers == 0)
+        return;
+    pthread_mutex_lock(&idle_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&wake);
+    pthread_mutex_unlock(&idle_lock);
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(workers[i], NULL);
+        pthread_mutex_destroy(&deques[i].lock);
+        free(deques[i].tasks);
+    }
+    free(workers);
+    free(deques);
+    num_workers = 0;
+}
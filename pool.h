@@ -0,0 +1,24 @@
+#ifndef POOL_H_
+#define POOL_H_
+
+/*
+ * A fixed set of worker threads that run tasks handed to them with pool_run.
+ * Every worker has a deque of tasks: it takes tasks from the back of its own
+ * deque and, once that is empty, steals from the front of the others', so a
+ * worker that got slow tasks doesn't hold up the rest.
+ */
+
+typedef struct pool_batch pool_batch_t;
+
+typedef struct pool_task {
+    void (*run)(void *arg);
+    void *arg;
+    pool_batch_t *batch;  // set by pool_run
+} pool_task_t;
+
+void pool_start(int workers, int pin);
+int pool_running(void);
+void pool_run(pool_task_t **tasks, int n);
+void pool_stop(void);
+
+#endif  // POOL_H_
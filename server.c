@@ -9,10 +9,16 @@
 #include <errno.h>
 #include "./db.h"
 #include "./comm.h"
+#include "./pool.h"
 #include <pthread.h>
 #include <sys/time.h>
 #include <time.h>
 #include <signal.h>
+#include <sched.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+#endif
 #ifdef __APPLE__
 #include "pthread_OSX.h"
 #endif
@@ -24,232 +30,386 @@ void cleanup_pthread_mutex_unlock(void *arg) {
 
 int accepting_clients = 1;
 /* 
- * Use the variables in this struct to synchronize your main thread with client
- * threads. Note that all client threads must have terminated before you clean
+ * Use the variables in this struct to synchronize your main thread with the
+ * clients. Note that all clients must have disconnected before you clean
  * up the database. 
  */
 typedef struct server_control {
     pthread_mutex_t server_mutex;
     pthread_cond_t server_cond;
-    int num_client_threads;
+    int num_clients;
 } server_control_t;
 
 /*
- * Controls when the clients in the client thread list should be stopped and
+ * Every thread that runs commands has a gate record that says whether it is
+ * in the middle of one, on a cache line of its own. Records are only ever
+ * added.
+ */
+typedef struct gate_record {
+    int active;
+    struct gate_record *next;
+} __attribute__((aligned(64))) gate_record_t;
+
+/*
+ * Controls when the clients in the client list should be stopped and
  * let go.
  */
 typedef struct client_control {
     pthread_mutex_t go_mutex;
     pthread_cond_t go;
     int stopped;
+    gate_record_t *records;  // added to under go_mutex
+    int membarrier;          // set if stopping can fence the running threads
 } client_control_t;
 
 /*
- * The encapsulation of a client thread, i.e., the thread that handles
- * commands from clients.
+ * The encapsulation of a client, i.e., a connection that sends commands. Its
+ * commands are run by whichever I/O thread (see comm.c) serves it.
  */
 typedef struct client {
-    pthread_t thread;
-    FILE *cxstr;  // File stream for input and output
+    comm_conn_t *conn;
+    int closing;  // set when the server is dropping the connection
     // For client list
+    int list;
     struct client *prev;
     struct client *next;
 } client_t;
 
+#define CLIENT_LISTS 16  // client lists, each with a lock of its own
+
+/*
+ * The clients are dealt out over several lists, so that connecting and
+ * disconnecting clients seldom wait for each other. A client goes in at the
+ * head of its list and is unlinked where it is, both in constant time.
+ */
+typedef struct client_list {
+    pthread_mutex_t mutex;
+    client_t *head;
+} __attribute__((aligned(64))) client_list_t;
+
 /*
  * The encapsulation of a thread that handles signals sent to the server.
- * When SIGINT is sent to the server all client threads should be destroyed.
+ * When SIGINT is sent to the server all clients should be disconnected.
  */
 typedef struct sig_handler {
     sigset_t set;
     pthread_t thread;
 } sig_handler_t;
 
-client_t *thread_list_head;
-pthread_mutex_t thread_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+/*
+ * A file load (the f command) can take seconds, and the I/O thread that got
+ * it would keep every other connection it serves waiting all that time. So
+ * loads are handed to the loader thread instead, which runs them in the
+ * order they come as commands of their clients (stopping for s like any
+ * other), and gives each connection its response with comm_resume.
+ */
+typedef struct load {
+    client_t *client;
+    struct load *next;
+    char command[BUFLEN];
+} load_t;
+
+typedef struct loader {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    load_t *head;
+    load_t *tail;
+    pthread_t thread;
+} loader_t;
+
+client_list_t client_lists[CLIENT_LISTS];
+loader_t loader;
 
-void *run_client(void *arg);
 void *monitor_signal(void *arg);
-void thread_cleanup(void *arg);
+void client_control_done();
 
 client_control_t *c_control;
 server_control_t *s_control;
 
-// Called by client threads to wait until progress is permitted
-void client_control_wait() {
-    // Block the calling thread until the main thread calls
-    // client_control_release()
+static __thread gate_record_t *my_gate;
+
+// gives the calling thread a gate record
+static gate_record_t *gate_register(void) {
+    if ((my_gate = (gate_record_t *) calloc(1, sizeof(gate_record_t))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
     pthread_mutex_lock(&c_control->go_mutex);
-    pthread_cleanup_push(&cleanup_pthread_mutex_unlock, (void *) &c_control->go_mutex);
-    while (c_control->stopped == 1) {
-        pthread_cond_wait(&c_control->go, &c_control->go_mutex);
+    my_gate->next = c_control->records;
+    c_control->records = my_gate;
+    pthread_mutex_unlock(&c_control->go_mutex);
+    return my_gate;
+}
+
+// Called by I/O threads to wait until the client may run a command. Returns
+// -1 if the client is being disconnected instead; otherwise the command must
+// be followed by client_control_done. While clients aren't stopped this only
+// marks the thread's own gate record and loads stopped: the memory barrier
+// needed in between is left to client_control_stop when membarrier is there.
+int client_control_wait(client_t *client) {
+    gate_record_t *gate = (my_gate != NULL)? my_gate: gate_register();
+    while (1) {
+        __atomic_store_n(&gate->active, 1, __ATOMIC_RELAXED);
+        if (c_control->membarrier) {
+            __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        } else {
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        }
+        if (!__atomic_load_n(&c_control->stopped, __ATOMIC_ACQUIRE))
+            break;
+
+        // Block the calling thread until the main thread calls
+        // client_control_release()
+        __atomic_store_n(&gate->active, 0, __ATOMIC_RELEASE);
+        pthread_mutex_lock(&c_control->go_mutex);
+        while (c_control->stopped == 1 && !__atomic_load_n(&client->closing, __ATOMIC_ACQUIRE)) {
+            pthread_cond_wait(&c_control->go, &c_control->go_mutex);
+        }
+        pthread_mutex_unlock(&c_control->go_mutex);
+        if (__atomic_load_n(&client->closing, __ATOMIC_ACQUIRE))
+            return -1;
     }
-    pthread_cleanup_pop(1);
+    if (__atomic_load_n(&client->closing, __ATOMIC_ACQUIRE)) {
+        client_control_done();
+        return -1;
+    }
+    return 0;
+}
+
+// Called by I/O threads once a command let through by client_control_wait
+// has run.
+void client_control_done() {
+    __atomic_store_n(&my_gate->active, 0, __ATOMIC_RELEASE);
 }
-// Called by main thread to stop client threads
+
+// Called by main thread to stop clients. Returns once no command is running.
 void client_control_stop() {
-    c_control->stopped = 1;
+    gate_record_t *rec;
+
+    pthread_mutex_lock(&c_control->go_mutex);
+    __atomic_store_n(&c_control->stopped, 1, __ATOMIC_SEQ_CST);
+#ifdef __linux__
+    // Runs a memory barrier on every running thread, so each one either sees
+    // stopped from now on or has its gate record marked where we can see it.
+    if (c_control->membarrier)
+        syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0);
+#endif
+    rec = c_control->records;
+    pthread_mutex_unlock(&c_control->go_mutex);
+
+    // threads that register after this see stopped
+    for (; rec != NULL; rec = rec->next) {
+        while (__atomic_load_n(&rec->active, __ATOMIC_ACQUIRE)) {
+            sched_yield();
+        }
+    }
 }
 
-// Called by main thread to resume client threads
+// Called by main thread to resume clients
 // Allows clients that are blocked within client_control_wait()
 void client_control_release() {
-    c_control->stopped = 0;
+    pthread_mutex_lock(&c_control->go_mutex);
+    __atomic_store_n(&c_control->stopped, 0, __ATOMIC_RELEASE);
     pthread_cond_broadcast(&c_control->go);
+    pthread_mutex_unlock(&c_control->go_mutex);
 }
 
-// Called by listener (in comm.c) to create a new client thread
-void client_constructor(FILE *cxstr) {
-    // You should create a new client_t struct here and initialize ALL
-    // of its fields. Remember that these initializations should be 
-    // error-checked.
-    // 
-    // Step 1: Allocate memory for a new client and set its connection stream
-    // to the input argument.
-    // For client list
-    client_t *client = malloc(sizeof(client_t));
-    client -> cxstr = cxstr;
-    client -> prev = NULL;
-    client -> next = NULL;
-    // Step 2: Create the new client thread running the run_client routine.
-    int err;
+// Called by the listener (in comm.c) for every new connection. Returns the
+// new client, or NULL if the server is not accepting clients.
+void *client_constructor(comm_conn_t *conn) {
+    static int next_list;  // only the listener thread adds clients
+    client_list_t *list;
 
-    if ((err = pthread_create(&client->thread, 0, run_client, (void *) client)))
-        handle_error_en(err, "pthread_create");
-    if ((err = pthread_detach(client->thread)))
-        handle_error_en(err, "pthread_detach");
+    if (__atomic_load_n(&accepting_clients, __ATOMIC_ACQUIRE) != 1)
+        return NULL;
+
+    client_t *client = malloc(sizeof(client_t));
+    if (client == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    client->conn = conn;
+    client->closing = 0;
+    client->list = next_list;
+    client->prev = NULL;
+    client->next = NULL;
+    next_list = (next_list + 1) % CLIENT_LISTS;
+
+    // Add client to the head of its list. accepting_clients is checked again
+    // under the list's lock, so that delete_all can't miss it.
+    list = &client_lists[client->list];
+    pthread_mutex_lock(&list->mutex);
+    if (__atomic_load_n(&accepting_clients, __ATOMIC_ACQUIRE) != 1) {
+        pthread_mutex_unlock(&list->mutex);
+        free(client);
+        return NULL;
+    }
+    client->next = list->head;
+    if (list->head != NULL)
+        list->head->prev = client;
+    list->head = client;
+    __atomic_add_fetch(&s_control->num_clients, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&list->mutex);
+    return client;
 }
+
 // Free all resources associated with a client.
 // Whatever was malloc'd in client_constructor should 
 // be freed here!
 void client_destructor(client_t *client) {
-    comm_shutdown(client->cxstr); // closing the file.
     free(client);
 }
 
-// Code executed by a client thread
-void *run_client(void *arg) {
-    client_t *client = arg;
-    // Step 1: Make sure that the server is still accepting clients.
-    //         NOTE: you can use a global variable to keep track if server is still accepting clients
-    if (accepting_clients != 1) {
-        client_destructor(client); 
-        return NULL; 
-    }
+// hands a value the database found on to be sent from where it's kept
+static void send_value(db_value_t *value, comm_extent_t *extent) {
+    if (value->data == NULL)
+        return;
+    extent->data = value->data;
+    extent->len = value->len;
+    extent->release = db_release;
+    extent->arg = value->blob;
+}
+
+// Code executed by the loader thread. It can only be cancelled while it
+// waits for a load.
+void *loader_loop(void *arg) {
+    char response[BUFLEN];
+    load_t *load;
+    (void) arg;
 
-    // Step 2: Add client to the client list and push thread_cleanup to remove
-    //       it if the thread is canceled.
-    // LOCK A MUTEX HERE
-    pthread_mutex_lock(&thread_list_mutex);
-    if (thread_list_head == NULL) {  // it's the only element in the client list, so no more needs to be done.
-        thread_list_head = client;
-} else {
-    client_t *curr = thread_list_head;
-    while (curr->next != NULL) {
-        curr = curr->next;
+    while (1) {
+        pthread_mutex_lock(&loader.mutex);
+        pthread_cleanup_push(&cleanup_pthread_mutex_unlock, (void *) &loader.mutex);
+        while (loader.head == NULL) {
+            pthread_cond_wait(&loader.cond, &loader.mutex);
+        }
+        load = loader.head;
+        if ((loader.head = load->next) == NULL)
+            loader.tail = NULL;
+        pthread_cleanup_pop(1);
+
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, 0);
+        response[0] = '\0';
+        if (client_control_wait(load->client) == 0) {
+            interpret_command(load->command, response, BUFLEN, NULL);
+            db_sync(db_mark());
+            client_control_done();
+        }
+        comm_resume(load->client->conn, response);
+        free(load);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, 0);
     }
-    curr -> next = client;
-    client -> prev = curr;
-    client -> next = NULL;
+    return NULL;
 }
-pthread_mutex_lock(&s_control->server_mutex);
-s_control->num_client_threads++;
-pthread_mutex_unlock(&s_control->server_mutex);
-pthread_mutex_unlock(&thread_list_mutex);
-pthread_cleanup_push(thread_cleanup, (void *) client);
-
-    // Step 3: Loop comm_serve (in comm.c) to receive commands and output
-    //       responses. Note that the client may terminate the connection at
-    //       any moment, in which case reading/writing to the connection stream
-    //       on the server side will send this process a SIGPIPE. You must
-    //       ensure that the server doesn't crash when this happens!
-char response[BUFLEN];
-char command[BUFLEN];    
-memset(response, '\0', BUFLEN);
-memset(command, '\0', BUFLEN);
-
-    // setting up signal ignoring. 
-sigset_t set;
-sigemptyset(&set);
-sigaddset(&set, SIGPIPE);
-pthread_sigmask(SIG_BLOCK, &set, 0);
 
+// Hands a file load to the loader thread. Returns -1 if it couldn't.
+static int client_load(client_t *client, char *command) {
+    load_t *load = malloc(sizeof(load_t));
 
-while (comm_serve(client->cxstr, response, command) == 0) {
-    client_control_wait();
-    interpret_command(command, response, BUFLEN);
+    if (load == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    load->client = client;
+    load->next = NULL;
+    strcpy(load->command, command);
+    pthread_mutex_lock(&loader.mutex);
+    if (loader.tail == NULL) {
+        loader.head = load;
+    } else {
+        loader.tail->next = load;
+    }
+    loader.tail = load;
+    pthread_cond_signal(&loader.cond);
+    pthread_mutex_unlock(&loader.mutex);
+    return 0;
 }
 
-    // Step 4: When the client is done sending commands, exit the thread
-    //       cleanly.
+// Called by an I/O thread (in comm.c) for every command a client sends. A
+// file load goes on in the loader thread, and its response comes later.
+int client_command(void *arg, char *command, char *response, comm_extent_t *extent) {
+    db_value_t value = {0};
+
+    if (command[0] == 'f' && client_load((client_t *) arg, command) == 0)
+        return 1;
+    if (client_control_wait((client_t *) arg) < 0)
+        return -1;
+    interpret_command(command, response, BUFLEN, &value);
+    client_control_done();
+    send_value(&value, extent);
+    return 0;
+}
 
-pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-pthread_cleanup_pop(1);
-    // Keep the signal handler thread in mind when writing this function!
-return NULL;
+// Called by an I/O thread (in comm.c) for every binary request a client sends
+int client_request(void *arg, int op, char *key, char *value, char *result,
+        comm_extent_t *extent) {
+    db_value_t found = {0};
+    int status;
+
+    if (client_control_wait((client_t *) arg) < 0)
+        return -1;
+    status = db_request(op, key, value, result, BUFLEN, &found);
+    client_control_done();
+    send_value(&found, extent);
+    return (status < 0)? COMM_BAD: status;
 }
 
 void delete_all() {
-    pthread_mutex_lock(&thread_list_mutex);
-    // Cancel every thread in the client thread list with the 
-    // pthread_cancel function.
-    accepting_clients = 0;
-    client_t *curr = thread_list_head;
-
-    while (curr != NULL) { 
-     pthread_cancel(curr->thread);
-     curr = curr->next;
- }
- pthread_mutex_unlock(&thread_list_mutex);
+    // Shut down the connection of every client in the client lists. The I/O
+    // threads see them end and disconnect them.
+    __atomic_store_n(&accepting_clients, 0, __ATOMIC_RELEASE);
+    for (int i = 0; i < CLIENT_LISTS; i++) {
+        pthread_mutex_lock(&client_lists[i].mutex);
+        client_t *curr = client_lists[i].head;
+
+        while (curr != NULL) {
+            __atomic_store_n(&curr->closing, 1, __ATOMIC_RELEASE);
+            comm_close(curr->conn);
+            curr = curr->next;
+        }
+        pthread_mutex_unlock(&client_lists[i].mutex);
+    }
+
+    // wake up clients that are stopped, so they see they are closing
+    pthread_mutex_lock(&c_control->go_mutex);
+    pthread_cond_broadcast(&c_control->go);
+    pthread_mutex_unlock(&c_control->go_mutex);
 }
 
-// Cleanup routine for client threads, called on cancels and exit.
-void thread_cleanup(void *arg) { // takes in the client
-    // Remove the client object from thread list
+// Called by an I/O thread (in comm.c) when a client's connection has ended.
+void client_disconnect(void *arg) { // takes in the client
+    // Remove the client object from its list
     client_t *client = (client_t *)arg;
-    // edge case: to delete is at the front of the list.
-    if (client == thread_list_head) { 
-        if (client -> next == NULL) { // it's the only item in the list.
-            thread_list_head = NULL;
+    client_list_t *list = &client_lists[client->list];
+    pthread_mutex_lock(&list->mutex);
+    if (client->prev == NULL) {
+        list->head = client->next;
     } else {
-        pthread_mutex_lock(&thread_list_mutex);
-        thread_list_head = client -> next ;
-        thread_list_head -> prev = NULL;
-        pthread_mutex_unlock(&thread_list_mutex);
+        client->prev->next = client->next;
     }
-} else {
-        if (client->next == NULL) { // edge case: to delete is at the end of the list.
-            pthread_mutex_lock(&thread_list_mutex);
-            client -> prev -> next = NULL;
-            pthread_mutex_unlock(&thread_list_mutex);
-        } else { // general case: somewhere in the middle of the list
-            pthread_mutex_lock(&thread_list_mutex);
-            client -> prev -> next = client -> next;
-            client -> next -> prev = client -> prev;
-            pthread_mutex_unlock(&thread_list_mutex);
-        }
+    if (client->next != NULL) {
+        client->next->prev = client->prev;
     }
+    pthread_mutex_unlock(&list->mutex);
     client_destructor(client);
-    // lock the server control mutex 
-    pthread_mutex_lock(&s_control->server_mutex);
-    // pthread_cond_signal to signal the server cond
-    // while the length of the list is greater than zero, use pthread_cond_wait. 
-    s_control->num_client_threads--;
-    
-    if (s_control->num_client_threads == 0) {
+    // The count only needs the server control mutex when it gets to zero, to
+    // wake up the main thread (which checks it under the mutex).
+    if (__atomic_sub_fetch(&s_control->num_clients, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_lock(&s_control->server_mutex);
         pthread_cond_signal(&s_control->server_cond);
+        pthread_mutex_unlock(&s_control->server_mutex);
     }
-
-    pthread_mutex_unlock(&s_control->server_mutex);
-
 }
 
+comm_handler_t client_handler = {client_constructor, client_command, client_request, client_disconnect,
+    db_mark, db_sync};
+
 // Code executed by the signal handler thread. For the purpose of this
 // assignment, there are two reasonable ways to implement this.
 // The one you choose will depend on logic in sig_handler_constructor. 
 // 'man 7 signal' and 'man sigwait' are both helpful for making this
-// decision. One way or another, all of the server's client threads 
-// should terminate on SIGINT. The server (this includes the listener 
+// decision. One way or another, all of the server's clients 
+// should be disconnected on SIGINT. The server (this includes the listener 
 // thread) should not, however, terminate on SIGINT!
 void *monitor_signal(void *arg) {
     int sig;
@@ -257,7 +417,7 @@ void *monitor_signal(void *arg) {
     while (1) {
         if (sigwait(&handler->set, &sig) == 0) {
             delete_all();
-            accepting_clients = 1;
+            __atomic_store_n(&accepting_clients, 1, __ATOMIC_RELEASE);
         }
     }
     return NULL;
@@ -285,11 +445,83 @@ void sig_handler_destructor(sig_handler_t *sighandler) {
     free(sighandler);
 }
 
+// Code executed by the checkpoint thread: checkpoints the database every
+// interval seconds. It can only be cancelled between checkpoints.
+void *checkpoint_loop(void *arg) {
+    int interval = *(int *) arg;
+    while (1) {
+        sleep(interval);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, 0);
+        if (db_checkpoint() < 0)
+            perror("checkpoint");
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, 0);
+    }
+    return NULL;
+}
 
-// The arguments to the server should be the port number.
+// The arguments to the server should be the port number, optionally preceded
+// by -e and the name of the storage engine to use (tree, skiplist, btree or art),
+// and by -l and a write-ahead log to keep the database in. -i and -b say how
+// many microseconds the log may wait for how many changes to build up before
+// it writes them out together (see db_open_log), and -c how many seconds go
+// between checkpoints (see db_checkpoint), if any. -w runs commands on a pool
+// of that many worker threads instead of on the I/O threads (see comm.c), and
+// -p pins each worker to a core. -f puts a filter sized for that many keys in
+// front of the engine (see db_filter), and -x a hash index for that many keys
+// next to it (see db_index).
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "%s\n", "usage: server <port>");
+    char *usage = "usage: server [-e engine] [-l log [-i usec] [-b changes] [-c seconds]] "
+        "[-w workers [-p]] [-f keys] [-x keys] <port>";
+    char *engine_name = NULL;
+    char *log_name = NULL;
+    int log_interval = 0;
+    int log_batch = 64;
+    int checkpoint_interval = 0;
+    int workers = 0;
+    int pin = 0;
+    long filter_keys = 0;
+    long index_keys = 0;
+    pthread_t checkpoint_thread;
+    int opt;
+    int err;
+    while ((opt = getopt(argc, argv, "e:l:i:b:c:w:pf:x:")) != -1) {
+        switch (opt) {
+        case 'e':
+            engine_name = optarg;
+            break;
+        case 'l':
+            log_name = optarg;
+            break;
+        case 'i':
+            log_interval = atoi(optarg);
+            break;
+        case 'b':
+            log_batch = atoi(optarg);
+            break;
+        case 'c':
+            checkpoint_interval = atoi(optarg);
+            break;
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        case 'p':
+            pin = 1;
+            break;
+        case 'f':
+            filter_keys = atol(optarg);
+            break;
+        case 'x':
+            index_keys = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "%s\n", usage);
+            exit(1);
+        }
+    }
+    if (argc - optind != 1 || log_interval < 0 || log_batch < 1 || checkpoint_interval < 0
+            || (checkpoint_interval > 0 && log_name == NULL) || workers < 0
+            || (pin && workers == 0) || filter_keys < 0 || index_keys < 0) {
+        fprintf(stderr, "%s\n", usage);
         exit(1);
     }
     // mallocing controls
@@ -300,17 +532,52 @@ int main(int argc, char *argv[]) {
     pthread_mutex_init(&c_control -> go_mutex, 0);
     pthread_cond_init(&c_control -> go, 0);
     c_control -> stopped = 0;
+    c_control -> records = NULL;
+    c_control -> membarrier = 0;
+#ifdef __linux__
+    c_control -> membarrier =
+        (syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0);
+#endif
     
     // initalizing server control
     pthread_mutex_init(&s_control -> server_mutex, 0);
     pthread_cond_init(&s_control -> server_cond, 0);
-    s_control -> num_client_threads = 0;
+    s_control -> num_clients = 0;
+
+    for (int i = 0; i < CLIENT_LISTS; i++) {
+        pthread_mutex_init(&client_lists[i].mutex, 0);
+        client_lists[i].head = NULL;
+    }
+    pthread_mutex_init(&loader.mutex, 0);
+    pthread_cond_init(&loader.cond, 0);
+    loader.head = NULL;
+    loader.tail = NULL;
+
+    if (db_init(engine_name) < 0) {
+        fprintf(stderr, "server: unknown engine %s\n", engine_name);
+        exit(1);
+    }
+    db_filter((size_t) filter_keys);
+    db_index((size_t) index_keys);
+    if (log_name != NULL && db_open_log(log_name, log_interval, log_batch) < 0) {
+        perror(log_name);
+        exit(1);
+    }
+    if (checkpoint_interval > 0) {
+        if ((err = pthread_create(&checkpoint_thread, 0, checkpoint_loop, &checkpoint_interval)))
+            handle_error_en(err, "pthread_create");
+    }
 
     // Step 1: Set up the signal handler.
     sig_handler_t *handler = sig_handler_constructor();
-    // Step 2: Start a listener thread for clients (see start_listener in 
+    // Step 2: Start the workers, if any, the loader thread, and a listener
+    //       thread and the I/O threads for clients (see start_listener in
     //       comm.c).
-    pthread_t listener_thread = start_listener(atoi(argv[1]), client_constructor);
+    if (workers > 0)
+        pool_start(workers, pin);
+    if ((err = pthread_create(&loader.thread, 0, loader_loop, NULL)))
+        handle_error_en(err, "pthread_create");
+    start_listener(atoi(argv[optind]), &client_handler);
 
     // Step 3: Loop for command line input and handle accordingly until EOF.
 
@@ -346,6 +613,13 @@ int main(int argc, char *argv[]) {
     if (strcmp(command, "p") == 0 && potential_file != NULL) {
         db_print(potential_file);
     } 
+    if (strcmp(command, "c") == 0 && db_checkpoint() < 0) {
+        perror("checkpoint");
+    }
+    if (strcmp(command, "i") == 0) {
+        db_stats(stdout);
+        fflush(stdout);
+    }
 }
         // Step 4: Destroy the signal handler, delete all clients, cleanup the
         //       database, cancel the listener thread, and exit.
@@ -357,16 +631,26 @@ int main(int argc, char *argv[]) {
     pthread_mutex_lock(&s_control->server_mutex);
         // while the length of the list is greater than zero, use pthread_cond_wait. 
     pthread_cleanup_push(&cleanup_pthread_mutex_unlock, (void *) &s_control->server_mutex);
-    while (s_control->num_client_threads > 0) {
+    while (__atomic_load_n(&s_control->num_clients, __ATOMIC_ACQUIRE) > 0) {
         pthread_cond_wait(&s_control->server_cond, &s_control->server_mutex);
     }
     pthread_cleanup_pop(1);
-        // (3) cleanup the database
+        // (3) stop the loader (idle, with no clients left) and checkpointing,
+        //     and cleanup the database
+    pthread_cancel(loader.thread);
+    pthread_join(loader.thread, NULL);
+    if (checkpoint_interval > 0) {
+        pthread_cancel(checkpoint_thread);
+        pthread_join(checkpoint_thread, NULL);
+    }
     db_cleanup();
-        // (4) cancel the listener thread
-    pthread_cancel(listener_thread);
+        // (4) stop the listener and the I/O threads
+    comm_stop();
+    pool_stop();
         // destroy all mutex
-    pthread_mutex_destroy(&thread_list_mutex);
+    for (int i = 0; i < CLIENT_LISTS; i++) {
+        pthread_mutex_destroy(&client_lists[i].mutex);
+    }
     pthread_mutex_destroy(&c_control->go_mutex);
     pthread_mutex_destroy(&s_control->server_mutex);
         // destroy all cond.
@@ -0,0 +1,379 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include "./engine.h"
+#include "./blob.h"
+#include "./epoch.h"
+
+// The skiplist engine keeps every key in one sorted linked list (level 0),
+// with sparser express lists above it. It takes no locks: nodes are linked
+// in and out with compare-and-swap, and queries never write to shared
+// memory at all.
+//
+// Removing a node first marks it, by setting the low bit of each of its
+// next pointers, and then unlinks it. A marked pointer can't be the target
+// of a compare-and-swap, so nothing can be linked in behind a node that is
+// on its way out. Whoever runs into a marked node on the way down unlinks
+// it. Unlinked nodes are freed through epoch_retire.
+
+#define SKIPLIST_LEVELS 16  // enough for 4^16 keys
+#define MARK ((uintptr_t) 1)
+
+typedef struct sl_node {
+    char *name;
+    char *value;
+    int height;
+    // The inserting thread and the removing thread each hold a reference
+    // until they are done linking and unlinking the node; the last one to
+    // let go retires it.
+    int refs;
+    uintptr_t next[];  // successor at each level, | MARK once removed
+} sl_node_t;
+
+static sl_node_t *head;  // sentinel that comes before every key
+
+static inline sl_node_t *unmarked(uintptr_t next) {
+    return (sl_node_t *) (next & ~MARK);
+}
+
+static inline uintptr_t load_next(sl_node_t *node, int level) {
+    return __atomic_load_n(&node->next[level], __ATOMIC_ACQUIRE);
+}
+
+static inline int cas_next(sl_node_t *node, int level, uintptr_t *expected, uintptr_t desired) {
+    return __atomic_compare_exchange_n(&node->next[level], expected, desired, 0,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+// Returns a random height for a new node: 1 with probability 3/4, 2 with
+// probability 3/16 and so on. Every thread runs its own xorshift generator.
+static int random_height(void) {
+    static __thread unsigned int state;
+    int height = 1;
+
+    if (state == 0) {
+        state = (unsigned int) time(0) ^ (unsigned int) (uintptr_t) &state;
+        if (state == 0)
+            state = 1;
+    }
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    for (unsigned int bits = state; (bits & 3) == 0 && height < SKIPLIST_LEVELS; bits >>= 2) {
+        height++;
+    }
+    return height;
+}
+
+// constructs a node of the given height
+static sl_node_t *sl_node_constructor(char *name, char *value, int height) {
+    size_t name_len = strlen(name);
+    size_t val_len = strlen(value);
+    sl_node_t *node;
+
+    if (name_len > MAXLEN || val_len > MAXLEN)
+        return 0;
+
+    if ((node = (sl_node_t *) malloc(sizeof(sl_node_t) + height * sizeof(uintptr_t))) == 0)
+        return 0;
+
+    if ((node->name = (char *) malloc(name_len + 1)) == 0) {
+        free(node);
+        return 0;
+    }
+
+    if ((node->value = (char *) malloc(val_len + 1)) == 0) {
+        free(node->name);
+        free(node);
+        return 0;
+    }
+
+    memcpy(node->name, name, name_len + 1);
+    memcpy(node->value, value, val_len + 1);
+    node->height = height;
+    node->refs = 2;
+    memset(node->next, 0, height * sizeof(uintptr_t));
+    return node;
+}
+
+// destroys a node
+static void sl_node_destructor(sl_node_t *node) {
+    free(node->name);
+    free(node->value);
+    free(node);
+}
+
+// reclaims an unlinked node (passed to epoch_retire)
+static void sl_node_reclaim(void *node) {
+    sl_node_destructor((sl_node_t *) node);
+}
+
+// drops one of the two references to node, retiring it if that was the last
+static void sl_node_release(sl_node_t *node) {
+    if (__atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        epoch_retire(node, sl_node_reclaim);
+}
+
+// Finds, at every level, the last node whose name is smaller than name
+// (preds) and the node after it (succs), unlinking any marked nodes along
+// the way. Returns the node at level 0 that holds name, or 0 if there is
+// none. Must be called inside an epoch critical section.
+static sl_node_t *sl_find(char *name, sl_node_t **preds, sl_node_t **succs) {
+    sl_node_t *pred;
+    sl_node_t *curr;
+    uintptr_t next;
+    int cmp = 1;
+
+retry:
+    pred = head;
+    for (int level = SKIPLIST_LEVELS - 1; level >= 0; level--) {
+        curr = unmarked(load_next(pred, level));
+        while (curr != 0) {
+            next = load_next(curr, level);
+            if (next & MARK) {
+                // curr is being removed: unlink it here, unless pred is too
+                uintptr_t expected = (uintptr_t) curr;
+                if (!cas_next(pred, level, &expected, next & ~MARK))
+                    goto retry;
+                curr = unmarked(next);
+                continue;
+            }
+            if ((cmp = strcmp(curr->name, name)) >= 0)
+                break;
+            pred = curr;
+            curr = unmarked(next);
+        }
+        preds[level] = pred;
+        succs[level] = curr;
+    }
+    return (succs[0] != 0 && cmp == 0)? succs[0]: 0;
+}
+
+// Queries for a key. Marked nodes are skipped rather than unlinked, so
+// this never writes to shared memory.
+static void sl_query(char *name, char *result, int len) {
+    sl_node_t *pred = head;
+    sl_node_t *curr = 0;
+    uintptr_t next;
+    int cmp = 1;
+
+    epoch_enter();
+    for (int level = SKIPLIST_LEVELS - 1; level >= 0; level--) {
+        curr = unmarked(load_next(pred, level));
+        while (curr != 0) {
+            next = load_next(curr, level);
+            if (!(next & MARK)) {
+                if ((cmp = strcmp(curr->name, name)) >= 0)
+                    break;
+                pred = curr;
+            }
+            curr = unmarked(next);
+        }
+    }
+
+    if (curr != 0 && cmp == 0) {
+        snprintf(result, len, "%s", curr->value);
+    } else {
+        result[0] = '\0';
+    }
+    epoch_exit();
+}
+
+// adds a new node into the skiplist
+static int sl_add(char *name, char *value) {
+    sl_node_t *preds[SKIPLIST_LEVELS];
+    sl_node_t *succs[SKIPLIST_LEVELS];
+    sl_node_t *node;
+    uintptr_t expected;
+
+    if ((node = sl_node_constructor(name, value, random_height())) == 0)
+        return 0;
+
+    epoch_enter();
+
+    // Linking the node in at level 0 is what adds the key.
+    do {
+        if (sl_find(name, preds, succs) != 0) {
+            epoch_exit();
+            sl_node_destructor(node);
+            return 0;
+        }
+        for (int level = 0; level < node->height; level++) {
+            node->next[level] = (uintptr_t) succs[level];
+        }
+        expected = (uintptr_t) succs[0];
+    } while (!cas_next(preds[0], 0, &expected, (uintptr_t) node));
+
+    // The express levels are only shortcuts. If the node gets removed in
+    // the meantime, its pointers get marked and we stop.
+    for (int level = 1; level < node->height; level++) {
+        while (1) {
+            uintptr_t next = load_next(node, level);
+            if (next & MARK)
+                goto linked;
+            if (unmarked(next) != succs[level] &&
+                    !cas_next(node, level, &next, (uintptr_t) succs[level]))
+                goto linked;
+            expected = (uintptr_t) succs[level];
+            if (cas_next(preds[level], level, &expected, (uintptr_t) node))
+                break;
+            if (sl_find(name, preds, succs) != node)
+                goto linked;
+        }
+    }
+
+linked:
+    // If it was removed while we were linking it, we may have linked it
+    // back in at some level; unlink it for good before letting go.
+    if (load_next(node, 0) & MARK)
+        sl_find(name, preds, succs);
+    sl_node_release(node);
+    epoch_exit();
+    return 1;
+}
+
+// removes the input argument from the skiplist
+static int sl_remove(char *name) {
+    sl_node_t *preds[SKIPLIST_LEVELS];
+    sl_node_t *succs[SKIPLIST_LEVELS];
+    sl_node_t *node;
+    uintptr_t next;
+
+    epoch_enter();
+    if ((node = sl_find(name, preds, succs)) == 0) {
+        epoch_exit();
+        return 0;
+    }
+
+    // mark the express levels top-down, then level 0: whoever marks level
+    // 0 is the one that removed the key
+    for (int level = node->height - 1; level >= 1; level--) {
+        next = load_next(node, level);
+        while (!(next & MARK) && !cas_next(node, level, &next, next | MARK)) {
+        }
+    }
+    next = load_next(node, 0);
+    while (1) {
+        if (next & MARK) {
+            epoch_exit();
+            return 0;
+        }
+        if (cas_next(node, 0, &next, next | MARK))
+            break;
+    }
+
+    sl_find(name, preds, succs);
+    sl_node_release(node);
+    epoch_exit();
+    return 1;
+}
+
+// Visits the keys from start up to end in order. Like a query, this takes no
+// locks and skips marked nodes, so a scan never holds up adds and removes;
+// it sees every key that is there for the whole scan.
+static void sl_scan(char *start, char *end, int (*visit)(void *, char *, char *), void *arg) {
+    sl_node_t *pred = head;
+    sl_node_t *curr = 0;
+    uintptr_t next;
+
+    epoch_enter();
+    for (int level = SKIPLIST_LEVELS - 1; level >= 0; level--) {
+        curr = unmarked(load_next(pred, level));
+        while (curr != 0) {
+            next = load_next(curr, level);
+            if (!(next & MARK)) {
+                if (strcmp(curr->name, start) >= 0)
+                    break;
+                pred = curr;
+            }
+            curr = unmarked(next);
+        }
+    }
+
+    for (; curr != 0; curr = unmarked(next)) {
+        next = load_next(curr, 0);
+        if (next & MARK)
+            continue;
+        if ((end != 0 && strcmp(curr->name, end) >= 0) || visit(arg, curr->name, curr->value))
+            break;
+    }
+    epoch_exit();
+}
+
+// Builds the skiplist from sorted entries by appending every node to the end
+// of each of its levels, with no searching and no compare-and-swap. The
+// skiplist must be empty and nobody else may be using it.
+static void sl_load(db_entry_t *entries, size_t n) {
+    sl_node_t *tail[SKIPLIST_LEVELS];
+    sl_node_t *node;
+
+    for (int level = 0; level < SKIPLIST_LEVELS; level++) {
+        tail[level] = head;
+    }
+    for (size_t e = 0; e < n; e++) {
+        if ((node = sl_node_constructor(entries[e].name, entries[e].value, random_height())) == 0) {
+            perror("load");
+            exit(1);
+        }
+        node->refs = 1;  // only the remover's is left
+        for (int level = 0; level < node->height; level++) {
+            tail[level]->next[level] = (uintptr_t) node;
+            tail[level] = node;
+        }
+    }
+}
+
+// Prints every key in order, one per line, indented by its height.
+static void sl_print(FILE *out) {
+    sl_node_t *node;
+    uintptr_t next;
+
+    epoch_enter();
+    fprintf(out, "(skiplist)\n");
+    for (node = unmarked(load_next(head, 0)); node != 0; node = unmarked(next)) {
+        next = load_next(node, 0);
+        if (!(next & MARK))
+            fprintf(out, "%*s%s %s\n", node->height, "", node->name,
+                    blob_value(node->value));
+    }
+    epoch_exit();
+}
+
+// sets up the head sentinel
+static void sl_init(void) {
+    if ((head = (sl_node_t *) calloc(1, sizeof(sl_node_t) + SKIPLIST_LEVELS * sizeof(uintptr_t))) == 0) {
+        perror("calloc");
+        exit(1);
+    }
+    head->height = SKIPLIST_LEVELS;
+}
+
+// Destroys every node other than the head.
+// No threads should be using the skiplist when this is called.
+static void sl_cleanup(void) {
+    sl_node_t *node = unmarked(head->next[0]);
+    sl_node_t *next;
+
+    while (node != 0) {
+        next = unmarked(node->next[0]);
+        sl_node_destructor(node);
+        node = next;
+    }
+    memset(head->next, 0, SKIPLIST_LEVELS * sizeof(uintptr_t));
+    epoch_barrier();
+}
+
+db_engine_t skiplist_engine = {
+    "skiplist",
+    sl_init,
+    sl_query,
+    sl_add,
+    sl_remove,
+    sl_scan,
+    sl_load,
+    sl_print,
+    sl_cleanup,
+    0, 0, 0  // batches run one key at a time
+};
@@ -0,0 +1,361 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "./slab.h"
+
+#define SLAB_CHUNK (1 << 20)  // bytes mapped from the OS at a time
+#define SLAB_BATCH 64         // objects moved to or from the depot at once
+#define SLAB_TRIM 1024        // fewest batches put in the depot between trims
+#define SLAB_CLASSES 23
+
+// Object sizes: every 16 bytes up to 256, then coarser steps up to SLAB_MAX.
+static const size_t class_size[SLAB_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 144, 160, 176, 192, 208, 224, 240, 256,
+    320, 384, 448, 512, 640, 768, 1024
+};
+
+// A free object. The batch link chains batches together in the depot.
+typedef struct free_obj {
+    struct free_obj *next;
+    struct free_obj *batch;
+} free_obj_t;
+
+// The start of every chunk, linking all chunks for slab_release. Chunks are
+// aligned to SLAB_CHUNK, so an object's chunk is its address rounded down.
+typedef struct chunk {
+    struct chunk *next;
+    size_t carved;  // bytes from the start carved into objects, once done
+    size_t free;    // bytes of them in the depot
+    int done;       // set once no cache carves from it any more
+    int empty;      // set by depot_trim if every object in it is free
+} chunk_t;
+
+// Uncarved memory left over by a thread that exited, kept at its own start.
+typedef struct spare {
+    char *end;
+    struct spare *next;
+} spare_t;
+
+typedef struct slab_cache {
+    unsigned long generation;       // of the chunks this cache points into
+    free_obj_t *free[SLAB_CLASSES];
+    unsigned int count[SLAB_CLASSES];
+    char *bump;                     // uncarved part of the current chunk
+    char *end;
+} slab_cache_t;
+
+// Everything below is protected by depot_lock.
+static pthread_mutex_t depot_lock = PTHREAD_MUTEX_INITIALIZER;
+static free_obj_t *depot[SLAB_CLASSES];  // batches of free objects
+static chunk_t *chunks;
+static spare_t *spares;
+static size_t depot_batches;     // batches in the depot
+static size_t batches_put;       // batches put in the depot since the last trim
+static size_t trim_at = SLAB_TRIM;  // batches_put that makes the next trim due
+// Bumped by slab_release, so that thread caches know to forget the chunks.
+static unsigned long generation = 1;
+
+static __thread slab_cache_t cache;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+// returns the smallest size class that fits size
+static inline int size_class(size_t size) {
+    int c;
+
+    if (size <= 256)
+        return (size == 0)? 0: (int) ((size - 1) / 16);
+    for (c = 16; class_size[c] < size; c++) {
+    }
+    return c;
+}
+
+static inline chunk_t *chunk_of(void *ptr) {
+    return (chunk_t *) ((uintptr_t) ptr & ~(uintptr_t) (SLAB_CHUNK - 1));
+}
+
+// Notes that the chunk a cache carves from won't be carved any further, and
+// how much of it was. Called with depot_lock held.
+static void chunk_done(slab_cache_t *sc) {
+    chunk_t *chunk = (chunk_t *) (void *) (sc->end - SLAB_CHUNK);
+
+    chunk->carved = sc->bump - (char *) chunk;
+    chunk->done = 1;
+}
+
+// Counts the objects of a batch of class c in or out of the free bytes of
+// their chunks, as it goes in or out of the depot, and returns how many
+// there are. The objects of a batch mostly come from one chunk, so a run of
+// them is counted at once. Called with depot_lock held.
+static unsigned int batch_count(int c, free_obj_t *batch, int put) {
+    chunk_t *chunk = 0;
+    size_t bytes = 0;
+    unsigned int n = 0;
+
+    for (free_obj_t *obj = batch; ; obj = obj->next) {
+        if (obj == 0 || chunk_of(obj) != chunk) {
+            if (chunk != 0 && put)
+                chunk->free += bytes;
+            else if (chunk != 0)
+                chunk->free -= bytes;
+            if (obj == 0)
+                return n;
+            chunk = chunk_of(obj);
+            bytes = 0;
+        }
+        bytes += class_size[c];
+        n++;
+    }
+}
+
+// Gives back to the OS every chunk that is done and whose objects are all
+// free in the depot, taking them out of it; objects still in a thread's
+// cache keep their chunk. Called with depot_lock held, once as many batches
+// have been put in the depot as it held after the last trim. Finding the
+// chunks only takes their headers; taking their objects out of the depot
+// walks it, which the batches put there since the last trim pay for.
+static void depot_trim(void) {
+    chunk_t **link;
+    chunk_t *chunk;
+    int empty = 0;
+
+    for (chunk = chunks; chunk != 0; chunk = chunk->next) {
+        chunk->empty = chunk->done && chunk->free == chunk->carved - sizeof(chunk_t);
+        empty += chunk->empty;
+    }
+    batches_put = 0;
+    if (empty == 0) {
+        trim_at = (depot_batches > SLAB_TRIM)? depot_batches: SLAB_TRIM;
+        return;
+    }
+
+    // put the objects of the other chunks back in batches
+    depot_batches = 0;
+    for (int c = 0; c < SLAB_CLASSES; c++) {
+        free_obj_t *batches = 0;
+        free_obj_t *keep = 0;
+        free_obj_t *next_batch;
+        free_obj_t *next;
+        int n = 0;
+
+        for (free_obj_t *batch = depot[c]; batch != 0; batch = next_batch) {
+            next_batch = batch->batch;
+            for (free_obj_t *obj = batch; obj != 0; obj = next) {
+                next = obj->next;
+                if (chunk_of(obj)->empty)
+                    continue;
+                obj->next = keep;
+                keep = obj;
+                if (++n == SLAB_BATCH) {
+                    keep->batch = batches;
+                    batches = keep;
+                    keep = 0;
+                    n = 0;
+                    depot_batches++;
+                }
+            }
+        }
+        if (keep != 0) {
+            keep->batch = batches;
+            batches = keep;
+            depot_batches++;
+        }
+        __atomic_store_n(&depot[c], batches, __ATOMIC_RELAXED);
+    }
+    for (link = &chunks; (chunk = *link) != 0; ) {
+        if (chunk->empty) {
+            *link = chunk->next;
+            munmap(chunk, SLAB_CHUNK);
+        } else {
+            link = &chunk->next;
+        }
+    }
+    trim_at = (depot_batches > SLAB_TRIM)? depot_batches: SLAB_TRIM;
+}
+
+// Puts a list of free objects of class c in the depot as one batch. Called
+// with depot_lock held.
+static void depot_put(int c, free_obj_t *obj) {
+    batch_count(c, obj, 1);
+    obj->batch = depot[c];
+    __atomic_store_n(&depot[c], obj, __ATOMIC_RELAXED);
+    depot_batches++;
+    if (++batches_put >= trim_at)
+        depot_trim();
+}
+
+// Called when a thread exits: hands its free objects to the depot and its
+// uncarved memory to the next thread that needs some.
+static void cache_flush(void *arg) {
+    slab_cache_t *sc = (slab_cache_t *) arg;
+
+    pthread_mutex_lock(&depot_lock);
+    if (sc->generation == __atomic_load_n(&generation, __ATOMIC_RELAXED)) {
+        if (sc->end == 0) {
+            // never carved anything
+        } else if (sc->end - sc->bump >= SLAB_MAX) {
+            spare_t *spare = (spare_t *) (void *) sc->bump;
+            spare->end = sc->end;
+            spare->next = spares;
+            spares = spare;
+        } else {
+            chunk_done(sc);
+        }
+        for (int c = 0; c < SLAB_CLASSES; c++) {
+            if (sc->free[c] != 0)
+                depot_put(c, sc->free[c]);
+        }
+    }
+    pthread_mutex_unlock(&depot_lock);
+}
+
+static void cache_key_create(void) {
+    if (pthread_key_create(&cache_key, cache_flush)) {
+        fprintf(stderr, "%s\n", "pthread_key_create failed");
+        exit(1);
+    }
+}
+
+// Empties the calling thread's cache if slab_release has run since it was
+// last used (or it never was).
+static inline slab_cache_t *get_cache(void) {
+    slab_cache_t *sc = &cache;
+    unsigned long current = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+
+    if (sc->generation != current) {
+        if (sc->generation == 0) {
+            pthread_once(&cache_key_once, cache_key_create);
+            pthread_setspecific(cache_key, sc);
+        }
+        for (int c = 0; c < SLAB_CLASSES; c++) {
+            sc->free[c] = 0;
+            sc->count[c] = 0;
+        }
+        sc->bump = sc->end = 0;
+        sc->generation = current;
+    }
+    return sc;
+}
+
+// maps a chunk aligned to its size, exiting if it can't
+static chunk_t *chunk_map(void) {
+    char *map = mmap(0, 2 * SLAB_CHUNK, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    char *start;
+
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    start = (char *) chunk_of(map + SLAB_CHUNK - 1);
+    if (start > map)
+        munmap(map, start - map);
+    munmap(start + SLAB_CHUNK, map + SLAB_CHUNK - start);
+    return (chunk_t *) (void *) start;
+}
+
+// Gives the cache a new stretch of memory to carve from: some that an exited
+// thread left behind, or a new chunk.
+static void cache_refill_chunk(slab_cache_t *sc) {
+    chunk_t *chunk;
+
+    pthread_mutex_lock(&depot_lock);
+    if (sc->end != 0)
+        chunk_done(sc);
+    if (spares != 0) {
+        sc->bump = (char *) spares;
+        sc->end = spares->end;
+        spares = spares->next;
+        pthread_mutex_unlock(&depot_lock);
+        return;
+    }
+
+    chunk = chunk_map();
+    chunk->free = 0;
+    chunk->done = 0;
+    chunk->next = chunks;
+    chunks = chunk;
+    pthread_mutex_unlock(&depot_lock);
+
+    sc->bump = (char *) (chunk + 1);
+    sc->end = (char *) chunk + SLAB_CHUNK;
+}
+
+// Returns size bytes, 16-byte aligned. size must be at most SLAB_MAX.
+void *slab_alloc(size_t size) {
+    slab_cache_t *sc = get_cache();
+    int c = size_class(size);
+    free_obj_t *obj;
+
+    // (peeking at the depot without the lock is only a hint)
+    if (sc->free[c] == 0 && __atomic_load_n(&depot[c], __ATOMIC_RELAXED) != 0) {
+        pthread_mutex_lock(&depot_lock);
+        if ((obj = depot[c]) != 0) {
+            __atomic_store_n(&depot[c], obj->batch, __ATOMIC_RELAXED);
+            depot_batches--;
+            sc->free[c] = obj;
+            sc->count[c] = batch_count(c, obj, 0);
+        }
+        pthread_mutex_unlock(&depot_lock);
+    }
+
+    if ((obj = sc->free[c]) != 0) {
+        sc->free[c] = obj->next;
+        sc->count[c]--;
+        return obj;
+    }
+
+    if ((size_t) (sc->end - sc->bump) < class_size[c])
+        cache_refill_chunk(sc);
+    obj = (free_obj_t *) (void *) sc->bump;
+    sc->bump += class_size[c];
+    return obj;
+}
+
+// Frees an object from slab_alloc. size must be the size it was asked for.
+void slab_free(void *ptr, size_t size) {
+    slab_cache_t *sc = get_cache();
+    int c = size_class(size);
+    free_obj_t *obj = (free_obj_t *) ptr;
+
+    obj->next = sc->free[c];
+    sc->free[c] = obj;
+
+    // Too many: the oldest SLAB_BATCH go to the depot as one batch.
+    if (++sc->count[c] >= 2 * SLAB_BATCH) {
+        free_obj_t *last = obj;
+        for (int i = 1; i < SLAB_BATCH; i++) {
+            last = last->next;
+        }
+        obj = last->next;
+        last->next = 0;
+        sc->count[c] = SLAB_BATCH;
+
+        pthread_mutex_lock(&depot_lock);
+        depot_put(c, obj);
+        pthread_mutex_unlock(&depot_lock);
+    }
+}
+
+/* Gives every chunk back to the OS at once, and with it every object that
+ * slab_alloc has handed out. No thread may be using any of them. */
+void slab_release(void) {
+    chunk_t *chunk;
+
+    pthread_mutex_lock(&depot_lock);
+    while ((chunk = chunks) != 0) {
+        chunks = chunk->next;
+        munmap(chunk, SLAB_CHUNK);
+    }
+    for (int c = 0; c < SLAB_CLASSES; c++) {
+        __atomic_store_n(&depot[c], 0, __ATOMIC_RELAXED);
+    }
+    spares = 0;
+    depot_batches = 0;
+    batches_put = 0;
+    trim_at = SLAB_TRIM;
+    __atomic_store_n(&generation, generation + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&depot_lock);
+}
@@ -0,0 +1,25 @@
+#ifndef SLAB_H_
+#define SLAB_H_
+
+#include <stddef.h>
+
+/*
+ * A size-classed allocator for small objects. Every thread allocates from
+ * its own free lists and carves new objects out of its own chunk of memory,
+ * so the common case takes no locks and makes no calls into malloc. A thread
+ * that frees more objects than it allocates hands them to a shared depot in
+ * batches, and a thread that runs out takes a batch from there before it
+ * carves new ones. Chunks are mapped from the OS SLAB_CHUNK bytes at a time.
+ * Once no thread carves from a chunk any more and all its objects are back
+ * in the depot, the depot lets go of them and the chunk goes back to the OS;
+ * the depot is looked over for such chunks each time as many batches have
+ * come in as it holds. slab_release gives back every chunk at once.
+ */
+
+#define SLAB_MAX 1024  // largest object slab_alloc hands out
+
+void *slab_alloc(size_t size);
+void slab_free(void *ptr, size_t size);
+void slab_release(void);
+
+#endif  // SLAB_H_
@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "./snapshot.h"
+#include "./blob.h"
+#include "./filter.h"
+#include "./keyindex.h"
+
+/*
+ * A snapshot is written while clients keep running. The keys are read with
+ * the engine's scan a block at a time: the scan stops once a block is full
+ * and picks up again at the next key after the block has been written, so
+ * the engine is never held up by the disk. Keys that change while this goes
+ * on may or may not make it in; the log from before the snapshot started
+ * (see db_checkpoint) has every such change.
+ *
+ * Loading maps the file and finds every entry in parallel, a block per task,
+ * and hands them all to the engine's load, which builds the database from
+ * sorted entries in one go instead of adding them one at a time.
+ *
+ * A value kept in a blob is written out as the value itself, and an entry
+ * too big for a block gets a block of its own, written from the blob once
+ * the scan has let go of the engine. Loading puts long values back into
+ * blobs. Snapshots from before values could be long ("dbsnap01", with 16-bit
+ * value lengths) still load.
+ */
+
+#define SNAP_MAGIC "dbsnap02"
+#define SNAP_MAGIC_V1 "dbsnap01"
+#define SNAP_BLOCK (64 * 1024)  // bytes of entries in a block
+
+typedef struct snap_header {
+    char magic[8];
+    uint64_t entries;
+    uint64_t blocks;
+    uint64_t index;     // offset of the block index
+} snap_header_t;
+
+typedef struct snap_index {
+    uint64_t offset;
+    uint64_t entries;
+} snap_index_t;
+
+// The lengths in front of an entry.
+typedef struct snap_lens {
+    uint16_t name;
+    uint32_t value;
+} snap_lens_t;
+
+#define SNAP_LENS 6     // bytes of the lengths in the file
+#define SNAP_LENS_V1 4  // in a dbsnap01 file, where the value's has 16 bits
+
+// A block being filled by snapshot_visit.
+typedef struct snap_block {
+    char data[SNAP_BLOCK];
+    size_t len;
+    uint64_t entries;
+    int more;                 // set if the scan stopped before the end
+    blob_t *big;              // held: the value of an entry too big for a block
+    char cursor[MAXLEN + 1];  // the key to pick up at
+} snap_block_t;
+
+// Arguments of load_block.
+typedef struct snap_load {
+    char *map;
+    size_t size;
+    snap_index_t *index;
+    uint64_t *first;          // number of the first entry of each block
+    db_entry_t *entries;
+    size_t lens;              // SNAP_LENS, or SNAP_LENS_V1
+    int bad;                  // set if a block runs off its end
+} snap_load_t;
+
+// writes all of buf to fd, returning -1 if it couldn't
+static int write_all(int fd, const void *buf, size_t len) {
+    for (size_t done = 0; done < len; ) {
+        ssize_t written = write(fd, (const char *) buf + done, len - done);
+        if (written < 0 && errno != EINTR)
+            return -1;
+        if (written > 0)
+            done += written;
+    }
+    return 0;
+}
+
+// makes a rename or a new file in the directory of path durable
+static int sync_dir(const char *path) {
+    char dir[4096];
+    int fd;
+    int ret;
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    if ((fd = open(dirname(dir), O_RDONLY)) < 0)
+        return -1;
+    ret = fsync(fd);
+    close(fd);
+    return ret;
+}
+
+// writes the lengths of an entry to buf
+static void put_lens(char *buf, snap_lens_t lens) {
+    memcpy(buf, &lens.name, sizeof(lens.name));
+    memcpy(buf + sizeof(lens.name), &lens.value, sizeof(lens.value));
+}
+
+// Copies a key into the block, or stops the scan if it doesn't fit. A key
+// whose value can't fit in any block is held for snapshot_write. The scan
+// may have found a key that is being removed, whose blob can't be held any
+// more; the scan then picks up at that key again, and won't find it.
+static int snapshot_visit(void *arg, char *name, char *value) {
+    snap_block_t *block = (snap_block_t *) arg;
+    blob_t *blob = blob_of(value);
+    snap_lens_t lens = {(uint16_t) strlen(name), (blob != NULL)? (uint32_t) blob->len: strlen(value)};
+    size_t need = SNAP_LENS + lens.name + lens.value + 2;
+
+    if (block->len + need > SNAP_BLOCK) {
+        if (block->len == 0 && blob_try_hold(blob))
+            block->big = blob;
+        memcpy(block->cursor, name, lens.name + 1);
+        block->more = 1;
+        return 1;
+    }
+    put_lens(block->data + block->len, lens);
+    memcpy(block->data + block->len + SNAP_LENS, name, lens.name + 1);
+    memcpy(block->data + block->len + SNAP_LENS + lens.name + 1, blob_value(value), lens.value + 1);
+    block->len += need;
+    block->entries++;
+    return 0;
+}
+
+// adds a block to the index, which has room for *capacity blocks
+static int index_add(snap_index_t **index, size_t *capacity, snap_header_t *header,
+        uint64_t entries) {
+    if (header->blocks == *capacity) {
+        *capacity = (*capacity == 0)? 64: 2 * *capacity;
+        if ((*index = realloc(*index, *capacity * sizeof(snap_index_t))) == NULL)
+            return -1;
+    }
+    (*index)[header->blocks].offset = header->index;
+    (*index)[header->blocks++].entries = entries;
+    header->entries += entries;
+    return 0;
+}
+
+// writes an entry too big for a block as a block of its own
+static int write_big(int fd, char *name, blob_t *blob) {
+    snap_lens_t lens = {(uint16_t) strlen(name), (uint32_t) blob->len};
+    char head[SNAP_LENS + MAXLEN];
+
+    put_lens(head, lens);
+    memcpy(head + SNAP_LENS, name, lens.name + 1);
+    if (write_all(fd, head, SNAP_LENS + lens.name + 1) < 0
+            || write_all(fd, blob->data, blob->len + 1) < 0)
+        return -1;
+    return 0;
+}
+
+/* Writes every key in the engine to a snapshot at path. The snapshot goes to
+ * a temporary file first and replaces the one at path only once all of it is
+ * on disk.
+ *
+ * Returns 0 on success, or -1 if the file could not be written. */
+int snapshot_write(char *path, db_engine_t *engine) {
+    char tmp[4096];
+    snap_header_t header;
+    snap_block_t *block;
+    snap_index_t *index = NULL;
+    size_t capacity = 0;
+    char *start = "";
+    int fd;
+    int ok = 0;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAP_MAGIC, sizeof(header.magic));
+    header.index = sizeof(header);
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        return -1;
+    if ((block = malloc(sizeof(snap_block_t))) == NULL
+            || write_all(fd, &header, sizeof(header)) < 0)
+        goto out;
+
+    do {
+        block->len = 0;
+        block->entries = 0;
+        block->more = 0;
+        block->big = NULL;
+        engine->scan(start, 0, snapshot_visit, block);
+        if (block->entries > 0) {
+            if (index_add(&index, &capacity, &header, block->entries) < 0
+                    || write_all(fd, block->data, block->len) < 0)
+                goto out;
+            header.index += block->len;
+        }
+        start = block->cursor;
+        if (block->big != NULL) {
+            int failed = (index_add(&index, &capacity, &header, 1) < 0
+                    || write_big(fd, block->cursor, block->big) < 0);
+            header.index += SNAP_LENS + strlen(block->cursor) + block->big->len + 2;
+            blob_drop(block->big);
+            if (failed)
+                goto out;
+            // pick up right after it: no key sorts between a key and the key
+            // with the lowest byte after it
+            strcat(block->cursor, "\x01");
+        }
+    } while (block->more);
+
+    if (write_all(fd, index, header.blocks * sizeof(snap_index_t)) < 0
+            || pwrite(fd, &header, sizeof(header), 0) != sizeof(header)
+            || fsync(fd) < 0)
+        goto out;
+    ok = 1;
+
+out:
+    close(fd);
+    free(block);
+    free(index);
+    if (!ok || rename(tmp, path) < 0 || sync_dir(path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// finds the entries of one block of the snapshot being loaded, putting
+// long values into blobs and the keys into the filter and the index
+static void load_block(void *arg, int b) {
+    snap_load_t *load = (snap_load_t *) arg;
+    uint64_t offset = load->index[b].offset;
+    db_entry_t *entry = load->entries + load->first[b];
+    snap_lens_t lens;
+    uint16_t short_len;
+    char *ref;
+
+    for (uint64_t i = 0; i < load->index[b].entries; i++, entry++) {
+        if (offset + load->lens > load->size) {
+            load->bad = 1;
+            return;
+        }
+        memcpy(&lens.name, load->map + offset, sizeof(lens.name));
+        if (load->lens == SNAP_LENS) {
+            memcpy(&lens.value, load->map + offset + sizeof(lens.name), sizeof(lens.value));
+        } else {
+            memcpy(&short_len, load->map + offset + sizeof(lens.name), sizeof(short_len));
+            lens.value = short_len;
+        }
+        entry->name = load->map + offset + load->lens;
+        entry->value = entry->name + lens.name + 1;
+        offset += load->lens + lens.name + (uint64_t) lens.value + 2;
+        if (offset > load->size || entry->name[lens.name] != '\0' || entry->value[lens.value] != '\0'
+                || lens.name >= MAXLEN || lens.value > BLOB_MAX) {
+            load->bad = 1;
+            return;
+        }
+        filter_add(entry->name);
+        if (lens.value >= MAXLEN || entry->value[0] == BLOB_TAG) {
+            if ((ref = malloc(BLOB_REF)) == NULL) {
+                perror("malloc");
+                exit(1);
+            }
+            entry->value = blob_store(entry->value, lens.value, ref);
+        }
+        keyindex_add(entry->name, entry->value);
+    }
+}
+
+/* Loads the snapshot at path into the engine, which must be empty. Does
+ * nothing if there is no snapshot.
+ *
+ * Returns 0 on success, or -1 if the snapshot could not be read or is not a
+ * snapshot. */
+int snapshot_load(char *path, db_engine_t *engine) {
+    snap_header_t header;
+    snap_load_t load;
+    struct stat st;
+    int fd;
+    int ret = -1;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return (errno == ENOENT)? 0: -1;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(header)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    memset(&load, 0, sizeof(load));
+    load.size = st.st_size;
+    if ((load.map = mmap(NULL, load.size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    memcpy(&header, load.map, sizeof(header));
+    errno = EINVAL;
+    load.lens = (memcmp(header.magic, SNAP_MAGIC_V1, sizeof(header.magic)) == 0)? SNAP_LENS_V1: SNAP_LENS;
+    if ((memcmp(header.magic, SNAP_MAGIC, sizeof(header.magic)) != 0 && load.lens == SNAP_LENS)
+            || header.index > load.size
+            || header.blocks > (load.size - header.index) / sizeof(snap_index_t))
+        goto out;
+    load.index = (snap_index_t *) (void *) (load.map + header.index);
+
+    if ((load.first = malloc((header.blocks + 1) * sizeof(uint64_t))) == NULL
+            || (load.entries = calloc(header.entries + 1, sizeof(db_entry_t))) == NULL)
+        goto out;
+    load.first[0] = 0;
+    for (uint64_t b = 0; b < header.blocks; b++) {
+        load.first[b + 1] = load.first[b] + load.index[b].entries;
+    }
+    if (load.first[header.blocks] != header.entries)
+        goto out;
+
+    engine_parallel((int) header.blocks, load_block, &load);
+    if (load.bad)
+        goto out;
+    engine->load(load.entries, header.entries);
+    ret = 0;
+
+out:
+    // the references to the blobs made by load_block, which the engine has
+    // copied, or which go with their blobs if it hasn't
+    for (uint64_t e = 0; load.entries != NULL && e < header.entries; e++) {
+        char *value = load.entries[e].value;
+        if (value != NULL && (value < load.map || value >= load.map + load.size)) {
+            if (ret < 0)
+                blob_drop(blob_of(value));
+            free(value);
+        }
+    }
+    free(load.first);
+    free(load.entries);
+    munmap(load.map, load.size);
+    return ret;
+}
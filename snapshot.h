@@ -0,0 +1,17 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include "./engine.h"
+
+/*
+ * A snapshot is every key in the database, in order, in one binary file: a
+ * header, then blocks of entries (each a 16-bit name length, a 32-bit value
+ * length, and the name and value with their terminating '\0's), then an
+ * index with the offset and number of entries of every block. The numbers
+ * are in the byte order of the machine that wrote them.
+ */
+
+int snapshot_write(char *path, db_engine_t *engine);
+int snapshot_load(char *path, db_engine_t *engine);
+
+#endif  // SNAPSHOT_H_
@@ -0,0 +1,500 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "./db.h"
+#include "./epoch.h"
+
+#define RESPLEN 1024
+#define THREADS 8         // threads changing keys at once
+#define OWN_KEYS 2048     // keys only one thread changes, per thread
+#define SHARED_KEYS 64    // keys every thread changes
+#define BATCH 4           // keys in a batch command
+#define SECONDS 2         // length of a run
+#define INDEX_KEYS 1024   // what -x sizes the index for, to crowd it
+#define CELLS (1 << 20)   // cells -r can swap in
+#define SLOTS 16          // places the cells of -r are swapped in and out of
+#define LIVE 0x11fe11feUL
+#define DEAD 0xdeadUL
+
+/*
+ * Stress tests for the parts of the database that threads share without a
+ * lock around them. Each run prints what it checked, and stops with an
+ * error at the first wrong answer. make test runs all of them.
+ *
+ * stress <engine> has THREADS threads add, remove and query keys at random
+ * through interpret_command, one at a time and in batches, while another
+ * thread scans. Each thread has keys that only it changes, and checks every
+ * response about them against what it knows they hold. All of them also
+ * change a set of shared keys, whose responses can only be checked for
+ * being one of the possible ones. Every value starts with its key and '=',
+ * so a scan can check each value it sees, as well as the order of the keys.
+ * At the end every key is queried once more.
+ *
+ * stress -x runs the same against the tree engine, with a hash index (see
+ * db_index) much too small for the keys, so that it is rebuilt while the
+ * threads run, and checks that it was.
+ *
+ * stress -r tests the epoch reclaimer by itself: threads swap cells in and
+ * out of a few slots and retire the old ones, which are marked dead when
+ * they are reclaimed, while other threads read the cells in the slots and
+ * check that none of them is dead.
+ *
+ * Usage: stress <engine> | stress -x | stress -r
+ */
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *what, const char *command, const char *response) {
+    fprintf(stderr, "stress: %s\n  command: %s\n  response: %s\n", what, command, response);
+    exit(1);
+}
+
+static volatile int stop;
+
+// what a thread knows about its own keys
+typedef struct worker {
+    int id;
+    unsigned int seed;
+    int value[OWN_KEYS];    // the number in each key's value, or -1 if absent
+    unsigned long ops;
+} worker_t;
+
+static void own_key(char *buf, int thread, int i) {
+    snprintf(buf, 32, "own%02d-%05d", thread, i);
+}
+
+static void shared_key(char *buf, int i) {
+    snprintf(buf, 32, "shared%03d", i);
+}
+
+// runs a command, which interpret_command may change, keeping a copy of it
+static void run(char *command, char *copy, char *response) {
+    snprintf(copy, RESPLEN, "%s", command);
+    response[0] = '\0';
+    interpret_command(command, response, RESPLEN, 0);
+}
+
+// returns 1 if value is key followed by '='
+static int belongs(const char *value, const char *key) {
+    size_t n = strlen(key);
+    return strncmp(value, key, n) == 0 && value[n] == '=';
+}
+
+// one add, remove or query of a key of the worker's own, checked
+static void own_single(worker_t *w) {
+    char command[RESPLEN];
+    char copy[RESPLEN];
+    char response[RESPLEN];
+    char key[32];
+    char expected[64];
+    int i = rand_r(&w->seed) % OWN_KEYS;
+    int op = rand_r(&w->seed) % 10;
+
+    own_key(key, w->id, i);
+    if (op < 4) {
+        int n = rand_r(&w->seed) % 100000;
+        snprintf(command, sizeof(command), "a %s %s=%d", key, key, n);
+        run(command, copy, response);
+        if (strcmp(response, (w->value[i] < 0)? "added": "already in database") != 0)
+            fail("wrong add", copy, response);
+        if (w->value[i] < 0)
+            w->value[i] = n;
+    } else if (op < 7) {
+        snprintf(command, sizeof(command), "d %s", key);
+        run(command, copy, response);
+        if (strcmp(response, (w->value[i] < 0)? "not in database": "removed") != 0)
+            fail("wrong remove", copy, response);
+        w->value[i] = -1;
+    } else {
+        snprintf(command, sizeof(command), "q %s", key);
+        run(command, copy, response);
+        if (w->value[i] < 0) {
+            snprintf(expected, sizeof(expected), "not found");
+        } else {
+            snprintf(expected, sizeof(expected), "%s=%d", key, w->value[i]);
+        }
+        if (strcmp(response, expected) != 0)
+            fail("wrong query", copy, response);
+    }
+}
+
+// a batch add, remove or query of BATCH keys of the worker's own, checked
+// field by field
+static void own_batch(worker_t *w) {
+    char command[RESPLEN];
+    char copy[RESPLEN];
+    char response[RESPLEN];
+    char expected[RESPLEN];
+    char key[32];
+    int first = rand_r(&w->seed) % (OWN_KEYS - BATCH);
+    int kind = rand_r(&w->seed) % 3;
+    int n = rand_r(&w->seed) % 100000;
+    int used = 1;
+    int at = 0;
+
+    command[0] = "AQD"[kind];
+    command[1] = '\0';
+    for (int i = first; i < first + BATCH; i++) {
+        own_key(key, w->id, i);
+        used += snprintf(command + used, sizeof(command) - used, " %s", key);
+        if (kind == 0)
+            used += snprintf(command + used, sizeof(command) - used, " %s=%d", key, n);
+        if (i > first)
+            expected[at++] = ' ';
+        if (kind == 1) {
+            if (w->value[i] >= 0)
+                at += snprintf(expected + at, sizeof(expected) - at, "%s=%d", key, w->value[i]);
+        } else {
+            expected[at++] = ((kind == 0) == (w->value[i] < 0))? '1': '0';
+        }
+        expected[at] = '\0';
+        if (kind == 0 && w->value[i] < 0)
+            w->value[i] = n;
+        else if (kind == 2)
+            w->value[i] = -1;
+    }
+    run(command, copy, response);
+    if (strcmp(response, expected) != 0)
+        fail("wrong batch", copy, response);
+}
+
+// one add, remove or query of a shared key, which can only be checked for
+// being one of the possible responses
+static void shared_single(worker_t *w) {
+    char command[RESPLEN];
+    char copy[RESPLEN];
+    char response[RESPLEN];
+    char key[32];
+    int op = rand_r(&w->seed) % 3;
+
+    shared_key(key, rand_r(&w->seed) % SHARED_KEYS);
+    if (op == 0) {
+        snprintf(command, sizeof(command), "a %s %s=%d", key, key, w->id);
+        run(command, copy, response);
+        if (strcmp(response, "added") != 0 && strcmp(response, "already in database") != 0)
+            fail("wrong shared add", copy, response);
+    } else if (op == 1) {
+        snprintf(command, sizeof(command), "d %s", key);
+        run(command, copy, response);
+        if (strcmp(response, "removed") != 0 && strcmp(response, "not in database") != 0)
+            fail("wrong shared remove", copy, response);
+    } else {
+        snprintf(command, sizeof(command), "q %s", key);
+        run(command, copy, response);
+        if (strcmp(response, "not found") != 0 && !belongs(response, key))
+            fail("wrong shared query", copy, response);
+    }
+}
+
+static void *worker_loop(void *arg) {
+    worker_t *w = (worker_t *) arg;
+
+    while (!stop) {
+        int pick = rand_r(&w->seed) % 16;
+        if (pick == 0) {
+            own_batch(w);
+        } else if (pick < 4) {
+            shared_single(w);
+        } else {
+            own_single(w);
+        }
+        w->ops++;
+    }
+    return NULL;
+}
+
+// Scans every key, a page at a time, checking that the keys come in order
+// and that each value belongs to its key. Returns the number of keys seen.
+static long scan_all(void) {
+    char command[RESPLEN];
+    char copy[RESPLEN];
+    char response[RESPLEN];
+    char last[RESPLEN] = "";
+    char from[RESPLEN] = "a";
+    long seen = 0;
+
+    while (1) {
+        char *save;
+        char *field;
+        int n;
+
+        snprintf(command, sizeof(command), "r %s z 16", from);
+        run(command, copy, response);
+        if ((field = strtok_r(response, " ", &save)) == NULL || (n = atoi(field)) < 0)
+            fail("wrong scan", copy, response);
+        for (int i = 0; i < n; i++) {
+            char *key = strtok_r(NULL, " ", &save);
+            char *value = strtok_r(NULL, " ", &save);
+            if (key == NULL || value == NULL || !belongs(value, key) || strcmp(last, key) >= 0)
+                fail("wrong scan", copy, key? key: "");
+            snprintf(last, sizeof(last), "%s", key);
+            seen++;
+        }
+        if ((field = strtok_r(NULL, " ", &save)) == NULL)
+            return seen;
+        if (strcmp(field, last) <= 0)
+            fail("scan cursor goes back", copy, field);
+        snprintf(from, sizeof(from), "%s", field);
+    }
+}
+
+static void *scan_loop(void *arg) {
+    long *scans = (long *) arg;
+
+    while (!stop) {
+        scan_all();
+        (*scans)++;
+    }
+    return NULL;
+}
+
+// queries every key once the threads are done, against what they know
+static void check_all(worker_t *workers) {
+    char command[RESPLEN];
+    char copy[RESPLEN];
+    char response[RESPLEN];
+    char key[32];
+    char expected[64];
+    long present = 0;
+
+    for (int t = 0; t < THREADS; t++) {
+        for (int i = 0; i < OWN_KEYS; i++) {
+            own_key(key, t, i);
+            snprintf(command, sizeof(command), "q %s", key);
+            run(command, copy, response);
+            if (workers[t].value[i] < 0) {
+                snprintf(expected, sizeof(expected), "not found");
+            } else {
+                snprintf(expected, sizeof(expected), "%s=%d", key, workers[t].value[i]);
+                present++;
+            }
+            if (strcmp(response, expected) != 0)
+                fail("wrong final query", copy, response);
+        }
+    }
+    for (int i = 0; i < SHARED_KEYS; i++) {
+        shared_key(key, i);
+        snprintf(command, sizeof(command), "q %s", key);
+        run(command, copy, response);
+        if (strcmp(response, "not found") == 0)
+            continue;
+        if (!belongs(response, key))
+            fail("wrong final query", copy, response);
+        present++;
+    }
+    if (scan_all() != present) {
+        snprintf(response, sizeof(response), "%ld keys queried", present);
+        fail("final scan missed keys", "r a z 16", response);
+    }
+}
+
+// returns the number of index rebuilds db_stats reports
+static unsigned long index_rebuilds(void) {
+    char *stats = NULL;
+    size_t len = 0;
+    unsigned long rebuilds = 0;
+    FILE *out = open_memstream(&stats, &len);
+    char *line;
+
+    if (out == NULL) {
+        perror("open_memstream");
+        exit(1);
+    }
+    db_stats(out);
+    fclose(out);
+    if ((line = strstr(stats, "rebuilds")) != NULL) {
+        while (line > stats && line[-1] == ' ') {
+            line--;
+        }
+        while (line > stats && line[-1] >= '0' && line[-1] <= '9') {
+            line--;
+        }
+        rebuilds = strtoul(line, NULL, 10);
+    }
+    free(stats);
+    return rebuilds;
+}
+
+static void run_engine(char *engine_name, int indexed) {
+    static worker_t workers[THREADS];
+    pthread_t threads[THREADS];
+    pthread_t scanner;
+    unsigned long ops = 0;
+    long scans = 0;
+    double start;
+
+    if (db_init(engine_name) < 0) {
+        fprintf(stderr, "stress: unknown engine %s\n", engine_name);
+        exit(1);
+    }
+    if (indexed)
+        db_index(INDEX_KEYS);
+    for (int t = 0; t < THREADS; t++) {
+        workers[t].id = t;
+        workers[t].seed = t + 1;
+        workers[t].ops = 0;
+        for (int i = 0; i < OWN_KEYS; i++) {
+            workers[t].value[i] = -1;
+        }
+    }
+
+    start = now();
+    for (int t = 0; t < THREADS; t++) {
+        pthread_create(&threads[t], 0, worker_loop, &workers[t]);
+    }
+    pthread_create(&scanner, 0, scan_loop, &scans);
+    while (now() - start < SECONDS) {
+        struct timespec nap = {0, 10000000};
+        nanosleep(&nap, NULL);
+    }
+    stop = 1;
+    for (int t = 0; t < THREADS; t++) {
+        pthread_join(threads[t], NULL);
+        ops += workers[t].ops;
+    }
+    pthread_join(scanner, NULL);
+    check_all(workers);
+
+    printf("%-8s %d threads: %lu commands and %ld scans checked", engine_name, THREADS, ops, scans);
+    if (indexed) {
+        unsigned long rebuilds = index_rebuilds();
+        printf(", %lu index rebuilds", rebuilds);
+        if (rebuilds == 0) {
+            printf("\nstress: the index was never rebuilt\n");
+            exit(1);
+        }
+    }
+    printf("\n");
+    db_cleanup();
+}
+
+// a cell of -r: live until it is reclaimed
+typedef struct cell {
+    unsigned long magic;
+    unsigned long seq;
+} cell_t;
+
+static cell_t *cells;
+static cell_t *slots[SLOTS];
+static unsigned long cells_used;
+static unsigned long cells_reclaimed;
+
+static void cell_reclaim(void *arg) {
+    cell_t *cell = (cell_t *) arg;
+
+    __atomic_store_n(&cell->magic, DEAD, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&cells_reclaimed, 1, __ATOMIC_RELAXED);
+}
+
+static void *swap_loop(void *arg) {
+    unsigned int seed = (unsigned int) (long) arg;
+    unsigned long *retired = (unsigned long *) malloc(sizeof(unsigned long));
+
+    *retired = 0;
+    while (!stop) {
+        unsigned long i = __atomic_fetch_add(&cells_used, 1, __ATOMIC_RELAXED);
+        cell_t *old;
+        if (i >= CELLS)
+            break;
+        cells[i].magic = LIVE;
+        cells[i].seq = i;
+        old = __atomic_exchange_n(&slots[rand_r(&seed) % SLOTS], &cells[i], __ATOMIC_ACQ_REL);
+        epoch_retire(old, cell_reclaim);
+        (*retired)++;
+    }
+    return retired;
+}
+
+static void *read_loop(void *arg) {
+    unsigned int seed = (unsigned int) (long) arg;
+    unsigned long *reads = (unsigned long *) malloc(sizeof(unsigned long));
+
+    *reads = 0;
+    while (!stop && __atomic_load_n(&cells_used, __ATOMIC_RELAXED) < CELLS) {
+        epoch_enter();
+        cell_t *cell = __atomic_load_n(&slots[rand_r(&seed) % SLOTS], __ATOMIC_ACQUIRE);
+        unsigned long seq = cell->seq;
+        // look again a little later: it must not be reclaimed meanwhile
+        for (int i = 0; i < 16; i++) {
+            if (__atomic_load_n(&cell->magic, __ATOMIC_RELAXED) != LIVE || cell->seq != seq) {
+                fprintf(stderr, "stress: cell %lu reclaimed while it was being read\n", seq);
+                exit(1);
+            }
+        }
+        epoch_exit();
+        (*reads)++;
+    }
+    return reads;
+}
+
+static void run_epoch(void) {
+    pthread_t swappers[THREADS / 2];
+    pthread_t readers[THREADS / 2];
+    unsigned long retired = 0;
+    unsigned long reads = 0;
+    unsigned long during;
+    void *count;
+    double start;
+
+    if ((cells = (cell_t *) calloc(CELLS + SLOTS, sizeof(cell_t))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i < SLOTS; i++) {
+        cells[CELLS + i].magic = LIVE;
+        cells[CELLS + i].seq = CELLS + i;
+        slots[i] = &cells[CELLS + i];
+    }
+
+    start = now();
+    for (long t = 0; t < THREADS / 2; t++) {
+        pthread_create(&swappers[t], 0, swap_loop, (void *) (t + 1));
+        pthread_create(&readers[t], 0, read_loop, (void *) (t + 101));
+    }
+    while (now() - start < SECONDS && __atomic_load_n(&cells_used, __ATOMIC_RELAXED) < CELLS) {
+        struct timespec nap = {0, 10000000};
+        nanosleep(&nap, NULL);
+    }
+    stop = 1;
+    for (int t = 0; t < THREADS / 2; t++) {
+        pthread_join(swappers[t], &count);
+        retired += *(unsigned long *) count;
+        free(count);
+        pthread_join(readers[t], &count);
+        reads += *(unsigned long *) count;
+        free(count);
+    }
+
+    // Most of what was retired must have been reclaimed along the way, and
+    // the rest by the barrier, with none of it twice.
+    during = __atomic_load_n(&cells_reclaimed, __ATOMIC_RELAXED);
+    epoch_barrier();
+    printf("epoch    %d threads: %lu reads checked, %lu of %lu cells reclaimed while running\n",
+            THREADS, reads, during, retired);
+    if (during == 0 || cells_reclaimed != retired) {
+        fprintf(stderr, "stress: %lu cells reclaimed in all\n", cells_reclaimed);
+        exit(1);
+    }
+    free(cells);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "%s\n", "usage: stress <engine> | stress -x | stress -r");
+        exit(1);
+    }
+    if (strcmp(argv[1], "-r") == 0) {
+        run_epoch();
+    } else if (strcmp(argv[1], "-x") == 0) {
+        run_engine("tree", 1);
+    } else {
+        run_engine(argv[1], 0);
+    }
+    return 0;
+}
@@ -0,0 +1,661 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include "./engine.h"
+#include "./blob.h"
+#include "./epoch.h"
+#include "./slab.h"
+
+#define DB_PARTITIONS 16  // number of independently locked trees
+#define lock(lt, lk) ((lt) == l_read)? pthread_rwlock_rdlock(lk): pthread_rwlock_wrlock(lk)
+
+// The tree engine is a treap: a binary search tree on the names that is also a
+// max-heap on a random per-node priority. Whatever order the keys arrive in,
+// the expected depth of every node is O(log n). Inserts and deletes restructure
+// the tree top-down (see unzip and zip below), so they only ever lock a node
+// after its parent and can use hand-over-hand locking.
+//
+// Queries take no locks at all. Writers never change a node that a query
+// might be looking at, apart from storing a single child pointer: when a
+// restructure would change several nodes, it builds copies of them and
+// publishes the copies with one atomic store. Nodes that have been unlinked
+// are freed through epoch_retire once no query can still be reading them.
+
+typedef struct node {
+    char *name;
+    char *value;
+    struct node *lchild;
+    struct node *rchild;
+    unsigned int priority;  // treap priority, a parent's is never lower
+    unsigned int size;      // bytes allocated for the node, name and value
+    pthread_rwlock_t lock;
+    // the name and the value follow the node in the same allocation
+} node_t;
+
+// The keyspace is split by hash into DB_PARTITIONS independent trees, so
+// that commands on different keys don't all go through the same root lock.
+// Each partition is aligned to its own cache line.
+typedef struct partition {
+    // The root node of the partition's tree, unlike all
+    // other nodes in the tree, this one is never
+    // freed (it's allocated in the data region).
+    // It has the highest priority so it always stays on top.
+    node_t head;
+} __attribute__((aligned(64))) partition_t;
+
+static partition_t partitions[DB_PARTITIONS];
+
+// type for locking
+enum locktype {l_read, l_write};
+
+// locks a node, exiting if that would deadlock
+static inline void node_lock(node_t *node, enum locktype lt) {
+    if (lock(lt, &node->lock) == EDEADLK) {
+        fprintf(stderr, "%s\n", "lock failed. deadlock.");
+        exit(1);
+    }
+}
+
+// unlocks a node, exiting if it wasn't locked
+static inline void node_unlock(node_t *node) {
+    if (pthread_rwlock_unlock(&node->lock) == EPERM) {
+        fprintf(stderr, "%s\n", "unlock failed. wasn't locked");
+        exit(1);
+    }
+}
+
+// Returns a random priority for a new node. Every thread runs its own
+// xorshift generator, so no locking is needed. The result is never
+// UINT_MAX, which is reserved for the partition roots.
+static unsigned int random_priority(void) {
+    static __thread unsigned int state;
+
+    if (state == 0) {
+        state = (unsigned int) time(0) ^ (unsigned int) (uintptr_t) &state;
+        if (state == 0)
+            state = 1;
+    }
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state % UINT_MAX;
+}
+
+// Allocates a node with room for a name and a value of the given lengths
+// right after it, and points the node's name and value there. Nodes come
+// from the slab allocator, so the common case doesn't call malloc at all.
+static node_t *node_alloc(size_t name_len, size_t val_len) {
+    unsigned int size = sizeof(node_t) + name_len + val_len + 2;
+    node_t *node = (node_t *) slab_alloc(size);
+
+    node->size = size;
+    node->name = (char *) (node + 1);
+    node->value = node->name + name_len + 1;
+    return node;
+}
+
+// constructs a node
+node_t *node_constructor(char *arg_name, char *arg_value, node_t *arg_left, node_t *arg_right) {
+    size_t name_len = strlen(arg_name);
+    size_t val_len = strlen(arg_value);
+
+    if (name_len > MAXLEN || val_len > MAXLEN)
+        return 0;
+
+    node_t *new_node = node_alloc(name_len, val_len);
+    memcpy(new_node->name, arg_name, name_len + 1);
+    memcpy(new_node->value, arg_value, val_len + 1);
+
+    new_node->lchild = arg_left;
+    new_node->rchild = arg_right;
+    new_node->priority = random_priority();
+    pthread_rwlock_init(&new_node->lock, 0);
+    return new_node;
+}
+
+// destroys a node
+void node_destructor(node_t *node) {
+    pthread_rwlock_destroy(&node->lock);
+    slab_free(node, node->size);
+}
+
+// Returns a copy of node, with its own copy of the name and value. The copy
+// gets its own lock, which nobody holds.
+static node_t *node_copy(node_t *node) {
+    size_t name_len = node->value - node->name - 1;
+    node_t *copy = node_alloc(name_len, node->size - sizeof(node_t) - name_len - 2);
+
+    memcpy(copy->name, node->name, node->size - sizeof(node_t));
+    copy->lchild = node->lchild;
+    copy->rchild = node->rchild;
+    copy->priority = node->priority;
+    pthread_rwlock_init(&copy->lock, 0);
+    return copy;
+}
+
+// reclaims a node removed from the tree or replaced by a copy (passed to
+// epoch_retire)
+static void node_reclaim(void *node) {
+    node_destructor((node_t *) node);
+}
+
+// returns the number of the partition that name belongs in (FNV-1a hash)
+static inline int partition_index(char *name) {
+    unsigned int hash = 2166136261u;
+
+    for (; *name != '\0'; name++) {
+        hash ^= (unsigned char) *name;
+        hash *= 16777619u;
+    }
+    return hash % DB_PARTITIONS;
+}
+
+// returns the root of the partition that name belongs in
+static inline node_t *partition_head(char *name) {
+    return &partitions[partition_index(name)].head;
+}
+
+// returns the link in parent that a search for name follows
+static inline node_t **child_link(node_t *parent, char *name) {
+    return (strcmp(name, parent->name) < 0)? &parent->lchild: &parent->rchild;
+}
+
+// reads a child pointer that writers may be storing to concurrently
+static inline node_t *load_child(node_t **link) {
+    return __atomic_load_n(link, __ATOMIC_ACQUIRE);
+}
+
+// links node into the tree where lock-free queries can see it
+static inline void publish(node_t **link, node_t *node) {
+    __atomic_store_n(link, node, __ATOMIC_RELEASE);
+}
+
+node_t *search(char *, node_t *, node_t **, enum locktype);
+
+// Queries for a key without taking any locks. The epoch critical section
+// keeps every node we can reach from being freed under us.
+static void tree_query(char *name, char *result, int len) {
+    node_t *target = partition_head(name);
+    int cmp = 1;
+
+    epoch_enter();
+    while (cmp != 0 && (target = load_child(child_link(target, name))) != 0) {
+        cmp = strcmp(name, target->name);
+    }
+
+    if (target == 0) {
+        result[0] = '\0';
+    } else {
+        snprintf(result, len, "%s", target->value);
+    }
+    epoch_exit();
+}
+
+// Returns 1 if name is in the subtree rooted at node, 0 otherwise. The
+// caller must hold a write lock on node's parent, so that no other thread
+// can enter the subtree behind us. Threads that are already inside it hold
+// at least one lock on their way down, so walking it hand-over-hand with
+// write locks keeps us behind them: an insert of name that's ahead of us
+// is seen before we can get past its insertion point.
+static int subtree_contains(char *name, node_t *node) {
+    node_t *next;
+    int cmp;
+
+    if (node == 0)
+        return 0;
+
+    node_lock(node, l_write);
+    while ((cmp = strcmp(name, node->name)) != 0) {
+        next = (cmp < 0)? node->lchild: node->rchild;
+        if (next == 0) {
+            node_unlock(node);
+            return 0;
+        }
+        node_lock(next, l_write);
+        node_unlock(node);
+        node = next;
+    }
+    node_unlock(node);
+    return 1;
+}
+
+// Splits the subtree rooted at node around name (which must not be in it):
+// the nodes smaller than name become newnode's left subtree and the others
+// its right subtree. Only the nodes on the search path for name change;
+// each of them keeps its other subtree and is relinked onto newnode's left
+// or right spine. Those nodes are copied rather than changed, so the old
+// subtree stays intact for queries until newnode is published. The caller
+// must hold a write lock on node's parent until then, and afterwards retire
+// the old nodes with unzip_retire.
+static void unzip(char *name, node_t *node, node_t *newnode) {
+    node_t **ltail = &newnode->lchild;
+    node_t **rtail = &newnode->rchild;
+    node_t *copy;
+    node_t *next;
+
+    while (node != 0) {
+        // wait for any thread still working below this node
+        node_lock(node, l_write);
+        copy = node_copy(node);
+        if (strcmp(name, node->name) < 0) {
+            *rtail = copy;
+            rtail = &copy->lchild;
+            next = node->lchild;
+        } else {
+            *ltail = copy;
+            ltail = &copy->rchild;
+            next = node->rchild;
+        }
+        node_unlock(node);
+        node = next;
+    }
+    *ltail = 0;
+    *rtail = 0;
+}
+
+// Retires the nodes that unzip copied. Nobody can change them once they've
+// been copied, so this follows the same path.
+static void unzip_retire(char *name, node_t *node) {
+    node_t *next;
+
+    while (node != 0) {
+        next = *child_link(node, name);
+        epoch_retire(node, node_reclaim);
+        node = next;
+    }
+}
+
+// adds a new node into the tree
+static int tree_add(char *name, char *value) {
+    node_t *gparent = 0;  // parent's parent, locked while it's not 0
+    node_t *parent = partition_head(name);
+    node_t *next;
+    node_t **link;
+    node_t *newnode;
+
+    if ((newnode = node_constructor(name, value, 0, 0)) == 0)
+        return(0);
+
+    // Walk down with read locks until the next node on the path has a lower
+    // priority than the new node: parent is where the new node goes. We
+    // keep parent's parent locked too, so that parent can't be unlinked
+    // while we trade its read lock for a write lock. Only then is anything
+    // write-locked, so concurrent inserts only serialize on the node that
+    // actually changes.
+    node_lock(parent, l_read);
+    while (1) {
+        link = child_link(parent, name);
+        next = *link;
+        if (next == 0 || next->priority < newnode->priority) {
+            node_unlock(parent);
+            node_lock(parent, l_write);
+            if (gparent != 0) {
+                node_unlock(gparent);
+                gparent = 0;
+            }
+
+            // somebody may have added a child there in the meantime
+            link = child_link(parent, name);
+            next = *link;
+            if (next == 0 || next->priority < newnode->priority)
+                break;
+        }
+        node_lock(next, l_read);
+        if (strcmp(name, next->name) == 0) {
+            node_unlock(next);
+            node_unlock(parent);
+            if (gparent != 0)
+                node_unlock(gparent);
+            node_destructor(newnode);
+            return(0);
+        }
+        if (gparent != 0)
+            node_unlock(gparent);
+        gparent = parent;
+        parent = next;
+    }
+
+    // parent is write-locked and stays locked while we check the rest of
+    // the path and split it under the new node.
+    if (subtree_contains(name, next)) {
+        node_unlock(parent);
+        node_destructor(newnode);
+        return(0);
+    }
+
+    unzip(name, next, newnode);
+    publish(link, newnode);
+    node_unlock(parent);
+    unzip_retire(name, next);
+    return(1);
+}
+
+// Merges the subtrees left and right, where every name in left is smaller
+// than every name in right, and returns the result. The root with the
+// higher priority goes on top, so merging walks down the right spine of
+// left and the left spine of right. The nodes on those spines are copied
+// rather than changed, so the old subtrees stay intact for queries until
+// the result is published. The caller must hold a write lock on the common
+// parent of left and right, and on its parent, until then; afterwards it
+// must retire the old nodes with zip_retire.
+static node_t *zip(node_t *left, node_t *right) {
+    node_t *root;
+    node_t **link = &root;
+    node_t *copy;
+
+    while (left != 0 && right != 0) {
+        if (left->priority < right->priority) {
+            // wait for any thread still working below this node
+            node_lock(right, l_write);
+            copy = node_copy(right);
+            *link = copy;
+            link = &copy->lchild;
+            node_unlock(right);
+            right = copy->lchild;
+        } else {
+            node_lock(left, l_write);
+            copy = node_copy(left);
+            *link = copy;
+            link = &copy->rchild;
+            node_unlock(left);
+            left = copy->rchild;
+        }
+    }
+    *link = (left != 0)? left: right;
+    return root;
+}
+
+// Retires the nodes that zip copied. Nobody can change them once they've
+// been copied, so this makes the same choices zip did. Those choices also
+// look at the first node that wasn't copied, which is live again once the
+// result is published and could be removed meanwhile: the caller must have
+// been in an epoch critical section since before publishing.
+static void zip_retire(node_t *left, node_t *right) {
+    node_t *next;
+
+    while (left != 0 && right != 0) {
+        if (left->priority < right->priority) {
+            next = right->lchild;
+            epoch_retire(right, node_reclaim);
+            right = next;
+        } else {
+            next = left->rchild;
+            epoch_retire(left, node_reclaim);
+            left = next;
+        }
+    }
+}
+
+// removes a the input argument from the tree.
+static int tree_remove(char *name) {
+    node_t *head = partition_head(name);
+    node_t *parent;
+    node_t *dnode;
+
+    // first, find the node to be removed 
+    node_lock(head, l_write);
+    if ((dnode = search(name, head, &parent, l_write)) == 0) {
+        // it's not there
+        node_unlock(parent);
+        return(0);
+    }
+
+    // We found it; both it and its parent are write-locked. Replace it
+    // with the merge of its two subtrees. Nobody can be waiting for dnode's
+    // lock, since they'd have to be holding the parent's.
+    epoch_enter();
+    publish((parent->lchild == dnode)? &parent->lchild: &parent->rchild,
+        zip(dnode->lchild, dnode->rchild));
+    node_unlock(dnode);
+    node_unlock(parent);
+    zip_retire(dnode->lchild, dnode->rchild);
+    epoch_exit();
+    epoch_retire(dnode, node_reclaim);
+    return(1);
+}
+
+// Search the tree, starting at parent, for a node containing
+// name (the "target node").  Return a pointer to the node,
+// if found, otherwise return 0.  If parentpp is not 0, then it points
+// to a location at which the address of the parent of the target node
+// is stored.  If the target node is not found, the location pointed to
+// by parentpp is set to what would be the the address of the parent of
+// the target node, if it were there.
+//
+// The caller must have locked parent with lt. Nodes are locked
+// hand-over-hand on the way down; the target is returned locked, and
+// so is its parent if parentpp is not 0.
+node_t *search(char *name, node_t *parent, node_t **parentpp, enum locktype lt) {
+    node_t *next;
+
+    while ((next = *child_link(parent, name)) != 0) {
+        node_lock(next, lt);
+        if (strcmp(name, next->name) == 0)
+            break;
+        node_unlock(parent);
+        parent = next;
+    }
+
+    if (parentpp != 0) {
+        *parentpp = parent;
+    } else {
+        node_unlock(parent);
+    }
+    return next;
+}
+
+// Returns the node in the partition under head with the smallest name that
+// is not smaller than name, or greater than it if after is set; 0 if there is
+// none. The caller must be in an epoch critical section.
+static node_t *lower_bound(node_t *head, char *name, int after) {
+    node_t *node = load_child(child_link(head, name));
+    node_t *best = 0;
+    int cmp;
+
+    while (node != 0) {
+        cmp = strcmp(node->name, name);
+        if (cmp > 0 || (cmp == 0 && !after)) {
+            best = node;
+            node = load_child(&node->lchild);
+        } else {
+            node = load_child(&node->rchild);
+        }
+    }
+    return best;
+}
+
+// Visits the keys from start up to end in order. The partitions split the
+// keys by hash, so this merges them: it keeps the next key of every partition
+// and moves on from the smallest one with a fresh lower_bound, which is a
+// lock-free walk from the root like a query. A scan never holds up adds and
+// removes; it sees every key that is there for the whole scan.
+static void tree_scan(char *start, char *end, int (*visit)(void *, char *, char *), void *arg) {
+    node_t *next[DB_PARTITIONS];
+    int min;
+
+    epoch_enter();
+    for (int i = 0; i < DB_PARTITIONS; i++) {
+        next[i] = lower_bound(&partitions[i].head, start, 0);
+    }
+    while (1) {
+        min = -1;
+        for (int i = 0; i < DB_PARTITIONS; i++) {
+            if (next[i] != 0 && (min < 0 || strcmp(next[i]->name, next[min]->name) < 0))
+                min = i;
+        }
+        if (min < 0 || (end != 0 && strcmp(next[min]->name, end) >= 0))
+            break;
+        if (visit(arg, next[min]->name, next[min]->value))
+            break;
+        next[min] = lower_bound(&partitions[min].head, next[min]->name, 1);
+    }
+    epoch_exit();
+}
+
+#define TREE_LOADTASK 65536  // entries hashed by one loading task
+
+// Arguments of the loading tasks.
+typedef struct tree_load {
+    db_entry_t *entries;
+    size_t n;
+    unsigned char *part;  // the partition of every entry
+} tree_load_t;
+
+// works out the partitions of TREE_LOADTASK of the entries
+static void load_hash(void *arg, int task) {
+    tree_load_t *load = (tree_load_t *) arg;
+    size_t last = (size_t) (task + 1) * TREE_LOADTASK;
+
+    for (size_t e = (size_t) task * TREE_LOADTASK; e < last && e < load->n; e++) {
+        load->part[e] = (unsigned char) partition_index(load->entries[e].name);
+    }
+}
+
+// Builds the treap of one partition from its entries, in order. Each new
+// node is the largest key so far, so it goes on the right spine: it takes
+// over the part of the spine with lower priorities as its left subtree. The
+// spine is kept on a stack; every node is pushed and popped at most once.
+static void load_partition(void *arg, int p) {
+    tree_load_t *load = (tree_load_t *) arg;
+    size_t capacity = 64;
+    size_t depth = 0;
+    node_t **spine;
+    node_t *node;
+    node_t *last;
+
+    if ((spine = malloc(capacity * sizeof(node_t *))) == 0) {
+        perror("malloc");
+        exit(1);
+    }
+    for (size_t e = 0; e < load->n; e++) {
+        if (load->part[e] != p)
+            continue;
+        if ((node = node_constructor(load->entries[e].name, load->entries[e].value, 0, 0)) == 0) {
+            fprintf(stderr, "%s\n", "load: key too long");
+            exit(1);
+        }
+        for (last = 0; depth > 0 && spine[depth - 1]->priority < node->priority; ) {
+            last = spine[--depth];
+        }
+        node->lchild = last;
+        if (depth > 0)
+            spine[depth - 1]->rchild = node;
+        if (depth == capacity && (spine = realloc(spine, (capacity *= 2) * sizeof(node_t *))) == 0) {
+            perror("realloc");
+            exit(1);
+        }
+        spine[depth++] = node;
+    }
+    partitions[p].head.rchild = (depth > 0)? spine[0]: 0;
+    free(spine);
+}
+
+/* Builds every partition from sorted entries, without the locking and
+ * copying that adds go through: the entries are split by partition in
+ * parallel, and then each partition is built by its own task in linear time.
+ * The tree must be empty and nobody else may be using it. */
+static void tree_load(db_entry_t *entries, size_t n) {
+    tree_load_t load = {entries, n, 0};
+
+    if ((load.part = malloc(n + 1)) == 0) {
+        perror("malloc");
+        exit(1);
+    }
+    engine_parallel((int) ((n + TREE_LOADTASK - 1) / TREE_LOADTASK), load_hash, &load);
+    engine_parallel(DB_PARTITIONS, load_partition, &load);
+    free(load.part);
+}
+
+static inline void print_spaces(int lvl, FILE *out) {
+    for (int i = 0; i < lvl; i++) {
+        fprintf(out, " ");
+    }
+}
+
+/* Recursively traverses the database tree and prints nodes
+ * pre-order. */
+static void tree_print_recurs(node_t *node, int lvl, FILE *out) {
+    // print spaces to differentiate levels
+    print_spaces(lvl, out);
+
+    // print out the current node
+    if (node == NULL) {
+        fprintf(out, "(null)\n");
+        return;
+    }
+
+    fprintf(out, "%s %s\n", node->name, blob_value(node->value));
+
+    tree_print_recurs(load_child(&node->lchild), lvl + 1, out);
+    tree_print_recurs(load_child(&node->rchild), lvl + 1, out);
+}
+
+/* Prints every partition, in order, each one headed by its number. Like a
+ * query, this takes no locks, so the nodes it reaches are protected by an
+ * epoch critical section. */
+static void tree_print(FILE *out) {
+    epoch_enter();
+    for (int i = 0; i < DB_PARTITIONS; i++) {
+        fprintf(out, "(partition %d)\n", i);
+        tree_print_recurs(load_child(&partitions[i].head.lchild), 1, out);
+        tree_print_recurs(load_child(&partitions[i].head.rchild), 1, out);
+    }
+    epoch_exit();
+}
+
+/* Recursively destroys node and all its children. */
+static void tree_cleanup_recurs(node_t *node) {
+    if (node == NULL) {
+        return;
+    }
+
+    tree_cleanup_recurs(node->lchild);
+    tree_cleanup_recurs(node->rchild);
+
+    node_destructor(node);
+}
+
+/* Sets up the partition roots. */
+static void tree_init(void) {
+    for (int i = 0; i < DB_PARTITIONS; i++) {
+        node_t *head = &partitions[i].head;
+        head->name = "";
+        head->value = "";
+        head->lchild = 0;
+        head->rchild = 0;
+        head->priority = UINT_MAX;
+        pthread_rwlock_init(&head->lock, 0);
+    }
+}
+
+/* Destroys all nodes in the database other than the partition roots.
+ * No threads should be using the database when this is called. */
+static void tree_cleanup(void) {
+    for (int i = 0; i < DB_PARTITIONS; i++) {
+        node_t *head = &partitions[i].head;
+        tree_cleanup_recurs(head->lchild);
+        tree_cleanup_recurs(head->rchild);
+        head->lchild = 0;
+        head->rchild = 0;
+    }
+    epoch_barrier();
+    slab_release();
+}
+
+db_engine_t tree_engine = {
+    "tree",
+    tree_init,
+    tree_query,
+    tree_add,
+    tree_remove,
+    tree_scan,
+    tree_load,
+    tree_print,
+    tree_cleanup,
+    0, 0, 0  // batches run one key at a time
+};
@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include "./wal.h"
+
+/*
+ * Every record gets a log sequence number: the number of bytes appended
+ * before it ends. A thread remembers the sequence number of the last record
+ * it appended (wal_mark), and wal_sync waits until the log thread has made
+ * everything up to a sequence number durable. While the log thread is writing one buffer, records
+ * go into the other one, so appending never waits for the disk.
+ *
+ * A checkpoint rotates the log: it becomes the old log (the path with ".old"
+ * after it) and a new, empty one takes its place. The old log stays until the
+ * checkpoint's snapshot is on disk, and is replayed before the new one if it
+ * is still there when the database starts.
+ */
+
+#define WAL_RECORD 2048  // longest record but for those of long values
+
+typedef struct wal_buf {
+    char *data;
+    size_t len;
+    size_t capacity;
+} wal_buf_t;
+
+// Everything below is protected by wal_lock.
+static pthread_mutex_t wal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wal_work = PTHREAD_COND_INITIALIZER;  // for the log thread
+static pthread_cond_t wal_done = PTHREAD_COND_INITIALIZER;  // for wal_sync
+static wal_buf_t bufs[2];
+static wal_buf_t *pending = &bufs[0];  // records not written yet
+static int records;                    // in pending
+static struct timespec first;          // when the first of them came in
+static uint64_t appended;              // sequence number of the last record
+static uint64_t durable;               // everything up to here is on disk
+static int closing;
+static int rotating;                   // appends wait until it's done
+static pthread_cond_t wal_rotated = PTHREAD_COND_INITIALIZER;
+
+static int wal_fd = -1;
+static char wal_path[4096];
+static char old_path[4096 + 4];
+static int wal_interval;  // microseconds to wait for a batch to fill up
+static int wal_batch;     // records that make a batch
+static pthread_t wal_thread;
+static __thread uint64_t last_appended;
+
+static void *wal_loop(void *arg);
+
+// Reads the log at path, passing every whole record to replay, and returns
+// how many bytes of it hold whole records: a crash can leave the last record
+// half written. Returns 0 if there is no log yet.
+static off_t wal_replay(char *path, void (*replay)(char *record)) {
+    char *record = NULL;
+    size_t capacity = 0;
+    ssize_t len;
+    off_t good = 0;
+    FILE *in;
+
+    if ((in = fopen(path, "r")) == NULL)
+        return 0;
+    while ((len = getline(&record, &capacity, in)) > 0) {
+        if (record[len - 1] != '\n' || strlen(record) != (size_t) len)
+            break;
+        replay(record);
+        good += (off_t) len;
+    }
+    free(record);
+    fclose(in);
+    return good;
+}
+
+// makes a rename or a new file in the directory of path durable
+static int sync_dir(const char *path) {
+    char dir[4096];
+    int fd;
+    int ret;
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    if ((fd = open(dirname(dir), O_RDONLY)) < 0)
+        return -1;
+    ret = fsync(fd);
+    close(fd);
+    return ret;
+}
+
+// adds the time in microseconds to ts
+static void timespec_add(struct timespec *ts, int usec) {
+    ts->tv_nsec += (long) usec * 1000;
+    ts->tv_sec += ts->tv_nsec / 1000000000;
+    ts->tv_nsec %= 1000000000;
+}
+
+/* Replays the old log, if there is one, and the log at path through replay,
+ * drops any half-written record at the end of the log and starts the log
+ * thread, which writes out new records at the
+ * latest interval microseconds after the first one comes in, or as soon as
+ * batch of them have, or at once if interval is 0.
+ *
+ * Returns 0 on success, or -1 if the log could not be opened. */
+int wal_open(char *path, void (*replay)(char *record), int interval, int batch) {
+    off_t good;
+    int err;
+
+    snprintf(wal_path, sizeof(wal_path), "%s", path);
+    snprintf(old_path, sizeof(old_path), "%s.old", path);
+    wal_replay(old_path, replay);
+    good = wal_replay(path, replay);
+    if ((wal_fd = open(path, O_WRONLY | O_CREAT, 0644)) < 0)
+        return -1;
+    if (ftruncate(wal_fd, good) < 0 || lseek(wal_fd, good, SEEK_SET) < 0) {
+        close(wal_fd);
+        wal_fd = -1;
+        return -1;
+    }
+
+    wal_interval = interval;
+    wal_batch = (batch > 0)? batch: 1;
+    if ((err = pthread_create(&wal_thread, 0, wal_loop, NULL))) {
+        errno = err;
+        perror("pthread_create");
+        exit(1);
+    }
+    return 0;
+}
+
+/* Appends a record of len bytes, ending in a newline, to the log. It is on
+ * disk once wal_sync(wal_mark()) returns. Records that change the same key must be
+ * appended in the order the changes were made. */
+void wal_append(char *record, int len) {
+    pthread_mutex_lock(&wal_lock);
+    while (rotating) {
+        pthread_cond_wait(&wal_rotated, &wal_lock);
+    }
+    if (pending->len + len > pending->capacity) {
+        size_t capacity = (pending->capacity == 0)? 64 * WAL_RECORD: 2 * pending->capacity;
+        while (capacity < pending->len + len) {
+            capacity *= 2;
+        }
+        if ((pending->data = realloc(pending->data, capacity)) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        pending->capacity = capacity;
+    }
+    memcpy(pending->data + pending->len, record, len);
+    pending->len += len;
+    appended += len;
+    last_appended = appended;
+    if (records++ == 0) {
+        clock_gettime(CLOCK_REALTIME, &first);
+        pthread_cond_signal(&wal_work);
+    } else if (records == wal_batch) {
+        pthread_cond_signal(&wal_work);
+    }
+    pthread_mutex_unlock(&wal_lock);
+}
+
+/* Returns the sequence number of the last record the calling thread has
+ * appended. */
+uint64_t wal_mark(void) {
+    return last_appended;
+}
+
+/* Waits until every record up to the sequence number mark is on disk. */
+void wal_sync(uint64_t mark) {
+    if (__atomic_load_n(&durable, __ATOMIC_ACQUIRE) >= mark)
+        return;
+    pthread_mutex_lock(&wal_lock);
+    while (durable < mark) {
+        pthread_cond_wait(&wal_done, &wal_lock);
+    }
+    pthread_mutex_unlock(&wal_lock);
+}
+
+/* Turns the log into the old log and starts a new one, once everything
+ * appended so far is on disk; appends wait until this is done. Leaves the
+ * log as it is if there is an old log already, which means the last
+ * checkpoint did not finish: the next snapshot then covers both.
+ *
+ * Returns 0 if the log was rotated, 1 if there was an old log already, or -1
+ * if the new log could not be created. */
+int wal_rotate(void) {
+    int fd = -1;
+    int ret = 0;
+
+    if (access(old_path, F_OK) == 0)
+        return 1;
+    pthread_mutex_lock(&wal_lock);
+    rotating = 1;
+    while (durable < appended) {
+        pthread_cond_wait(&wal_done, &wal_lock);
+    }
+    // the log thread is waiting for records now, so wal_fd is free to swap
+    if (rename(wal_path, old_path) < 0) {
+        ret = -1;
+    } else if ((fd = open(wal_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0
+            || sync_dir(wal_path) < 0) {
+        if (fd >= 0)
+            close(fd);
+        rename(old_path, wal_path);
+        ret = -1;
+    } else {
+        close(wal_fd);
+        wal_fd = fd;
+    }
+    rotating = 0;
+    pthread_cond_broadcast(&wal_rotated);
+    pthread_mutex_unlock(&wal_lock);
+    return ret;
+}
+
+/* Removes the old log, once a snapshot has everything in it. */
+void wal_drop_old(void) {
+    if (unlink(old_path) == 0)
+        sync_dir(old_path);
+}
+
+// Code executed by the log thread: waits for records, lets a batch build up
+// if it's been told to, and writes the batch out while the next one builds.
+static void *wal_loop(void *arg) {
+    wal_buf_t *writing;
+    uint64_t upto;
+    struct timespec deadline;
+    (void) arg;
+
+    pthread_mutex_lock(&wal_lock);
+    while (1) {
+        while (records == 0 && !closing) {
+            pthread_cond_wait(&wal_work, &wal_lock);
+        }
+        if (records == 0)
+            break;
+        if (wal_interval > 0 && !closing) {
+            deadline = first;
+            timespec_add(&deadline, wal_interval);
+            while (records < wal_batch && !closing) {
+                if (pthread_cond_timedwait(&wal_work, &wal_lock, &deadline) == ETIMEDOUT)
+                    break;
+            }
+        }
+
+        writing = pending;
+        pending = (pending == &bufs[0])? &bufs[1]: &bufs[0];
+        records = 0;
+        upto = appended;
+        pthread_mutex_unlock(&wal_lock);
+
+        for (size_t done = 0; done < writing->len; ) {
+            ssize_t written = write(wal_fd, writing->data + done, writing->len - done);
+            if (written < 0 && errno != EINTR) {
+                perror("write");
+                exit(1);
+            }
+            if (written > 0)
+                done += written;
+        }
+        if (fdatasync(wal_fd) < 0) {
+            perror("fdatasync");
+            exit(1);
+        }
+        writing->len = 0;
+
+        pthread_mutex_lock(&wal_lock);
+        __atomic_store_n(&durable, upto, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&wal_done);
+    }
+    pthread_mutex_unlock(&wal_lock);
+    return NULL;
+}
+
+/* Writes out whatever is left, stops the log thread and closes the log.
+ * Nothing may be appended once this is called. */
+void wal_close(void) {
+    if (wal_fd < 0)
+        return;
+    pthread_mutex_lock(&wal_lock);
+    closing = 1;
+    pthread_cond_signal(&wal_work);
+    pthread_mutex_unlock(&wal_lock);
+    pthread_join(wal_thread, NULL);
+
+    close(wal_fd);
+    wal_fd = -1;
+    for (int i = 0; i < 2; i++) {
+        free(bufs[i].data);
+        bufs[i].data = NULL;
+        bufs[i].len = bufs[i].capacity = 0;
+    }
+    closing = 0;
+}
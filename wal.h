@@ -0,0 +1,22 @@
+#ifndef WAL_H_
+#define WAL_H_
+
+#include <stdint.h>
+
+/*
+ * A write-ahead log of the changes made to the database, one text record per
+ * line ("a name value" or "d name"). Records are appended to a buffer in
+ * memory; a log thread writes out everything that has built up with one
+ * write and one fdatasync (group commit), so concurrent writers share the
+ * cost of getting to disk instead of paying for a sync each.
+ */
+
+int wal_open(char *path, void (*replay)(char *record), int interval, int batch);
+void wal_append(char *record, int len);
+uint64_t wal_mark(void);
+void wal_sync(uint64_t mark);
+int wal_rotate(void);
+void wal_drop_old(void);
+void wal_close(void);
+
+#endif  // WAL_H_